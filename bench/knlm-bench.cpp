@@ -0,0 +1,315 @@
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include "KNLangModel.hpp"
+
+using namespace std;
+
+/*
+Benchmark of knlm on a synthetic corpus.
+The corpus is drawn from a Zipfian distribution with a fixed seed, so runs are reproducible without any external data.
+Results are printed as JSON lines, one object per (order, width).
+
+usage: knlm-bench [--tokens N] [--vocab N] [--zipf S] [--queries N] [--seed N] [--orders 2,3,4] [--widths 1,2,4] [--batch N] [--filter-bits N] [--sort-nodes 1] [--profile N] [--out file]
+The queries are scored one by one and again by evaluateLLSentBatch in batches of N sentences (64 by default).
+With --filter-bits, sentence scoring is measured again with Bloom filters of N bits per n-gram.
+With --sort-nodes, it is measured again after reorderNodes(), guided by a profile of N other sentences if --profile is given.
+*/
+
+struct Options
+{
+	size_t tokens = 1000000;
+	size_t vocab = 50000;
+	double zipf = 1.05;
+	size_t queries = 5000;
+	size_t seed = 42;
+	vector<size_t> orders = { 2, 3, 4, 5, 6 };
+	vector<size_t> widths = { 1, 2, 4 };
+	size_t batch = 64;
+	size_t filterBits = 0, sortNodes = 0, profile = 0;
+	string out;
+};
+
+class ZipfGenerator
+{
+	vector<double> cdf;
+public:
+	ZipfGenerator(size_t n, double s) : cdf(n)
+	{
+		double sum = 0;
+		for (size_t i = 0; i < n; ++i) cdf[i] = sum += 1 / pow(i + 1., s);
+		for (auto& c : cdf) c /= sum;
+	}
+
+	template<typename _Rng>
+	size_t operator()(_Rng& rng) const
+	{
+		double u = uniform_real_distribution<double>{}(rng);
+		return min((size_t)(upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()), cdf.size() - 1);
+	}
+};
+
+// a sentence of 5 to 30 words between ___BEG___ (1) and ___END___ (2). words start from id 3.
+template<typename _WType>
+vector<_WType> generateSentence(const ZipfGenerator& zipf, mt19937_64& rng)
+{
+	vector<_WType> sent;
+	size_t len = 5 + rng() % 26;
+	sent.emplace_back(1);
+	for (size_t i = 0; i < len; ++i) sent.emplace_back(3 + zipf(rng));
+	sent.emplace_back(2);
+	return sent;
+}
+
+class Timer
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+public:
+	double elapsed() const
+	{
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+};
+
+struct Latency
+{
+	double mean = 0, p50 = 0, p90 = 0, p99 = 0, max = 0;
+
+	Latency(vector<double> samples)
+	{
+		if (samples.empty()) return;
+		sort(samples.begin(), samples.end());
+		for (auto s : samples) mean += s;
+		mean /= samples.size();
+		auto at = [&](double q)
+		{
+			return samples[min((size_t)(q * samples.size()), samples.size() - 1)];
+		};
+		p50 = at(.5);
+		p90 = at(.9);
+		p99 = at(.99);
+		max = samples.back();
+	}
+
+	string toJson() const
+	{
+		ostringstream oss;
+		oss << "{\"mean_us\": " << mean * 1e6 << ", \"p50_us\": " << p50 * 1e6 << ", \"p90_us\": " << p90 * 1e6
+			<< ", \"p99_us\": " << p99 * 1e6 << ", \"max_us\": " << max * 1e6 << "}";
+		return oss.str();
+	}
+};
+
+template<typename _Fn>
+Latency measure(size_t n, _Fn&& fn)
+{
+	vector<double> samples;
+	samples.reserve(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		Timer t;
+		fn(i);
+		samples.emplace_back(t.elapsed());
+	}
+	return { move(samples) };
+}
+
+template<typename _WType>
+string runBench(const Options& opt, size_t order)
+{
+	size_t vocab = min(opt.vocab, (size_t)numeric_limits<_WType>::max() - 2);
+	ZipfGenerator zipf{ vocab, opt.zipf };
+	mt19937_64 rng{ opt.seed };
+	vector<vector<_WType>> corpus, queries;
+	size_t totalTokens = 0;
+	while (totalTokens < opt.tokens)
+	{
+		corpus.emplace_back(generateSentence<_WType>(zipf, rng));
+		totalTokens += corpus.back().size();
+	}
+	for (size_t i = 0; i < opt.queries; ++i) queries.emplace_back(generateSentence<_WType>(zipf, rng));
+	vector<vector<_WType>> profile;
+	for (size_t i = 0; i < opt.profile; ++i) profile.emplace_back(generateSentence<_WType>(zipf, rng));
+
+	knlm::KNLangModel<_WType> mdl{ order };
+	Timer trainTimer;
+	for (auto& s : corpus) mdl.trainSequence(s.data(), s.size());
+	double trainTime = trainTimer.elapsed();
+
+	Timer optimizeTimer;
+	mdl.optimize();
+	double optimizeTime = optimizeTimer.elapsed();
+
+	ostringstream oss;
+	Timer writeTimer;
+	mdl.writeToStream(move(oss));
+	double writeTime = writeTimer.elapsed();
+	string image = oss.str();
+
+	knlm::KNLangModel<_WType> loaded;
+	Timer readTimer;
+	loaded.readFromStream(istringstream{ image });
+	double readTime = readTimer.elapsed();
+
+	// the checksum only changes if the scores do. the other results are consumed by sink so they are not optimized out
+	float checksum = 0;
+	volatile float sink = 0;
+	Timer sentTimer;
+	Latency sent = measure(queries.size(), [&](size_t i)
+	{
+		checksum += mdl.evaluateLLSent(queries[i].data(), queries[i].size());
+	});
+	double sentTime = sentTimer.elapsed();
+
+	// the same queries in batches. the latency is of a whole batch, and the checksum is the same as above
+	vector<const _WType*> seqs;
+	vector<size_t> lens;
+	for (auto& q : queries)
+	{
+		seqs.emplace_back(q.data());
+		lens.emplace_back(q.size());
+	}
+	size_t batch = max(opt.batch, (size_t)1);
+	vector<float> scores(batch);
+	float batchChecksum = 0;
+	Timer batchTimer;
+	Latency sentBatch = measure((queries.size() + batch - 1) / batch, [&](size_t i)
+	{
+		size_t b = i * batch, n = min(batch, queries.size() - b);
+		mdl.evaluateLLSentBatch(seqs.data() + b, lens.data() + b, n, scores.data());
+		for (size_t j = 0; j < n; ++j) batchChecksum += scores[j];
+	});
+	double batchTime = batchTimer.elapsed();
+
+	// predictNext and branchingEntropy walk the whole vocabulary, so fewer of them are run
+	size_t numContexts = min(queries.size(), (size_t)200);
+	auto context = [&](size_t i, size_t& len)
+	{
+		len = min(queries[i].size(), order - 1);
+		return queries[i].data() + queries[i].size() - len;
+	};
+	Latency predict = measure(numContexts, [&](size_t i)
+	{
+		size_t len;
+		auto* c = context(i, len);
+		sink = mdl.predictNext(c, len)[3];
+	});
+	Latency entropy = measure(numContexts, [&](size_t i)
+	{
+		size_t len;
+		auto* c = context(i, len);
+		sink = mdl.branchingEntropy(c, len);
+	});
+
+	ostringstream filtered;
+	if (opt.filterBits)
+	{
+		Timer filterTimer;
+		mdl.setFilterBits(opt.filterBits);
+		double filterTime = filterTimer.elapsed();
+		size_t filterBytes = 0;
+		for (auto& l : mdl.getMemoryUsage().levels) filterBytes += l.filterBytes;
+		float filteredChecksum = 0;
+		Latency sentFiltered = measure(queries.size(), [&](size_t i)
+		{
+			filteredChecksum += mdl.evaluateLLSent(queries[i].data(), queries[i].size());
+		});
+		filtered << ", \"filter_bits\": " << opt.filterBits << ", \"filter_s\": " << filterTime << ", \"filter_bytes\": " << filterBytes
+			<< ", \"evaluate_sent_filtered\": " << sentFiltered.toJson() << ", \"checksum_filtered\": " << filteredChecksum;
+	}
+
+	// the model read back is reordered, so that the filters above are not rebuilt
+	ostringstream sorted;
+	if (opt.sortNodes)
+	{
+		// the file quantizes the model, so the copy is measured before and after reordering
+		float readChecksum = 0, sortedChecksum = 0;
+		Latency sentRead = measure(queries.size(), [&](size_t i)
+		{
+			readChecksum += loaded.evaluateLLSent(queries[i].data(), queries[i].size());
+		});
+		Timer sortTimer;
+		loaded.reorderNodes(profile);
+		double sortTime = sortTimer.elapsed();
+		Latency sentSorted = measure(queries.size(), [&](size_t i)
+		{
+			sortedChecksum += loaded.evaluateLLSent(queries[i].data(), queries[i].size());
+		});
+		sorted << ", \"profile\": " << profile.size() << ", \"sort_s\": " << sortTime
+			<< ", \"evaluate_sent_read\": " << sentRead.toJson() << ", \"checksum_read\": " << readChecksum
+			<< ", \"evaluate_sent_sorted\": " << sentSorted.toJson() << ", \"checksum_sorted\": " << sortedChecksum;
+	}
+
+	ostringstream ret;
+	ret << "{\"order\": " << order << ", \"width\": " << sizeof(_WType)
+		<< ", \"vocab\": " << vocab << ", \"tokens\": " << totalTokens << ", \"sentences\": " << corpus.size()
+		<< ", \"train_s\": " << trainTime << ", \"train_tokens_per_s\": " << totalTokens / trainTime
+		<< ", \"optimize_s\": " << optimizeTime
+		<< ", \"write_s\": " << writeTime << ", \"read_s\": " << readTime << ", \"model_bytes\": " << image.size()
+		<< ", \"evaluate_sent\": " << sent.toJson() << ", \"evaluate_sent_per_s\": " << queries.size() / sentTime
+		<< ", \"batch\": " << batch << ", \"evaluate_sent_batch\": " << sentBatch.toJson()
+		<< ", \"evaluate_sent_batch_per_s\": " << queries.size() / batchTime << ", \"checksum_batch\": " << batchChecksum
+		<< ", \"predict_next\": " << predict.toJson()
+		<< ", \"branching_entropy\": " << entropy.toJson() << filtered.str() << sorted.str()
+		<< ", \"checksum\": " << checksum << "}";
+	return ret.str();
+}
+
+vector<size_t> parseList(const string& s)
+{
+	vector<size_t> ret;
+	istringstream iss{ s };
+	string item;
+	while (getline(iss, item, ',')) ret.emplace_back(stoul(item));
+	return ret;
+}
+
+int main(int argc, char** argv)
+{
+	Options opt;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		string key = argv[i], value = argv[i + 1];
+		if (key == "--tokens") opt.tokens = stoul(value);
+		else if (key == "--vocab") opt.vocab = stoul(value);
+		else if (key == "--zipf") opt.zipf = stod(value);
+		else if (key == "--queries") opt.queries = stoul(value);
+		else if (key == "--seed") opt.seed = stoul(value);
+		else if (key == "--orders") opt.orders = parseList(value);
+		else if (key == "--widths") opt.widths = parseList(value);
+		else if (key == "--batch") opt.batch = stoul(value);
+		else if (key == "--filter-bits") opt.filterBits = stoul(value);
+		else if (key == "--sort-nodes") opt.sortNodes = stoul(value);
+		else if (key == "--profile") opt.profile = stoul(value);
+		else if (key == "--out") opt.out = value;
+		else
+		{
+			cerr << "unknown option " << key << endl;
+			return 1;
+		}
+	}
+
+	ofstream ofs;
+	if (!opt.out.empty()) ofs.open(opt.out);
+	ostream& os = opt.out.empty() ? cout : ofs;
+	for (auto width : opt.widths)
+	{
+		for (auto order : opt.orders)
+		{
+			switch (width)
+			{
+			case 1: os << runBench<uint8_t>(opt, order) << endl; break;
+			case 2: os << runBench<uint16_t>(opt, order) << endl; break;
+			case 4: os << runBench<uint32_t>(opt, order) << endl; break;
+			default: cerr << "width must be 1, 2 or 4" << endl; return 1;
+			}
+		}
+	}
+	return 0;
+}
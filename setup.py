@@ -14,8 +14,11 @@ for f in os.listdir(os.path.join(here, 'src')):
 
 if os.name == 'nt': cargs = ['/O2', '/MT', '/Gy']
 else: cargs = ['-std=c++11', '-O3', '-fpermissive']
+# set KNLM_STATS=1 to collect query statistics, see KneserNey.stats()
+macros = [('KNLM_STATS', None)] if os.environ.get('KNLM_STATS') else []
 modules = [Extension('knlm_c',
                     libraries = [],
+                    define_macros = macros,
                     sources = sources,
                     extra_compile_args=cargs)]
 
@@ -0,0 +1,600 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include "KNLangModel.hpp"
+
+/*
+Reading and writing models in the ARPA format of SRILM and KenLM.
+
+An n-gram of order k < N is the node of depth k, whose ll and gamma are its probability and backoff.
+An n-gram of order N is an entry in the leaf map of its (N-1)-gram prefix.
+Ids 0, 1 and 2 are written as <unk>, <s> and </s>. Log10 values of -99 or less are read as impossible (-inf) and -inf is written as -99.
+*/
+namespace knlm
+{
+	namespace arpa
+	{
+		static const double ln10 = 2.302585092994046;
+
+		// runs fn(tid) on numThreads threads, one of them the caller. the first exception thrown is rethrown after all threads end.
+		template<typename _Fn>
+		void parallelRun(size_t numThreads, _Fn&& fn)
+		{
+			exception_ptr error;
+			mutex errorLock;
+			auto run = [&](size_t tid)
+			{
+				try
+				{
+					fn(tid);
+				}
+				catch (...)
+				{
+					lock_guard<mutex> lock{ errorLock };
+					if (!error) error = current_exception();
+				}
+			};
+			vector<thread> workers;
+			for (size_t i = 1; i < numThreads; ++i) workers.emplace_back(run, i);
+			run(0);
+			for (auto& w : workers) w.join();
+			if (error) rethrow_exception(error);
+		}
+
+		// runs fn(tid, begin, end) over equal parts of [0, n) and returns the number of parts
+		template<typename _Fn>
+		size_t parallelFor(size_t n, size_t numThreads, _Fn&& fn)
+		{
+			numThreads = max(min(numThreads, n / 1024), (size_t)1);
+			parallelRun(numThreads, [&](size_t tid)
+			{
+				fn(tid, n * tid / numThreads, n * (tid + 1) / numThreads);
+			});
+			return numThreads;
+		}
+
+		// sorts parts of idx on each thread, then merges neighbouring parts in parallel
+		template<typename _Cmp>
+		void parallelSort(vector<size_t>& idx, _Cmp&& cmp, size_t numThreads)
+		{
+			size_t parts = max(min(numThreads, idx.size() / 4096), (size_t)1);
+			vector<size_t> bounds(parts + 1);
+			for (size_t i = 0; i <= parts; ++i) bounds[i] = idx.size() * i / parts;
+			parallelRun(parts, [&](size_t tid)
+			{
+				sort(idx.begin() + bounds[tid], idx.begin() + bounds[tid + 1], cmp);
+			});
+			for (size_t step = 1; step < parts; step *= 2)
+			{
+				size_t merges = (parts + step * 2 - 1) / (step * 2);
+				parallelRun(merges, [&](size_t tid)
+				{
+					size_t i = tid * step * 2;
+					if (i + step >= parts) return;
+					inplace_merge(idx.begin() + bounds[i], idx.begin() + bounds[i + step], idx.begin() + bounds[min(i + step * 2, parts)], cmp);
+				});
+			}
+		}
+
+		inline size_t defaultThreads(size_t numThreads)
+		{
+			if (numThreads) return numThreads;
+			return max((size_t)thread::hardware_concurrency(), (size_t)1);
+		}
+
+		inline bool isSpace(char c)
+		{
+			return c == ' ' || c == '\t' || c == '\r';
+		}
+
+		inline const char* skipSpace(const char* p, const char* end)
+		{
+			while (p < end && isSpace(*p)) ++p;
+			return p;
+		}
+
+		inline const char* skipToken(const char* p, const char* end)
+		{
+			while (p < end && !isSpace(*p)) ++p;
+			return p;
+		}
+
+		inline const char* nextLine(const char* p, const char* end)
+		{
+			auto* n = (const char*)memchr(p, '\n', end - p);
+			return n ? n + 1 : end;
+		}
+
+		inline float toLL(double logp)
+		{
+			return logp <= -99 ? -INFINITY : (float)(logp * ln10);
+		}
+
+		inline void appendLog10(string& out, float ll)
+		{
+			char buf[32];
+			snprintf(buf, sizeof(buf), "%.7g", isinf(ll) ? -99. : ll / ln10);
+			out += buf;
+		}
+
+		typedef pair<const char*, const char*> Range;
+
+		static const char* const specials[] = { "<unk>", "<s>", "</s>" };
+
+		// the id of <unk>, <s> or </s>, or Vocab::npos
+		inline size_t findSpecial(Range w)
+		{
+			for (size_t i = 0; i < 3; ++i)
+			{
+				if ((size_t)(w.second - w.first) == strlen(specials[i]) && !memcmp(w.first, specials[i], w.second - w.first)) return i;
+			}
+			return Vocab::npos;
+		}
+
+		// the body of each "\k-grams:" section indexed by k - 1, and the counts of \data\ if requested
+		inline vector<Range> findSections(const char* data, size_t size, vector<size_t>* counts = nullptr)
+		{
+			const char* end = data + size;
+			const char* p = data;
+			vector<size_t> c;
+			while (p < end && strncmp(p, "\\data\\", 6)) p = nextLine(p, end);
+			if (p == end) throw runtime_error{ "ARPA file has no \\data\\ section" };
+			for (p = nextLine(p, end); p < end; p = nextLine(p, end))
+			{
+				auto* q = skipSpace(p, end);
+				if (q == end || *q == '\n')
+				{
+					if (c.empty()) continue;
+					break;
+				}
+				auto* eq = (const char*)memchr(q, '=', nextLine(q, end) - q);
+				if (strncmp(q, "ngram ", 6) || !eq) break;
+				c.emplace_back(strtoull(eq + 1, nullptr, 10));
+			}
+			if (c.size() < 2) throw runtime_error{ "ARPA files of order less than 2 are not supported" };
+
+			vector<Range> sections(c.size());
+			for (size_t k = 1; k <= c.size(); ++k)
+			{
+				string head = "\\" + to_string(k) + "-grams:";
+				while (p < end && strncmp(p, head.c_str(), head.size())) p = nextLine(p, end);
+				if (p == end) throw runtime_error{ "ARPA file has no " + head + " section" };
+				p = nextLine(p, end);
+				// n-gram lines start with a number, so a backslash at the start of a line ends the section
+				const char* e = p;
+				while (e < end && *e != '\\') e = nextLine(e, end);
+				sections[k - 1] = make_pair(p, e);
+				p = e;
+			}
+			if (counts) counts->swap(c);
+			return sections;
+		}
+
+		// an upper bound of the vocabulary of the model read from the file
+		inline size_t readVocabSize(const char* data, size_t size)
+		{
+			vector<size_t> counts;
+			findSections(data, size, &counts);
+			// <unk>, <s> and </s> take their ids even if missing in the file
+			return counts[0] + 3;
+		}
+
+		// splits section into about n parts at line boundaries
+		inline vector<Range> splitLines(Range section, size_t n)
+		{
+			vector<Range> ret;
+			const char* p = section.first;
+			for (size_t i = 1; i <= n && p < section.second; ++i)
+			{
+				const char* e = i == n ? section.second : section.first + (section.second - section.first) * i / n;
+				if (e < p) continue;
+				e = nextLine(e, section.second);
+				ret.emplace_back(p, e);
+				p = e;
+			}
+			return ret;
+		}
+
+		// calls fn(part, ll, words, gamma) for each line "logp w1 ... wk [backoff]" of the parts on all threads
+		template<typename _Fn>
+		void forEachLine(const vector<Range>& parts, size_t k, size_t numThreads, _Fn&& fn)
+		{
+			atomic<size_t> next{ 0 };
+			parallelRun(min(numThreads, parts.size()), [&](size_t)
+			{
+				vector<Range> words(k);
+				for (size_t c; (c = next++) < parts.size();)
+				{
+					for (const char* p = parts[c].first, *lineEnd; p < parts[c].second; p = lineEnd)
+					{
+						lineEnd = nextLine(p, parts[c].second);
+						const char* end = lineEnd;
+						while (end > p && (end[-1] == '\n' || isSpace(end[-1]))) --end;
+						const char* line = p = skipSpace(p, end);
+						if (p == end) continue;
+						char* q;
+						double logp = strtod(p, &q);
+						p = q;
+						for (auto& w : words)
+						{
+							w.first = p = skipSpace(p, end);
+							w.second = p = skipToken(p, end);
+							if (w.first == w.second) throw runtime_error{ "ARPA " + to_string(k) + "-gram has too few words: " + string(line, end) };
+						}
+						p = skipSpace(p, end);
+						fn(c, toLL(logp), words.data(), p < end ? toLL(strtod(p, nullptr)) : 0.f);
+					}
+				}
+			});
+		}
+
+		// n-grams of order k, with the ids of each stored contiguously
+		template<typename _WType>
+		struct Grams
+		{
+			size_t k = 0;
+			vector<_WType> ids;
+			vector<float> lls, gammas;
+
+			size_t size() const { return lls.size(); }
+			const _WType* at(size_t i) const { return &ids[i * k]; }
+
+			void add(const _WType* key, float ll, float gamma)
+			{
+				ids.insert(ids.end(), key, key + k);
+				lls.emplace_back(ll);
+				gammas.emplace_back(gamma);
+			}
+
+			void append(const Grams& o)
+			{
+				ids.insert(ids.end(), o.ids.begin(), o.ids.end());
+				lls.insert(lls.end(), o.lls.begin(), o.lls.end());
+				gammas.insert(gammas.end(), o.gammas.begin(), o.gammas.end());
+			}
+
+			// the first position whose first len ids are not less than key
+			size_t lowerBound(const _WType* key, size_t len) const
+			{
+				size_t lo = 0, hi = size();
+				while (lo < hi)
+				{
+					size_t mid = (lo + hi) / 2;
+					if (lexicographical_compare(at(mid), at(mid) + len, key, key + len)) lo = mid + 1;
+					else hi = mid;
+				}
+				return lo;
+			}
+
+			// position of the k ids of key, or size() if missing
+			size_t find(const _WType* key) const
+			{
+				size_t i = lowerBound(key, k);
+				return i < size() && equal(key, key + k, at(i)) ? i : size();
+			}
+
+			void sort(size_t numThreads)
+			{
+				auto cmp = [&](size_t a, size_t b) { return lexicographical_compare(at(a), at(a) + k, at(b), at(b) + k); };
+				bool sorted = true;
+				for (size_t i = 1; i < size() && sorted; ++i) sorted = !cmp(i, i - 1);
+				if (sorted) return;
+
+				vector<size_t> idx(size());
+				for (size_t i = 0; i < idx.size(); ++i) idx[i] = i;
+				parallelSort(idx, cmp, numThreads);
+				Grams s;
+				s.k = k;
+				s.ids.reserve(ids.size());
+				s.lls.reserve(size());
+				s.gammas.reserve(size());
+				for (auto i : idx) s.add(at(i), lls[i], gammas[i]);
+				ids.swap(s.ids);
+				lls.swap(s.lls);
+				gammas.swap(s.gammas);
+			}
+		};
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::writeToArpa(ostream& os, size_t numThreads) const
+	{
+		using namespace arpa;
+		if (bakedNodes.empty()) throw runtime_error{ "only an optimized model can be written as ARPA" };
+		numThreads = defaultThreads(numThreads);
+		auto appendWord = [&](string& out, size_t w)
+		{
+			if (w < 3) out += specials[w];
+			else if (w < vocab.size()) out.append(vocab.data(w), vocab.length(w));
+			else throw runtime_error{ "no word for id " + to_string(w) };
+		};
+
+		vector<size_t> counts(orderN);
+		for (auto& node : bakedNodes)
+		{
+			if (node.depth) counts[node.depth - 1]++;
+			if (node.depth == orderN - 1) counts[orderN - 1] += node.next.size();
+		}
+		// ARPA readers expect <unk> among the 1-grams
+		bool addUnk = !bakedNodes[0].getNextFromBaked(getLevels(), 0);
+		if (addUnk) counts[0]++;
+
+		os << "\n\\data\\\n";
+		for (size_t k = 1; k <= orderN; ++k) os << "ngram " << k << "=" << counts[k - 1] << "\n";
+
+		// the subtree of each 1-gram is a task, in the order of ids
+		vector<pair<_WType, const BakedNode*>> firsts;
+		for (auto p : bakedNodes[0].next) firsts.emplace_back(p.first, levels[1] + p.second - 1);
+		sort(firsts.begin(), firsts.end());
+
+		size_t window = numThreads * 64;
+		vector<string> outs(window);
+		for (size_t k = 1; k <= orderN; ++k)
+		{
+			os << "\n\\" << k << "-grams:\n";
+			if (k == 1 && addUnk) os << "-99\t<unk>\n";
+
+			// a window of tasks is formatted in parallel, then written in order
+			for (size_t base = 0; base < firsts.size(); base += window)
+			{
+				size_t numTasks = min(window, firsts.size() - base);
+				atomic<size_t> next{ 0 };
+				parallelRun(min(numThreads, numTasks), [&](size_t)
+				{
+					vector<_WType> path;
+					auto writeGram = [&](string& out, float ll)
+					{
+						appendLog10(out, ll);
+						for (size_t i = 0; i < path.size(); ++i)
+						{
+							out += i ? ' ' : '\t';
+							appendWord(out, path[i]);
+						}
+					};
+					function<void(string&, const BakedNode*)> visit = [&](string& out, const BakedNode* node)
+					{
+						if (node->depth == k)
+						{
+							writeGram(out, node->ll);
+							if (k < orderN && node->gamma != 0)
+							{
+								out += '\t';
+								appendLog10(out, node->gamma);
+							}
+							out += '\n';
+							return;
+						}
+						for (auto p : node->next)
+						{
+							path.emplace_back(p.first);
+							if (node->depth == orderN - 1)
+							{
+								float ll;
+								memcpy(&ll, &p.second, sizeof(ll));
+								writeGram(out, ll);
+								out += '\n';
+							}
+							else visit(out, levels[node->depth + 1] + p.second - 1);
+							path.pop_back();
+						}
+					};
+					for (size_t t; (t = next++) < numTasks;)
+					{
+						outs[t].clear();
+						path.assign(1, firsts[base + t].first);
+						visit(outs[t], firsts[base + t].second);
+					}
+				});
+				for (size_t t = 0; t < numTasks; ++t) os << outs[t];
+			}
+		}
+		os << "\n\\end\\\n";
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::readFromArpa(const char* data, size_t size, size_t numThreads)
+	{
+		using namespace arpa;
+		numThreads = defaultThreads(numThreads);
+		auto sections = findSections(data, size);
+		size_t order = sections.size();
+		vector<Grams<_WType>> grams(order + 1);
+		for (size_t k = 1; k <= order; ++k) grams[k].k = k;
+
+		// ids of the 1-grams follow the order of the file, after the special words of Vocab
+		Vocab words;
+		auto findWord = [&](Range w)
+		{
+			size_t id = findSpecial(w);
+			return id == Vocab::npos ? words.find(w.first, w.second - w.first) : id;
+		};
+		{
+			auto parts = splitLines(sections[0], numThreads * 4);
+			vector<vector<Range>> unigrams(parts.size());
+			vector<Grams<_WType>> values(parts.size());
+			forEachLine(parts, 1, numThreads, [&](size_t c, float ll, const Range* w, float gamma)
+			{
+				unigrams[c].emplace_back(w[0]);
+				values[c].lls.emplace_back(ll);
+				values[c].gammas.emplace_back(gamma);
+			});
+			for (size_t c = 0; c < parts.size(); ++c)
+			{
+				grams[1].append(values[c]);
+				for (auto& w : unigrams[c])
+				{
+					size_t id = findSpecial(w);
+					if (id == Vocab::npos) id = words.add(w.first, w.second - w.first);
+					if (id > numeric_limits<_WType>::max()) throw runtime_error{ "the vocabulary does not fit in the width of word ids" };
+					grams[1].ids.emplace_back(id);
+				}
+			}
+		}
+
+		for (size_t k = 2; k <= order; ++k)
+		{
+			auto parts = splitLines(sections[k - 1], numThreads * 4);
+			vector<Grams<_WType>> values(parts.size(), grams[k]);
+			forEachLine(parts, k, numThreads, [&](size_t c, float ll, const Range* w, float gamma)
+			{
+				for (size_t i = 0; i < k; ++i)
+				{
+					size_t id = findWord(w[i]);
+					if (id == Vocab::npos) throw runtime_error{ "ARPA " + to_string(k) + "-gram has a word missing from the 1-grams: " + string{ w[i].first, w[i].second } };
+					values[c].ids.emplace_back(id);
+				}
+				values[c].lls.emplace_back(ll);
+				values[c].gammas.emplace_back(gamma);
+			});
+			for (auto& v : values) grams[k].append(v);
+		}
+		for (size_t k = 1; k <= order; ++k) grams[k].sort(numThreads);
+
+		// a 1-gram of probability zero in no other n-gram, such as the <unk> added by writeToArpa, is dropped.
+		// its word is then scored as unknown, instead of by the likelihood the model file clamps to -16.
+		{
+			vector<bool> used(words.size());
+			for (auto id : grams[2].ids) used[id] = true;
+			Grams<_WType> kept;
+			kept.k = 1;
+			for (size_t i = 0; i < grams[1].size(); ++i)
+			{
+				if (isinf(grams[1].lls[i]) && grams[1].gammas[i] == 0 && !used[*grams[1].at(i)]) continue;
+				kept.add(grams[1].at(i), grams[1].lls[i], grams[1].gammas[i]);
+			}
+			grams[1] = move(kept);
+		}
+
+		// the prefix of every n-gram and the suffix of every n-gram below order N must be nodes as well.
+		// well-formed files have them. otherwise they are added with ll marked NaN, to be filled in by backing off below.
+		for (size_t k = order; k >= 2; --k)
+		{
+			auto& cur = grams[k];
+			auto& prev = grams[k - 1];
+			vector<Grams<_WType>> missing(numThreads);
+			for (auto& m : missing) m.k = k - 1;
+			size_t parts = parallelFor(cur.size(), numThreads, [&](size_t tid, size_t b, size_t e)
+			{
+				for (size_t i = b; i < e; ++i)
+				{
+					if (prev.find(cur.at(i)) == prev.size()) missing[tid].add(cur.at(i), NAN, 0);
+					if (k < order && prev.find(cur.at(i) + 1) == prev.size()) missing[tid].add(cur.at(i) + 1, NAN, 0);
+				}
+			});
+			Grams<_WType> added;
+			added.k = k - 1;
+			for (size_t t = 0; t < parts; ++t) added.append(missing[t]);
+			if (!added.size()) continue;
+			added.sort(1);
+			for (size_t i = 0; i < added.size(); ++i)
+			{
+				if (i && equal(added.at(i), added.at(i) + k - 1, added.at(i - 1))) continue;
+				prev.add(added.at(i), NAN, 0);
+			}
+			prev.sort(numThreads);
+		}
+
+		// the root comes first, then the n-grams of each order below N in sorted order,
+		// so the children of a node are a contiguous range of the next order
+		vector<size_t> base(order + 1);
+		base[1] = 1;
+		for (size_t k = 2; k <= order; ++k) base[k] = base[k - 1] + grams[k - 1].size();
+		size_t numNodes = base[order];
+		for (size_t k = 1; k <= order; ++k)
+		{
+			if (grams[k].size() >= numeric_limits<uint32_t>::max()) throw runtime_error{ "too many " + to_string(k) + "-grams for 32-bit node indices" };
+		}
+
+		vector<vector<size_t>> childBegin(order);
+		childBegin[0] = { 0, grams[1].size() };
+		for (size_t k = 1; k < order; ++k)
+		{
+			auto& cb = childBegin[k];
+			cb.resize(grams[k].size() + 1);
+			cb.back() = grams[k + 1].size();
+			parallelFor(grams[k].size(), numThreads, [&](size_t, size_t b, size_t e)
+			{
+				for (size_t i = b; i < e; ++i) cb[i] = grams[k + 1].lowerBound(grams[k].at(i), k);
+			});
+		}
+
+		// calls fn(tid, k, i, idx) for the i-th n-gram of order k, whose node is bakedNodes[idx], on all threads
+		auto forEachNode = [&](const function<void(size_t, size_t, size_t, size_t)>& fn)
+		{
+			return parallelFor(numNodes, numThreads, [&](size_t tid, size_t b, size_t e)
+			{
+				for (size_t idx = b; idx < e; ++idx)
+				{
+					size_t k = upper_bound(base.begin() + 1, base.end(), idx) - base.begin() - 1;
+					fn(tid, k, k ? idx - base[k] : 0, idx);
+				}
+			});
+		};
+		auto children = [&](size_t k, size_t i, vector<pair<_WType, uint32_t>>& out)
+		{
+			out.clear();
+			auto& next = grams[k + 1];
+			for (size_t c = childBegin[k][i]; c < childBegin[k][i + 1]; ++c)
+			{
+				uint32_t v;
+				if (k + 1 == order) memcpy(&v, &next.lls[c], sizeof(v));
+				else v = (uint32_t)(c + 1);
+				out.emplace_back(next.at(c)[k], v);
+			}
+		};
+
+		// without counts every context weighs the same when choosing layouts
+		vector<LayoutCost> costs(numThreads, LayoutCost{ order });
+		size_t parts = forEachNode([&](size_t tid, size_t k, size_t i, size_t)
+		{
+			thread_local vector<pair<_WType, uint32_t>> pairs;
+			children(k, i, pairs);
+			costs[tid].add(k, pairs.begin(), pairs.end(), 1);
+		});
+		for (size_t t = 1; t < parts; ++t) costs[0] += costs[t];
+
+		vector<Node>{}.swap(nodes);
+		orderN = order;
+		vocabSize = words.size();
+		vocab = move(words);
+		layouts = costs[0].choose();
+		ViewableVector<BakedNode>(numNodes).swap(bakedNodes);
+		image.reset();
+		bakedNodes[0].gamma = -INFINITY;
+		forEachNode([&](size_t, size_t k, size_t i, size_t idx)
+		{
+			thread_local vector<pair<_WType, uint32_t>> pairs;
+			auto& node = bakedNodes[idx];
+			node.depth = k;
+			if (k)
+			{
+				node.ll = grams[k].lls[i];
+				node.gamma = grams[k].gammas[i];
+				node.lower = k == 1 ? 0 : grams[k - 1].find(grams[k].at(i) + 1);
+			}
+			children(k, i, pairs);
+			node.next = typename BakedNode::BakedNext{ pairs.begin(), pairs.end(), layouts[k] };
+		});
+		indexLevels();
+
+		// added n-grams take the probability of backing off from their prefix, shorter ones first
+		for (size_t k = 2; k < order; ++k)
+		{
+			for (size_t i = 0; i < grams[k].size(); ++i)
+			{
+				auto& node = bakedNodes[base[k] + i];
+				if (!isnan(node.ll)) continue;
+				auto& parent = bakedNodes[base[k - 1] + grams[k - 1].find(grams[k].at(i))];
+				node.ll = parent.gamma + parent.getLower(getLevels())->backoffLL(getLevels(), grams[k].at(i)[k - 1], orderN - 1);
+			}
+		}
+		markRedundant();
+	}
+}
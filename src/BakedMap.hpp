@@ -1,63 +1,159 @@
 #pragma once
 
 #include <map>
+#include <vector>
+#include <unordered_map>
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "Utils.hpp"
+#include "QueryStats.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define KNLM_USE_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
-#define USE_MIXED_VEC_MAP
+// Counts keys less than `key` in a short sorted array without branching on the data.
+template<class Key>
+inline size_t countLessThan(const Key* keys, size_t n, Key key)
+{
+	size_t cnt = 0;
+	for (size_t i = 0; i < n; ++i) cnt += keys[i] < key;
+	return cnt;
+}
 
-#ifdef USE_UNORDERED_MAP
-#include <unordered_map>
+#ifdef KNLM_USE_SSE2
+inline int popCount(uint32_t v)
+{
+#ifdef _MSC_VER
+	return __popcnt(v);
+#else
+	return __builtin_popcount(v);
+#endif
+}
 
-template<class Key, class Value>
-class BakedMap : public std::unordered_map<Key, Value>
+inline size_t countLessThan(const uint8_t* keys, size_t n, uint8_t key)
 {
-public:
-	using std::unordered_map<Key, Value>::unordered_map;
+	// SSE2 only has signed compares, so flip the sign bit of both sides
+	const __m128i bias = _mm_set1_epi8((char)0x80), k = _mm_xor_si128(_mm_set1_epi8((char)key), bias);
+	size_t cnt = 0, i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), bias);
+		cnt += popCount(_mm_movemask_epi8(_mm_cmplt_epi8(v, k)));
+	}
+	return cnt + countLessThan<uint8_t>(keys + i, n - i, key);
+}
 
-	Value operator[](const Key& key) const
+inline size_t countLessThan(const uint16_t* keys, size_t n, uint16_t key)
+{
+	const __m128i bias = _mm_set1_epi16((short)0x8000), k = _mm_xor_si128(_mm_set1_epi16((short)key), bias);
+	size_t cnt = 0, i = 0;
+	for (; i + 8 <= n; i += 8)
 	{
-		auto it = find(key);
-		if (it == end()) return {};
-		return it->second;
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), bias);
+		cnt += popCount(_mm_movemask_epi8(_mm_cmplt_epi16(v, k))) / 2;
+	}
+	return cnt + countLessThan<uint16_t>(keys + i, n - i, key);
+}
+
+inline size_t countLessThan(const uint32_t* keys, size_t n, uint32_t key)
+{
+	const __m128i bias = _mm_set1_epi32((int)0x80000000), k = _mm_xor_si128(_mm_set1_epi32((int)key), bias);
+	size_t cnt = 0, i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), bias);
+		cnt += popCount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(v, k))));
+	}
+	return cnt + countLessThan<uint32_t>(keys + i, n - i, key);
+}
+#endif
+
+/*
+Parameters deciding how a MixedBakedMap places its entries. They are chosen per depth of the trie at optimize() time
+and stored in the model file, so the same layout is rebuilt when the model is loaded.
+*/
+struct BakedMapLayout
+{
+	// key k goes to the dense part while k < denseFactor * (the number of keys before it) + denseBias. 0 disables the dense part
+	uint8_t denseFactor = 5, denseBias = 10;
+	// the sparse part is looked up through a hash table if its search index would need at least this many levels. 0 disables it
+	uint8_t hashLevels = 0;
+
+	BakedMapLayout(uint8_t _denseFactor = 5, uint8_t _denseBias = 10, uint8_t _hashLevels = 0)
+		: denseFactor(_denseFactor), denseBias(_denseBias), hashLevels(_hashLevels)
+	{
+	}
+
+	bool operator==(const BakedMapLayout& o) const
+	{
+		return denseFactor == o.denseFactor && denseBias == o.denseBias && hashLevels == o.hashLevels;
 	}
 };
-#elif defined(USE_MIXED_VEC_MAP)
 
+/*
+Every BakedMap policy provides
+	Map(begin, end, layout): builds from a range of (key, value) sorted by key
+	operator[](key): returns the value or Value{} if missing
+	prefetch(key), size(), begin(), end(): iteration in key order
+	needsSearch(key): whether looking key up reads more than one cache line of the map, which filters of missing keys may save
+	imageData(), imageBytes(), writeImageHeader(header, offset): writing to a model image, which only MixedBakedMap supports
+	candidateLayouts(): layouts to try at optimize() time
+	estimateCost(begin, end, layout, bytes): expected cache lines touched per lookup and the bytes used
+	bytesUsed(dense, sparse, overhead): heap bytes held by the map, apart from the map object itself
+*/
+
+/*
+Layout of elems:
+	Value vec[vecLength]: dense part, indexed by key directly
+	Value vals[length], Key keys[length]: sparse part sorted by key, with keys stored apart from values
+	then either
+	Key index[]: for maps longer than blockSize, the last key of every block of blockSize keys,
+		repeated level by level until one block covers the whole level.
+		A lookup scans one block per level with SIMD compare instead of branching on every probe of a binary search.
+	or, if hashed,
+	uint32_t table[]: open addressing table holding (position in keys + 1), 0 for an empty slot
+*/
 template<class Key, class Value>
-class BakedMap
+class MixedBakedMap
 {
 	typedef std::pair<const Key, Value> KVPair;
 public:
+	static constexpr size_t blockSize = 64 / sizeof(Key);
+
 	struct const_iterator
 	{
-		const KVPair* ptr = nullptr;
-		uint32_t vecLength = 0; 
-		Key cKey = 0;
+		const MixedBakedMap* home = nullptr;
+		size_t pos = 0;
 
-		const_iterator(const KVPair* _ptr = nullptr, 
-			uint32_t _vecLength = 0, Key _cKey = 0) 
-			: ptr(_ptr), vecLength(_vecLength), cKey(_cKey)
+		const_iterator(const MixedBakedMap* _home = nullptr, size_t _pos = 0)
+			: home(_home), pos(_pos)
 		{
+			skipEmpty();
+		}
+
+		// empty slots of the dense part are not entries
+		void skipEmpty()
+		{
+			while (home && pos < home->vecLength && home->getVec()[pos] == Value{}) ++pos;
 		}
 
 		const_iterator operator++()
 		{
-			if (vecLength)
-			{
-				--vecLength;
-				++cKey;
-				ptr = (const KVPair*)((Value*)ptr + 1);
-			}
-			else
-			{
-				++ptr;
-			}
+			++pos;
+			skipEmpty();
 			return *this;
 		}
 
 		bool operator==(const const_iterator& o) const
 		{
-			return ptr == o.ptr && vecLength == o.vecLength;
+			return pos == o.pos;
 		}
 
 		bool operator!=(const const_iterator& o) const
@@ -67,43 +163,136 @@ public:
 
 		KVPair operator*() const
 		{
-			if (vecLength) return std::make_pair(cKey, *(Value*)ptr);
-			return *ptr;
+			if (pos < home->vecLength) return KVPair((Key)pos, home->getVec()[pos]);
+			return KVPair(home->getKeys()[pos - home->vecLength], home->getVals()[pos - home->vecLength]);
 		}
 	};
 
 protected:
-	void* elems = nullptr;
-	uint32_t vecLength = 0, length = 0;
+	// elems is addressed relative to the map, so that maps and their elems can be mapped together from a model image at any address.
+	// 0 if the map is empty
+	ptrdiff_t elemsOffset = 0;
+	uint32_t vecLength = 0;
+	uint32_t length : 31;
+	uint32_t hashed : 1;
+
+	void* getElems() const
+	{
+		return elemsOffset ? (void*)((uintptr_t)this + elemsOffset) : nullptr;
+	}
+
+	void setElems(void* elems)
+	{
+		elemsOffset = elems ? (ptrdiff_t)((uintptr_t)elems - (uintptr_t)this) : 0;
+	}
 	
 	Value* getVec()
 	{
-		return (Value*)elems;
+		return (Value*)getElems();
 	}
 
 	const Value* getVec() const
 	{
-		return (const Value*)elems;
+		return (const Value*)getElems();
+	}
+
+	Value* getVals()
+	{
+		return getVec() + vecLength;
+	}
+
+	const Value* getVals() const
+	{
+		return getVec() + vecLength;
+	}
+
+	Key* getKeys()
+	{
+		return (Key*)(getVals() + length);
+	}
+
+	const Key* getKeys() const
+	{
+		return (const Key*)(getVals() + length);
+	}
+
+	Key* getIndex()
+	{
+		return getKeys() + length;
+	}
+
+	const Key* getIndex() const
+	{
+		return getKeys() + length;
+	}
+
+	uint32_t* getTable()
+	{
+		return (uint32_t*)(((size_t)(getKeys() + length) + 3) & ~(size_t)3);
+	}
+
+	const uint32_t* getTable() const
+	{
+		return (const uint32_t*)(((size_t)(getKeys() + length) + 3) & ~(size_t)3);
+	}
+
+	static size_t indexSize(size_t n)
+	{
+		size_t ret = 0;
+		while (n > blockSize)
+		{
+			n = (n + blockSize - 1) / blockSize;
+			ret += n;
+		}
+		return ret;
+	}
+
+	static size_t indexLevels(size_t n)
+	{
+		size_t ret = 0;
+		while (n > blockSize)
+		{
+			n = (n + blockSize - 1) / blockSize;
+			++ret;
+		}
+		return ret;
+	}
+
+	static size_t tableBits(size_t n)
+	{
+		size_t bits = 1;
+		while (((size_t)1 << bits) < n * 2) ++bits;
+		return bits;
 	}
 
-	std::pair<Key, Value>* getMap()
+	static uint32_t hashKey(Key key, size_t bits)
 	{
-		return (std::pair<Key, Value>*)((Value*)elems + vecLength);
+		return (uint32_t)((uint32_t)key * 2654435761u) >> (32 - bits);
 	}
 
-	const KVPair* getMap() const
+	static bool useHash(size_t n, const BakedMapLayout& layout)
 	{
-		return (const KVPair*)((const Value*)elems + vecLength);
+		return layout.hashLevels && indexLevels(n) >= layout.hashLevels;
 	}
 
+	static size_t bufferSize(size_t vecLength, size_t length, bool hashed)
+	{
+		size_t bytes = sizeof(Value) * (vecLength + length) + sizeof(Key) * length;
+		if (hashed) bytes = ((bytes + 3) & ~(size_t)3) + sizeof(uint32_t) * ((size_t)1 << tableBits(length));
+		else bytes += sizeof(Key) * indexSize(length);
+		return bytes;
+	}
+
+	// returns (the number of entries in the dense part, the length of the dense part)
 	template<class Input>
-	std::pair<size_t, size_t> countVecSize(Input begin, Input end) const
+	static std::pair<size_t, size_t> countVecSize(Input begin, Input end, const BakedMapLayout& layout)
 	{
+		if (!layout.denseFactor) return std::make_pair(0, 0);
 		size_t n = 0;
 		Key last = {};
 		for (; begin != end; ++begin, ++n)
 		{
-			if (begin->first >= 5 * n + 10) break;
+			if (begin->first >= layout.denseFactor * n + layout.denseBias) break;
 			last = begin->first;
 		}
 		if (begin != end)
@@ -113,106 +302,227 @@ protected:
 		}
 		return std::make_pair(n, last + 1);
 	}
-public:
-	BakedMap() {}
 
 	template<class Input>
-	BakedMap(Input begin, Input end, bool useMixed) : length(std::distance(begin, end))
+	void fill(Input begin, size_t numVec)
 	{
-		if (length)
+		setElems(operator new[](bufferSize(vecLength, length, hashed)));
+		std::fill_n(getVec(), vecLength, Value{});
+		for (size_t i = 0; i < numVec; ++i, ++begin) getVec()[begin->first] = begin->second;
+		for (size_t i = 0; i < length; ++i, ++begin)
 		{
-			auto vecInfo = countVecSize(begin, end);
-			vecLength = vecInfo.second;
-			length -= vecInfo.first;
-			elems = operator new[](sizeof(Value) * vecLength + sizeof(std::pair<Key, Value>) * length);
-			std::fill_n((Value*)elems, vecLength, Value{});
+			getKeys()[i] = begin->first;
+			getVals()[i] = begin->second;
+		}
 
-			for (size_t i = 0; begin != end; ++begin, ++i)
+		if (hashed)
+		{
+			size_t bits = tableBits(length), mask = ((size_t)1 << bits) - 1;
+			uint32_t* table = getTable();
+			std::fill_n(table, mask + 1, 0);
+			for (size_t i = 0; i < length; ++i)
 			{
-				if (i < vecInfo.first) getVec()[begin->first] = begin->second;
-				else getMap()[i - vecInfo.first] = *begin;
+				size_t h = hashKey(getKeys()[i], bits);
+				while (table[h]) h = (h + 1) & mask;
+				table[h] = i + 1;
 			}
+			return;
+		}
+
+		// levels of the index are stored bottom-up right after the keys
+		const Key* level = getKeys();
+		Key* index = getIndex();
+		for (size_t n = length; n > blockSize; )
+		{
+			size_t m = (n + blockSize - 1) / blockSize;
+			for (size_t i = 0; i < m; ++i) index[i] = level[std::min((i + 1) * blockSize, n) - 1];
+			level = index;
+			index += m;
+			n = m;
 		}
 	}
 
-	template<class Input>
-	BakedMap(Input begin, Input end) : length(std::distance(begin, end))
+	size_t findSparse(const Key& key) const
 	{
-		if (length)
+		const Key* keys = getKeys();
+		if (hashed)
 		{
-			vecLength = 0;
-			elems = operator new[](sizeof(std::pair<Key, Value>) * length);
-			for (size_t i = 0; begin != end; ++begin, ++i)
+			size_t bits = tableBits(length), mask = ((size_t)1 << bits) - 1;
+			const uint32_t* table = getTable();
+			for (size_t h = hashKey(key, bits); table[h]; h = (h + 1) & mask)
 			{
-				getMap()[i] = *begin;
+				if (keys[table[h] - 1] == key) return table[h] - 1;
 			}
+			return length;
 		}
+
+		size_t sizes[8], numLevels = 0;
+		for (size_t n = length; n > blockSize; ++numLevels)
+		{
+			n = (n + blockSize - 1) / blockSize;
+			sizes[numLevels] = n;
+		}
+
+		const Key* index = getIndex() + indexSize(length);
+		size_t block = 0;
+		for (size_t l = numLevels; l-- > 0; )
+		{
+			index -= sizes[l];
+			size_t b = block * blockSize;
+			block = b + countLessThan(index + b, std::min(sizes[l] - b, blockSize), key);
+			if (block == sizes[l]) return length;
+		}
+
+		size_t b = block * blockSize;
+		size_t i = b + countLessThan(keys + b, std::min(length - b, blockSize), key);
+		if (i == length || keys[i] != key) return length;
+		return i;
 	}
+public:
+	MixedBakedMap() : length(0), hashed(0) {}
 
-	BakedMap(BakedMap&& o)
+	template<class Input>
+	MixedBakedMap(Input begin, Input end, const BakedMapLayout& layout = {}) : length(0), hashed(0)
+	{
+		size_t total = std::distance(begin, end);
+		if (total)
+		{
+			auto vecInfo = countVecSize(begin, end, layout);
+			vecLength = vecInfo.second;
+			length = total - vecInfo.first;
+			hashed = useHash(length, layout);
+			fill(begin, vecInfo.first);
+		}
+	}
+
+	MixedBakedMap(MixedBakedMap&& o) : length(0), hashed(0)
 	{
 		swap(o);
 	}
 
-	~BakedMap()
+	~MixedBakedMap()
 	{
-		if (elems)
+		if (elemsOffset)
 		{
-			delete[] elems;
-			elems = nullptr;
+			operator delete[](getElems());
+			elemsOffset = 0;
 		}
 	}
 
-	BakedMap& operator= (BakedMap&& o)
+	MixedBakedMap& operator= (MixedBakedMap&& o)
 	{
 		swap(o);
 		return *this;
 	}
 
-	void swap(BakedMap& o)
+	void swap(MixedBakedMap& o)
 	{
-		std::swap(o.elems, elems);
-		std::swap(o.length, length);
+		void* elems = getElems();
+		setElems(o.getElems());
+		o.setElems(elems);
 		std::swap(o.vecLength, vecLength);
+		uint32_t t = o.length;
+		o.length = length;
+		length = t;
+		t = o.hashed;
+		o.hashed = hashed;
+		hashed = t;
 	}
 
 	Value operator[](const Key& key) const
 	{
 		if (key < vecLength)
 		{
+			KNLM_STAT(knlm::stats::local().denseHit());
 			return getVec()[key];
 		}
-		auto ret = std::lower_bound(getMap(), getMap() + length, key, [](const std::pair<Key, Value>& p, const Key& k)
-		{
-			return p.first < k;
-		});
-		if (ret == getMap() + length)  return {};
-		if (ret->first == key) return ret->second;
-		return {};
+		KNLM_STAT(knlm::stats::local().sparseSearch());
+		size_t i = findSparse(key);
+		if (i == length) return {};
+		return getVals()[i];
+	}
+
+	bool needsSearch(const Key& key) const
+	{
+		return key >= vecLength && (hashed || length > blockSize);
+	}
+
+	void prefetch(const Key& key) const
+	{
+		if (key < vecLength) prefetchRead(getVec() + key);
+		else if (hashed) prefetchRead(getTable() + hashKey(key, tableBits(length)));
+		else if (length > blockSize) prefetchRead(getIndex() + indexSize(length) - 1);
+		else if (length) prefetchRead(getKeys());
 	}
 
 	size_t size() const
 	{
-		return vecLength + length;
+		return vecLength - std::count(getVec(), getVec() + vecLength, Value{}) + length;
+	}
+
+	const_iterator begin() const { return { this, 0 }; }
+	const_iterator end() const { return { this, vecLength + length }; }
+
+	void bytesUsed(size_t& dense, size_t& sparse, size_t& overhead) const
+	{
+		size_t total = elemsOffset ? bufferSize(vecLength, length, hashed) : 0;
+		dense = sizeof(Value) * vecLength;
+		sparse = total - dense;
+		overhead = heapOverhead(total);
+	}
+
+	const void* imageData() const
+	{
+		return getElems();
+	}
+
+	size_t imageBytes() const
+	{
+		return elemsOffset ? bufferSize(vecLength, length, hashed) : 0;
 	}
 
-	const_iterator begin() const { return { (const KVPair*)getVec(), vecLength, 0 }; }
-	const_iterator end() const { return { getMap() + length, 0, 0 }; }
+	// copies the map to header, for a model image where imageData() is written offset bytes after the header.
+	// maps in an image only view it: they are never destroyed nor modified
+	void writeImageHeader(void* header, ptrdiff_t offset) const
+	{
+		std::memcpy(header, (const void*)this, sizeof(MixedBakedMap));
+		((MixedBakedMap*)header)->elemsOffset = elemsOffset ? offset : 0;
+	}
+
+	static std::vector<BakedMapLayout> candidateLayouts()
+	{
+		return { { 0, 0, 0 }, { 2, 10, 0 }, { 5, 10, 0 }, { 10, 10, 0 }, { 5, 10, 3 }, { 0, 0, 3 } };
+	}
+
+	template<class Input>
+	static float estimateCost(Input begin, Input end, const BakedMapLayout& layout, size_t& bytes)
+	{
+		size_t total = std::distance(begin, end);
+		bytes = sizeof(MixedBakedMap);
+		if (!total) return 0;
+		auto vecInfo = countVecSize(begin, end, layout);
+		size_t n = total - vecInfo.first;
+		bool h = useHash(n, layout);
+		bytes += bufferSize(vecInfo.second, n, h);
+		// a dense hit touches one line. a sparse hit touches one line per index level, the keys and the value
+		// or the table, the keys and the value if hashed.
+		float sparseCost = h ? 3 : indexLevels(n) + 2;
+		return (vecInfo.first + sparseCost * n) / total;
+	}
 };
 
-#else
 template<class Key, class Value>
-class BakedMap
+class SortedBakedMap
 {
 	typedef std::pair<const Key, Value>* iterator;
 protected:
 	std::pair<Key, Value>* elems = nullptr;
 	size_t length = 0;
 public:
-	BakedMap() {}
+	SortedBakedMap() {}
 
 	template<class Input>
-	BakedMap(Input begin, Input end) : length(std::distance(begin, end))
+	SortedBakedMap(Input begin, Input end, const BakedMapLayout& layout = {}) : length(std::distance(begin, end))
 	{
 		if (length)
 		{
@@ -227,12 +537,12 @@ public:
 		}
 	}
 
-	BakedMap(BakedMap&& o)
+	SortedBakedMap(SortedBakedMap&& o)
 	{
 		swap(o);
 	}
 
-	~BakedMap()
+	~SortedBakedMap()
 	{
 		if (elems)
 		{
@@ -241,13 +551,13 @@ public:
 		}
 	}
 
-	BakedMap& operator= (BakedMap&& o)
+	SortedBakedMap& operator= (SortedBakedMap&& o)
 	{
 		swap(o);
 		return *this;
 	}
 
-	void swap(BakedMap& o)
+	void swap(SortedBakedMap& o)
 	{
 		std::swap(o.elems, elems);
 		std::swap(o.length, length);
@@ -255,6 +565,7 @@ public:
 
 	Value operator[](const Key& key) const
 	{
+		KNLM_STAT(knlm::stats::local().sparseSearch());
 		auto ret = std::lower_bound(elems, elems + length, key, [](const std::pair<Key, Value>& p, const Key& k)
 		{
 			return p.first < k;
@@ -264,6 +575,16 @@ public:
 		return {};
 	}
 
+	bool needsSearch(const Key& key) const
+	{
+		return length * sizeof(std::pair<Key, Value>) > 64;
+	}
+
+	void prefetch(const Key& key) const
+	{
+		if (length) prefetchRead(elems + length / 2);
+	}
+
 	size_t size() const { return length; }
 
 	iterator begin() { return (iterator)elems; }
@@ -271,7 +592,111 @@ public:
 
 	const iterator begin() const { return (iterator)elems; }
 	const iterator end() const { return (iterator)elems + length; }
+
+	void bytesUsed(size_t& dense, size_t& sparse, size_t& overhead) const
+	{
+		dense = 0;
+		sparse = sizeof(std::pair<Key, Value>) * length;
+		overhead = heapOverhead(sparse);
+	}
+
+	const void* imageData() const
+	{
+		throw std::runtime_error{ "SortedBakedMap cannot be written to a model image" };
+	}
+
+	size_t imageBytes() const
+	{
+		throw std::runtime_error{ "SortedBakedMap cannot be written to a model image" };
+	}
+
+	void writeImageHeader(void* header, ptrdiff_t offset) const
+	{
+		throw std::runtime_error{ "SortedBakedMap cannot be written to a model image" };
+	}
+
+	static std::vector<BakedMapLayout> candidateLayouts()
+	{
+		return { {} };
+	}
+
+	template<class Input>
+	static float estimateCost(Input begin, Input end, const BakedMapLayout& layout, size_t& bytes)
+	{
+		size_t total = std::distance(begin, end);
+		bytes = sizeof(SortedBakedMap) + sizeof(std::pair<Key, Value>) * total;
+		float lines = 1;
+		for (size_t n = total * sizeof(std::pair<Key, Value>) / 64; n > 1; n /= 2) ++lines;
+		return lines;
+	}
 };
 
+template<class Key, class Value>
+class UnorderedBakedMap : public std::unordered_map<Key, Value>
+{
+	typedef std::unordered_map<Key, Value> Base;
+public:
+	UnorderedBakedMap() {}
+
+	template<class Input>
+	UnorderedBakedMap(Input begin, Input end, const BakedMapLayout& layout = {}) : Base(begin, end)
+	{
+	}
 
-#endif
+	Value operator[](const Key& key) const
+	{
+		KNLM_STAT(knlm::stats::local().sparseSearch());
+		auto it = this->find(key);
+		if (it == this->end()) return {};
+		return it->second;
+	}
+
+	bool needsSearch(const Key& key) const
+	{
+		return !this->empty();
+	}
+
+	void prefetch(const Key& key) const
+	{
+	}
+
+	void bytesUsed(size_t& dense, size_t& sparse, size_t& overhead) const
+	{
+		size_t node = sizeof(void*) * 2 + sizeof(std::pair<Key, Value>);
+		dense = 0;
+		sparse = this->size() * node + this->bucket_count() * sizeof(void*);
+		overhead = this->size() * heapOverhead(node) + heapOverhead(this->bucket_count() * sizeof(void*));
+	}
+
+	const void* imageData() const
+	{
+		throw std::runtime_error{ "UnorderedBakedMap cannot be written to a model image" };
+	}
+
+	size_t imageBytes() const
+	{
+		throw std::runtime_error{ "UnorderedBakedMap cannot be written to a model image" };
+	}
+
+	void writeImageHeader(void* header, ptrdiff_t offset) const
+	{
+		throw std::runtime_error{ "UnorderedBakedMap cannot be written to a model image" };
+	}
+
+	static std::vector<BakedMapLayout> candidateLayouts()
+	{
+		return { {} };
+	}
+
+	template<class Input>
+	static float estimateCost(Input begin, Input end, const BakedMapLayout& layout, size_t& bytes)
+	{
+		size_t total = std::distance(begin, end);
+		// a bucket array plus one node per entry
+		bytes = sizeof(UnorderedBakedMap) + total * (sizeof(void*) * 3 + sizeof(std::pair<Key, Value>));
+		return 2;
+	}
+};
+
+template<class Key, class Value>
+using BakedMap = MixedBakedMap<Key, Value>;
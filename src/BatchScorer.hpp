@@ -0,0 +1,191 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "KNLangModel.hpp"
+
+namespace knlm
+{
+	/*
+	Scores requests submitted one by one from many threads in micro-batches.
+	Workers take the queued requests when maxBatch of them are waiting or the oldest has waited maxDelay,
+	score the sentences of a batch together with evaluateLLSentBatch, and hand the whole batch to done().
+	Requests carry the model they are made on, so a model swapped in meanwhile only serves the requests made on it.
+	done() is called on the worker threads and must not throw.
+	*/
+	class BatchScorer
+	{
+	public:
+		struct Request
+		{
+			std::shared_ptr<const IModel> model;
+			// word ids of the model, beginning with the beginning of sentence. sentence scores need the end of sentence as well
+			std::vector<uint32_t> seq;
+			bool eachWord = false;
+			// given back with the result, to tell the requests apart
+			void* tag = nullptr;
+			// the score of the sentence, or of each word of seq if eachWord is set
+			float ll = 0;
+			std::vector<float> lls;
+			std::string error;
+			std::chrono::steady_clock::time_point arrival;
+		};
+
+		struct Stats
+		{
+			size_t queued = 0, maxQueued = 0, requests = 0, batches = 0;
+			// batchSizes[i] counts the batches of i + 1 requests
+			std::vector<size_t> batchSizes;
+		};
+
+		typedef std::function<void(std::vector<Request>&)> Done;
+
+	private:
+		Done done;
+		size_t maxBatch;
+		std::chrono::microseconds maxDelay;
+		float minValue;
+		mutable std::mutex lock; // guards the members below
+		std::condition_variable cond;
+		std::deque<Request> queue;
+		Stats stats;
+		bool stopping = false;
+		std::vector<std::thread> workers;
+
+		template<typename _WType>
+		void scoreWith(Request* reqs, size_t n)
+		{
+			auto* mdl = static_cast<const KNLangModel<_WType>*>(reqs[0].model.get());
+			std::vector<std::vector<_WType>> seqs;
+			std::vector<const _WType*> ptrs;
+			std::vector<size_t> lens;
+			std::vector<float> scores;
+			std::vector<Request*> sents;
+			for (size_t i = 0; i < n; ++i)
+			{
+				auto& r = reqs[i];
+				std::vector<_WType> seq{ r.seq.begin(), r.seq.end() };
+				if (r.eachWord) r.lls = mdl->evaluateLLEachWord(seq.data(), seq.size());
+				else
+				{
+					seqs.emplace_back(std::move(seq));
+					sents.emplace_back(&r);
+				}
+			}
+			for (auto& s : seqs)
+			{
+				ptrs.emplace_back(s.data());
+				lens.emplace_back(s.size());
+			}
+			scores.resize(seqs.size());
+			mdl->evaluateLLSentBatch(ptrs.data(), lens.data(), seqs.size(), scores.data(), minValue);
+			for (size_t i = 0; i < sents.size(); ++i) sents[i]->ll = scores[i];
+		}
+
+		void score(std::vector<Request>& batch)
+		{
+			// consecutive requests on the same model are scored together
+			for (size_t b = 0, e; b < batch.size(); b = e)
+			{
+				for (e = b + 1; e < batch.size() && batch[e].model == batch[b].model; ++e);
+				try
+				{
+					switch (batch[b].model->getWordSize())
+					{
+					case 1: scoreWith<uint8_t>(&batch[b], e - b); break;
+					case 2: scoreWith<uint16_t>(&batch[b], e - b); break;
+					case 4: scoreWith<uint32_t>(&batch[b], e - b); break;
+					}
+				}
+				catch (const std::exception& ex)
+				{
+					for (size_t i = b; i < e; ++i) batch[i].error = ex.what();
+				}
+			}
+		}
+
+		void work()
+		{
+			std::vector<Request> batch;
+			std::unique_lock<std::mutex> guard{ lock };
+			while (true)
+			{
+				cond.wait(guard, [&]() { return stopping || !queue.empty(); });
+				if (queue.empty()) return;
+				// a batch waits to fill up until the deadline of its oldest request, except when stopping.
+				// another worker may take the oldest meanwhile, and then the next one sets the deadline
+				auto deadline = queue.front().arrival + maxDelay;
+				cond.wait_until(guard, deadline, [&]() { return stopping || queue.size() >= maxBatch; });
+				if (queue.empty()) continue;
+				if (!stopping && queue.size() < maxBatch && queue.front().arrival + maxDelay > std::chrono::steady_clock::now()) continue;
+
+				size_t n = std::min(queue.size(), maxBatch);
+				batch.clear();
+				for (size_t i = 0; i < n; ++i)
+				{
+					batch.emplace_back(std::move(queue.front()));
+					queue.pop_front();
+				}
+				stats.queued = queue.size();
+				stats.batches++;
+				stats.batchSizes[n - 1]++;
+				guard.unlock();
+
+				score(batch);
+				done(batch);
+				guard.lock();
+			}
+		}
+
+	public:
+		BatchScorer(Done _done, size_t _maxBatch = 64, std::chrono::microseconds _maxDelay = std::chrono::microseconds{ 1000 },
+			size_t numWorkers = 1, float _minValue = -100.f)
+			: done(std::move(_done)), maxBatch(std::max(_maxBatch, (size_t)1)), maxDelay(_maxDelay), minValue(_minValue)
+		{
+			stats.batchSizes.resize(maxBatch);
+			for (size_t i = 0; i < std::max(numWorkers, (size_t)1); ++i) workers.emplace_back(&BatchScorer::work, this);
+		}
+
+		BatchScorer(const BatchScorer&) = delete;
+		BatchScorer& operator=(const BatchScorer&) = delete;
+
+		// the requests queued so far are scored and handed to done() before the workers stop
+		~BatchScorer()
+		{
+			{
+				std::lock_guard<std::mutex> guard{ lock };
+				stopping = true;
+			}
+			cond.notify_all();
+			for (auto& w : workers) w.join();
+		}
+
+		void submit(Request req)
+		{
+			if (!req.model || !req.model->isOptimized()) throw std::invalid_argument{ "requests must be made on an optimized model" };
+			req.arrival = std::chrono::steady_clock::now();
+			{
+				std::lock_guard<std::mutex> guard{ lock };
+				if (stopping) throw std::runtime_error{ "the scorer is stopping" };
+				queue.emplace_back(std::move(req));
+				stats.requests++;
+				stats.queued = queue.size();
+				stats.maxQueued = std::max(stats.maxQueued, stats.queued);
+			}
+			cond.notify_one();
+		}
+
+		Stats getStats() const
+		{
+			std::lock_guard<std::mutex> guard{ lock };
+			return stats;
+		}
+	};
+}
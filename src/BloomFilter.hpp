@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "Utils.hpp"
+
+namespace knlm
+{
+	/*
+	Split block Bloom filter. A key sets one bit in each of the eight words of a 32-byte block chosen by its hash,
+	so a query reads a single cache line and never misses a key inserted. With 10 bits per key,
+	about 1 % of the keys never inserted are still reported as present.
+	*/
+	class BloomFilter
+	{
+		static const size_t blockWords = 8;
+		std::vector<uint32_t> words;
+		// blocks start at words[offset], aligned to 32 bytes where the allocation allows it
+		size_t offset = 0, numBlocks = 0;
+
+		static uint64_t mix(uint64_t h)
+		{
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdull;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ull;
+			h ^= h >> 33;
+			return h;
+		}
+
+		const uint32_t* block(uint64_t h) const
+		{
+			return words.data() + offset + (size_t)(((h >> 32) * numBlocks) >> 32) * blockWords;
+		}
+
+		static uint32_t bit(uint64_t h, size_t i)
+		{
+			static const uint32_t salts[blockWords] = { 0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+				0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u };
+			return (uint32_t)1 << (((uint32_t)h * salts[i]) >> 27);
+		}
+
+	public:
+		BloomFilter()
+		{
+		}
+
+		BloomFilter(size_t numKeys, size_t bitsPerKey)
+		{
+			numBlocks = (numKeys * bitsPerKey + blockWords * 32 - 1) / (blockWords * 32);
+			if (!numBlocks) numBlocks = 1;
+			words.resize(numBlocks * blockWords + blockWords - 1);
+			offset = ((32 - (size_t)words.data() % 32) % 32) / sizeof(uint32_t);
+		}
+
+		void insert(uint64_t key)
+		{
+			uint64_t h = mix(key);
+			auto* b = const_cast<uint32_t*>(block(h));
+			for (size_t i = 0; i < blockWords; ++i) b[i] |= bit(h, i);
+		}
+
+		bool mayContain(uint64_t key) const
+		{
+			uint64_t h = mix(key);
+			auto* b = block(h);
+			uint32_t missing = 0;
+			for (size_t i = 0; i < blockWords; ++i) missing |= ~b[i] & bit(h, i);
+			return !missing;
+		}
+
+		void prefetch(uint64_t key) const
+		{
+			prefetchRead(block(mix(key)));
+		}
+
+		bool empty() const { return !numBlocks; }
+		size_t bytesUsed() const { return words.size() * sizeof(uint32_t); }
+	};
+}
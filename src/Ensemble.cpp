@@ -0,0 +1,106 @@
+#include "Ensemble.hpp"
+
+namespace knlm
+{
+	template<typename _WType>
+	static void bindSteps(const IModel& model, function<const void*()>& init, function<const void*(const void*, uint32_t, float&)>& step)
+	{
+		using Model = KNLangModel<_WType>;
+		auto* m = static_cast<const Model*>(&model);
+		init = [m]() -> const void*
+		{
+			return m->getInitState();
+		};
+		step = [m](const void* state, uint32_t n, float& ll) -> const void*
+		{
+			return m->scoreNext((const typename Model::BakedNode*)state, n, ll);
+		};
+	}
+
+	Ensemble::Ensemble(const vector<shared_ptr<const IModel>>& models, const vector<float>& weights)
+	{
+		if (models.empty() || models.size() != weights.size()) throw invalid_argument{ "a weight is needed for each model" };
+		float total = 0;
+		for (auto w : weights)
+		{
+			if (!(w >= 0)) throw invalid_argument{ "weights must not be negative" };
+			total += w;
+		}
+		if (!(total > 0)) throw invalid_argument{ "weights must not all be zero" };
+
+		members.resize(models.size());
+		for (size_t i = 0; i < models.size(); ++i)
+		{
+			auto& m = members[i];
+			m.model = models[i];
+			if (!m.model || !m.model->isOptimized()) throw invalid_argument{ "the models must be optimized" };
+			m.logWeight = log(weights[i] / total);
+			switch (m.model->getWordSize())
+			{
+			case 1: bindSteps<uint8_t>(*m.model, m.init, m.step); break;
+			case 2: bindSteps<uint16_t>(*m.model, m.init, m.step); break;
+			case 4: bindSteps<uint32_t>(*m.model, m.init, m.step); break;
+			}
+
+			// the special words come first in every vocabulary, so they keep their ids
+			auto& v = m.model->getVocab();
+			m.ids = { 0, 1, 2 };
+			for (size_t id = 3; id < v.size(); ++id)
+			{
+				size_t shared = vocab.add(v.data(id), v.length(id));
+				if (shared >= m.ids.size()) m.ids.resize(shared + 1, 0);
+				m.ids[shared] = id;
+			}
+		}
+		for (auto& m : members) m.ids.resize(vocab.size(), 0);
+	}
+
+	template<typename _Fn>
+	void Ensemble::walk(const uint32_t* seq, size_t len, _Fn&& fn) const
+	{
+		vector<const void*> states(members.size());
+		vector<float> lls(members.size());
+		for (size_t m = 0; m < members.size(); ++m) states[m] = members[m].init();
+		for (size_t i = 0; i < len; ++i)
+		{
+			// log of the weighted sum of probabilities, scaled by the largest term
+			float maxLL = -INFINITY;
+			for (size_t m = 0; m < members.size(); ++m)
+			{
+				auto& mb = members[m];
+				uint32_t n = seq[i] < mb.ids.size() ? mb.ids[seq[i]] : 0;
+				states[m] = mb.step(states[m], n, lls[m]);
+				lls[m] += mb.logWeight;
+				maxLL = max(maxLL, lls[m]);
+			}
+			if (isinf(maxLL))
+			{
+				fn(i, maxLL);
+				continue;
+			}
+			float sum = 0;
+			for (auto ll : lls) sum += exp(ll - maxLL);
+			fn(i, maxLL + log(sum));
+		}
+	}
+
+	float Ensemble::evaluateLLSent(const uint32_t* seq, size_t len, float minValue) const
+	{
+		float score = 0;
+		walk(seq, len, [&](size_t i, float ll)
+		{
+			if (i) score += max(ll, minValue);
+		});
+		return score;
+	}
+
+	vector<float> Ensemble::evaluateLLEachWord(const uint32_t* seq, size_t len) const
+	{
+		vector<float> score;
+		walk(seq, len, [&](size_t, float ll)
+		{
+			score.emplace_back(ll);
+		});
+		return score;
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "KNLangModel.hpp"
+
+namespace knlm
+{
+	/*
+	Linear interpolation of optimized models, which may differ in order and in the width of word ids.
+	Words are given once in ids of a vocabulary shared by all the models, the union of theirs,
+	and each word moves the context of every model before the next word is read.
+	A word unknown to a model is its ___UNK___, so only the other models give it probability.
+	The models are shared with their owners and are not changed.
+	*/
+	class Ensemble
+	{
+		struct Member
+		{
+			shared_ptr<const IModel> model;
+			float logWeight = 0;
+			// the id in the model of each shared id
+			vector<uint32_t> ids;
+			// the state before the first word, and a step returning the likelihood and the next state
+			function<const void*()> init;
+			function<const void*(const void*, uint32_t, float&)> step;
+		};
+		vector<Member> members;
+		Vocab vocab;
+
+		// calls fn(i, ll) for each word of seq
+		template<typename _Fn> void walk(const uint32_t* seq, size_t len, _Fn&& fn) const;
+	public:
+		// weights are normalized to sum to 1
+		Ensemble(const vector<shared_ptr<const IModel>>& models, const vector<float>& weights);
+
+		size_t size() const { return members.size(); }
+		const Vocab& getVocab() const { return vocab; }
+		const IModel& getModel(size_t i) const { return *members[i].model; }
+		float getWeight(size_t i) const { return exp(members[i].logWeight); }
+
+		float evaluateLLSent(const uint32_t* seq, size_t len, float minValue = -100.f) const;
+		vector<float> evaluateLLEachWord(const uint32_t* seq, size_t len) const;
+	};
+}
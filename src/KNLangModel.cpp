@@ -0,0 +1,119 @@
+#include <cstdio>
+#include <atomic>
+#include <fstream>
+#include "Arpa.hpp"
+
+namespace knlm
+{
+	void writeNegFixed16(ostream& os, float v)
+	{
+		assert(v <= 0);
+		auto dv = (uint16_t)min(-v * (1 << 12), 65535.f);
+		writeToBinStream(os, dv);
+	}
+
+	float readNegFixed16(istream& is)
+	{
+		auto dv = readFromBinStream<uint16_t>(is);
+		return -(dv / float(1 << 12));
+	}
+
+	size_t readWordSize(istream& is)
+	{
+		auto pos = is.tellg();
+		uint32_t head = readFromBinStream<uint32_t>(is);
+		if (head == modelMagic || head == levelModelMagic || head == offsetModelMagic) head = readFromBinStream<uint32_t>(is);
+		is.seekg(pos);
+		return head;
+	}
+
+	unique_ptr<IModel> createModel(size_t wordSize, size_t order)
+	{
+		switch (wordSize)
+		{
+		case 1: return unique_ptr<IModel>{ new KNLangModel<uint8_t>{ order } };
+		case 2: return unique_ptr<IModel>{ new KNLangModel<uint16_t>{ order } };
+		case 4: return unique_ptr<IModel>{ new KNLangModel<uint32_t>{ order } };
+		default: throw runtime_error{ "wordSize must be 1, 2 or 4" };
+		}
+	}
+
+	unique_ptr<IModel> readModel(istream&& is, size_t maxOrder)
+	{
+		is.exceptions(istream::failbit | istream::badbit);
+		auto mdl = createModel(readWordSize(is));
+		mdl->readFromStream(move(is), maxOrder);
+		return mdl;
+	}
+
+	unique_ptr<IModel> mapModel(const string& path)
+	{
+		auto file = make_shared<const MappedFile>(path);
+		ImageHeader head;
+		if (file->size() < sizeof(ImageHeader)) throw runtime_error{ path + " is not a model image" };
+		memcpy(&head, file->data(), sizeof(ImageHeader));
+		auto mdl = createModel(head.wordSize);
+		mdl->viewImage(move(file));
+		return mdl;
+	}
+
+	shared_ptr<IModel> withFilterBits(shared_ptr<const IModel> mdl, size_t bitsPerKey)
+	{
+		switch (mdl->getWordSize())
+		{
+		case 1: return KNLangModel<uint8_t>::withFilterBits(static_pointer_cast<const KNLangModel<uint8_t>>(mdl), bitsPerKey);
+		case 2: return KNLangModel<uint16_t>::withFilterBits(static_pointer_cast<const KNLangModel<uint16_t>>(mdl), bitsPerKey);
+		default: return KNLangModel<uint32_t>::withFilterBits(static_pointer_cast<const KNLangModel<uint32_t>>(mdl), bitsPerKey);
+		}
+	}
+
+	void writeImageFile(const IModel& mdl, const string& path)
+	{
+		static atomic<size_t> counter{ 0 };
+#ifdef _WIN32
+		string tmp = path + ".tmp" + to_string(GetCurrentProcessId()) + "." + to_string(counter++);
+#else
+		string tmp = path + ".tmp" + to_string(getpid()) + "." + to_string(counter++);
+#endif
+		try
+		{
+			{
+				ofstream ofs{ tmp, ios_base::binary };
+				if (!ofs) throw runtime_error{ "cannot write " + path };
+				mdl.writeImage(move(ofs));
+				// a short write, such as on a full disk, must not replace a good image
+				ofs.close();
+				if (!ofs) throw runtime_error{ "cannot write " + path };
+			}
+#ifdef _WIN32
+			if (!MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) throw runtime_error{ "cannot replace " + path };
+#else
+			if (rename(tmp.c_str(), path.c_str())) throw runtime_error{ "cannot replace " + path };
+#endif
+		}
+		catch (const exception&)
+		{
+			remove(tmp.c_str());
+			throw;
+		}
+	}
+
+	bool isModelImage(const string& path)
+	{
+		ifstream ifs{ path, ios_base::binary };
+		uint32_t magic = 0;
+		return ifs.read((char*)&magic, sizeof(magic)) && magic == imageMagic;
+	}
+
+	unique_ptr<IModel> loadModel(const string& path, size_t maxOrder)
+	{
+		if (isModelImage(path)) return mapModel(path);
+		ifstream ifs{ path, ios_base::binary };
+		if (!ifs) throw runtime_error{ "cannot read " + path };
+		return readModel(move(ifs), maxOrder);
+	}
+
+	template class KNLangModel<uint8_t>;
+	template class KNLangModel<uint16_t>;
+	template class KNLangModel<uint32_t>;
+}
@@ -5,31 +5,131 @@
 #include <functional>
 #include <iostream>
 #include <cassert>
+#include <cmath>
+#include <unordered_map>
+#include <string>
+#include <memory>
+#include <numeric>
 #include "Utils.hpp"
 #include "BakedMap.hpp"
+#include "BloomFilter.hpp"
+#include "Vocab.hpp"
+#include "MappedFile.hpp"
 
 namespace knlm
 {
 	using namespace std;
 
+	// bytes held by a model, by the depth of nodes (the length of their context)
+	struct MemoryUsage
+	{
+		struct Level
+		{
+			// filterBytes are of the filter of the n-grams following the nodes, if built
+			size_t nodes = 0, nodeBytes = 0, denseBytes = 0, sparseBytes = 0, overheadBytes = 0, filterBytes = 0;
+		};
+		vector<Level> levels;
+		size_t slackBytes = 0; // reserved but unused capacity of the node array
+		size_t vocabBytes = 0;
+		size_t mappedBytes = 0; // the size of the image the levels and the vocabulary are viewed from, shared with other processes mapping it
+
+		size_t total() const
+		{
+			size_t ret = slackBytes + vocabBytes;
+			for (auto& l : levels) ret += l.nodeBytes + l.denseBytes + l.sparseBytes + l.overheadBytes + l.filterBytes;
+			return ret;
+		}
+	};
+
+	// sizes of a model once optimized, by the depth of nodes
+	struct SizeEstimate
+	{
+		vector<size_t> bakedLevels;
+		size_t baked = 0, serialized = 0;
+	};
+
 	class IModel
 	{
 	public:
+		// the byte width of word ids
+		virtual size_t getWordSize() const = 0;
 		virtual size_t getVocabSize() const = 0;
 		virtual size_t getOrder() const = 0;
-		virtual void optimize() = 0;
+		virtual MemoryUsage getMemoryUsage() const = 0;
+		virtual SizeEstimate estimateSize() const = 0;
+		virtual bool isOptimized() const = 0;
+		// sortVocab renumbers the words by descending frequency, so that frequent words take the dense part of maps.
+		// sortNodes reorders the nodes of each depth as reorderNodes() of KNLangModel does without a profile
+		virtual void optimize(bool sortVocab = false, bool sortNodes = false) = 0;
 		virtual void writeToStream(ostream&& str) const = 0;
-		virtual void readFromStream(istream&& str) = 0;
+		// reads the n-grams up to maxOrder only, if it is given
+		virtual void readFromStream(istream&& str, size_t maxOrder = 0) = 0;
+		// ids 0, 1 and 2 are written as <unk>, <s> and </s>. defined in Arpa.hpp
+		virtual void writeToArpa(ostream& os, size_t numThreads = 0) const = 0;
+		// replaces the model and its vocabulary with the ARPA file in data
+		virtual void readFromArpa(const char* data, size_t size, size_t numThreads = 0) = 0;
+		virtual Vocab& getVocab() = 0;
+		virtual const Vocab& getVocab() const = 0;
+		// writes the optimized model in the layout it has in memory, so that it can be used from a mapped file without reading
+		virtual void writeImage(ostream&& str) const = 0;
+		// replaces the model with a view of the image in file, which is kept mapped while the model lives
+		virtual void viewImage(shared_ptr<const MappedFile> file) = 0;
+		// the image the model is viewed from, or null if it is in memory
+		virtual const MappedFile* getImage() const = 0;
+		/*
+		Builds a Bloom filter of bitsPerKey bits per n-gram for each depth of contexts longer than a word, now if optimized
+		and again whenever the model is optimized or read. Lookups the filter rules out skip the search of the map,
+		which most misses of high orders pay before backing off. 0 drops the filters.
+		Must not be called while other threads query the model. withFilterBits() makes a copy to swap in for them.
+		*/
+		virtual void setFilterBits(size_t bitsPerKey) = 0;
 
 		virtual ~IModel() {};
 	};
 
-	template<typename _WType = uint16_t>
+	/*
+	"KNL3" at the head of model files. The header gives the number of nodes of each depth and the vocabulary follows it,
+	then the nodes ordered by depth and linked by their index within a depth, so that reading can stop after any depth.
+	*/
+	static const uint32_t modelMagic = 0x334C4E4B;
+	// "KNL2" at the head of files with the same nodes, counted only in total, and the vocabulary after them
+	static const uint32_t levelModelMagic = 0x324C4E4B;
+	// "KNLM" at the head of files linking nodes by relative offsets. older files start with the size of WID instead.
+	static const uint32_t offsetModelMagic = 0x4D4C4E4B;
+	// "VOCB" followed by the vocabulary. files older than "KNL2" have none.
+	static const uint32_t vocabTag = 0x42434F56;
+	// "KNIM" at the head of model images
+	static const uint32_t imageMagic = 0x4D494E4B;
+	static const uint32_t imageVersion = 2;
+
+	/*
+	The head of a model image, followed by the layout of each depth. Nodes, the elems of their maps and the vocabulary follow
+	at the given offsets, as they are in memory. Maps address their elems relative to themselves, so an image can be mapped at any address.
+	Structs are written as they are, so an image is only read by the same build on the same kind of machine.
+	*/
+	struct ImageHeader
+	{
+		uint32_t magic = imageMagic, wordSize = 0, order = 0, vocabSize = 0, nodeSize = 0, version = imageVersion;
+		uint64_t numNodes = 0, nodesOffset = 0, vocabOffset = 0, vocabBytes = 0;
+	};
+
+	template<typename _WType = uint16_t, template<class, class> class _Map = BakedMap>
 	class KNLangModel : public IModel
 	{
 	public:
 		using WID = _WType;
 		static constexpr _WType npos = (_WType)-1;
+
+		struct LatticeEdge
+		{
+			uint32_t begin = 0, end = 0;
+			_WType wid = 0;
+
+			LatticeEdge(uint32_t _begin = 0, uint32_t _end = 0, _WType _wid = 0) : begin(_begin), end(_end), wid(_wid)
+			{
+			}
+		};
+		// a node of the trie being trained
 		struct Node
 		{
 			friend class KNLangModel;
@@ -64,16 +164,9 @@ namespace knlm
 			};
 		protected:
 			typedef function<Node*()> Allocator;
-			union
-			{
-				map<_WType, int32_t> next;
-				BakedMap<_WType, int32_t> bakedNext;
-			};
+			map<_WType, int32_t> next;
 		public:
 			uint8_t depth = 0;
-		protected:
-			bool baked = false;
-		public:
 			int32_t parent = 0, lower = 0;
 			union
 			{
@@ -82,18 +175,13 @@ namespace knlm
 			};
 			float gamma = 0;
 
-			Node(bool _baked = false) : baked(_baked)
+			Node()
 			{
-				if (baked) new (&bakedNext) BakedMap<_WType, int32_t>();
-				else new (&next) map<_WType, int32_t>();
 			}
 
 			Node(Node&& o)
 			{
-				if (o.baked) new (&bakedNext) BakedMap<_WType, int32_t>(move(o.bakedNext));
-				else new (&next) map<_WType, int32_t>(move(o.next));
-
-				baked = o.baked;
+				next.swap(o.next);
 				swap(parent, o.parent);
 				swap(lower, o.lower);
 				swap(depth, o.depth);
@@ -101,12 +189,6 @@ namespace knlm
 				swap(gamma, o.gamma);
 			}
 
-			~Node()
-			{
-				if (baked) bakedNext.~BakedMap();
-				else next.~map();
-			}
-
 			Node* getParent() const
 			{
 				if (!parent) return nullptr;
@@ -126,40 +208,6 @@ namespace knlm
 				return (Node*)this + it->second;
 			}
 
-			inline Node* getNextFromBaked(_WType n) const
-			{
-				auto t = bakedNext[n];
-				if (!t) return nullptr;
-				return (Node*)this + t;
-			}
-
-			template<typename It>
-			Node* getFromBaked(It begin, It end) const
-			{
-				if (begin == end) return (Node*)this;
-				auto nextNode = getNextFromBaked(*begin);
-				if (!nextNode) return nullptr;
-				return nextNode->getFromBaked(begin + 1, end);
-			}
-
-			float getLL(_WType n, size_t endOrder) const
-			{
-				if (depth == endOrder)
-				{
-					union { int32_t t; float u; };
-					t = bakedNext[n];
-					if (t) return u;
-				}
-				else
-				{
-					auto* p = getNextFromBaked(n);
-					if (p) return p->ll;
-				}
-				auto* lower = getLower();
-				if (!lower) return -INFINITY;
-				return gamma + lower->getLL(n, endOrder);
-			}
-
 			Node* addNextNode(_WType n, const Allocator& alloc)
 			{
 				Node* nextNode = alloc();
@@ -191,14 +239,6 @@ namespace knlm
 				nextNode->increaseCount(historyBegin + 1, historyEnd, endOrder, alloc);
 			}
 
-			void optimize()
-			{
-				map<_WType, int32_t> tNext = move(next);
-				memset(&bakedNext, 0, sizeof(bakedNext));
-				bakedNext = BakedMap<_WType, int32_t>{ tNext.begin(), tNext.end() };
-				baked = true;
-			}
-
 			inline void setLL(_WType n, float ll)
 			{
 				next[n] = *(int32_t*)&ll;
@@ -212,44 +252,437 @@ namespace knlm
 			{
 				return { this, next.end() };
 			}
+		};
+
+		struct BakedNode;
+
+		// the first node of each depth, and the filter of the n-grams following the nodes of each depth if they are built
+		struct Levels
+		{
+			const BakedNode* const* nodes;
+			const BloomFilter* filters;
+
+			const BakedNode* operator[](size_t d) const { return nodes[d]; }
+		};
+
+		/*
+		A node of the optimized trie. It only keeps the fields read while scoring, so that it takes 32 bytes
+		instead of the 72 bytes of a training Node. The parent is not stored, as nothing walks up the trie.
+		The likelihood of a node stays next to its child map, because the child found by one lookup is usually
+		the context of the next one.
+		Nodes are laid out depth by depth and link each other by their 32-bit index within a depth,
+		so a model may hold billions of nodes with links of the same size. Functions walking the trie
+		take the table of the first node of each depth, which the model keeps in levels, with the filters of each depth.
+		*/
+		struct BakedNode
+		{
+			friend class KNLangModel;
+			// children are stored as their index in the next depth plus one, so that 0 means missing
+			typedef _Map<_WType, uint32_t> BakedNext;
+		protected:
+			BakedNext next;
+		public:
+			// the index of the node backed off to, in the depth above. the root has none
+			uint32_t lower = 0;
+			float ll = 0, gamma = 0;
+			uint8_t depth = 0;
+			// set if no n-gram extends the node and backing off from it adds nothing, so that a state at it scores as its lower node does
+			uint8_t redundant = 0;
+
+			BakedNode()
+			{
+			}
+
+			template<typename It>
+			BakedNode(const Node& o, It nextBegin, It nextEnd, uint32_t _lower, const BakedMapLayout& layout)
+				: next{ nextBegin, nextEnd, layout }, lower(_lower), ll(o.ll), gamma(o.gamma), depth(o.depth)
+			{
+			}
+
+			BakedNode(BakedNode&& o)
+			{
+				next.swap(o.next);
+				swap(lower, o.lower);
+				swap(ll, o.ll);
+				swap(gamma, o.gamma);
+				swap(depth, o.depth);
+				swap(redundant, o.redundant);
+			}
+
+			const BakedNode* getLower(Levels lv) const
+			{
+				if (!depth) return nullptr;
+				return lv[depth - 1] + lower;
+			}
+
+			// the shortest state scoring every word as this node does, so that the next word does not probe contexts which cannot match
+			const BakedNode* getState(Levels lv) const
+			{
+				auto* p = this;
+				while (p->redundant) p = lv[p->depth - 1] + p->lower;
+				return p;
+			}
+
+			static uint64_t filterKey(size_t index, _WType n)
+			{
+				return ((uint64_t)index << 32) | n;
+			}
+
+			// the value of n in the map, or 0 if it is missing. the map is not searched if the filter of the depth rules n out
+			inline uint32_t findNext(Levels lv, _WType n) const
+			{
+				if (lv.filters && next.needsSearch(n) && !lv.filters[depth].empty())
+				{
+					if (!lv.filters[depth].mayContain(filterKey(this - lv[depth], n)))
+					{
+						KNLM_STAT(stats::local().filterNegative());
+						return 0;
+					}
+					auto t = next[n];
+					KNLM_STAT(stats::local().filterPositive(!t));
+					return t;
+				}
+				return next[n];
+			}
+
+			inline const BakedNode* getNextFromBaked(Levels lv, _WType n) const
+			{
+				auto t = findNext(lv, n);
+				if (!t) return nullptr;
+				return lv[depth + 1] + t - 1;
+			}
+
+			inline void prefetchNext(Levels lv, _WType n) const
+			{
+				if (lv.filters && next.needsSearch(n) && !lv.filters[depth].empty()) lv.filters[depth].prefetch(filterKey(this - lv[depth], n));
+				next.prefetch(n);
+			}
+
+			template<typename It>
+			const BakedNode* getFromBaked(Levels lv, It begin, It end) const
+			{
+				if (begin == end) return this;
+				auto nextNode = getNextFromBaked(lv, *begin);
+				if (!nextNode) return nullptr;
+				return nextNode->getFromBaked(lv, begin + 1, end);
+			}
+
+			float getLL(Levels lv, _WType n, size_t endOrder) const
+			{
+				float ll = backoffLL(lv, n, endOrder);
+				KNLM_STAT(stats::local().endToken(ll));
+				return ll;
+			}
+
+			float backoffLL(Levels lv, _WType n, size_t endOrder) const
+			{
+				if (depth == endOrder)
+				{
+					union { uint32_t t; float u; };
+					t = findNext(lv, n);
+					if (t) return u;
+				}
+				else
+				{
+					auto* p = getNextFromBaked(lv, n);
+					if (p) return p->ll;
+				}
+				auto* lower = getLower(lv);
+				if (!lower) return -INFINITY;
+				KNLM_STAT(stats::local().backoff());
+				return gamma + lower->backoffLL(lv, n, endOrder);
+			}
+
+			float addBackoff(Levels lv, size_t numBackoff, float ll) const
+			{
+				if (!numBackoff) return ll;
+				return gamma + getLower(lv)->addBackoff(lv, numBackoff - 1, ll);
+			}
+
+			const BakedNext& getNext() const
+			{
+				return next;
+			}
 
 			void writeToStream(ostream& str, size_t leafDepth = 3) const;
 
-			static Node readFromStream(istream& str, size_t leafDepth = 3);
+			// reads a node of a file linking nodes by relative offsets if relative is set, which are kept as they are
+			static BakedNode readFromStream(istream& str, size_t leafDepth = 3, const vector<BakedMapLayout>& layouts = {}, bool relative = false);
+			// reads a node only for its likelihood, skipping its map
+			static float readLL(istream& str, size_t leafDepth = 3);
+		};
+
+		/*
+		Backoff chain with the depth of the context and the leaf depth known at compile time.
+		Each level of the chain is a separate instantiation, so the recursion of BakedNode::getLL and the loop of nextState
+		unroll into straight code without depth or null checks.
+		step() computes the likelihood of n and the next state together, sharing the lookup which finds both.
+		The sums are associated as in getLL, so results are bit-identical.
+		*/
+		template<size_t _Leaf, size_t _Depth>
+		struct FixedOrder
+		{
+			static const BakedNode* child(Levels lv, const BakedNode* node, _WType n)
+			{
+				auto t = node->findNext(lv, n);
+				return t ? lv[_Depth + 1] + t - 1 : nullptr;
+			}
+
+			static const BakedNode* lower(Levels lv, const BakedNode* node)
+			{
+				return lv[_Depth - 1] + node->lower;
+			}
+
+			static const BakedNode* nextState(Levels lv, const BakedNode* node, _WType n)
+			{
+				auto* p = child(lv, node, n);
+				if (p) return p->getState(lv);
+				return FixedOrder<_Leaf, _Depth - 1>::nextState(lv, lower(lv, node), n);
+			}
+
+			static const BakedNode* step(Levels lv, const BakedNode* node, _WType n, float& ll)
+			{
+				if (_Depth == _Leaf)
+				{
+					union { uint32_t t; float u; };
+					t = node->findNext(lv, n);
+					if (t)
+					{
+						ll = u;
+						return FixedOrder<_Leaf, _Depth - 1>::nextState(lv, lower(lv, node), n);
+					}
+				}
+				else
+				{
+					auto* p = child(lv, node, n);
+					if (p)
+					{
+						ll = p->ll;
+						return p->getState(lv);
+					}
+				}
+				KNLM_STAT(stats::local().backoff());
+				auto* r = FixedOrder<_Leaf, _Depth - 1>::step(lv, lower(lv, node), n, ll);
+				ll = node->gamma + ll;
+				return r;
+			}
+
+			static const BakedNode* dispatch(Levels lv, const BakedNode* node, _WType n, float& ll)
+			{
+				if (node->depth == _Depth) return step(lv, node, n, ll);
+				return FixedOrder<_Leaf, _Depth - 1>::dispatch(lv, node, n, ll);
+			}
 		};
+
+		template<size_t _Leaf>
+		struct FixedOrder<_Leaf, 0>
+		{
+			static const BakedNode* nextState(Levels lv, const BakedNode* node, _WType n)
+			{
+				auto t = node->getNext()[n];
+				return t ? (lv[1] + t - 1)->getState(lv) : node;
+			}
+
+			static const BakedNode* step(Levels lv, const BakedNode* node, _WType n, float& ll)
+			{
+				auto t = node->getNext()[n];
+				auto* p = t ? lv[1] + t - 1 : nullptr;
+				ll = p ? p->ll : -INFINITY;
+				return p ? p->getState(lv) : node;
+			}
+
+			static const BakedNode* dispatch(Levels lv, const BakedNode* node, _WType n, float& ll)
+			{
+				return step(lv, node, n, ll);
+			}
+		};
+		/*
+		For each depth, picks the layout minimizing the expected cache lines touched per lookup,
+		weighted by how often each context is used, plus the cache lines of memory spent per entry.
+		*/
+		struct LayoutCost
+		{
+			vector<BakedMapLayout> candidates = BakedNode::BakedNext::candidateLayouts();
+			vector<vector<double>> lines, bytes;
+			vector<double> weights, entries;
+
+			LayoutCost(size_t orderN)
+				: lines(orderN, vector<double>(candidates.size())), bytes(lines), weights(orderN), entries(orderN)
+			{
+			}
+
+			template<typename It>
+			void add(size_t depth, It begin, It end, double weight)
+			{
+				if (begin == end || candidates.size() <= 1) return;
+				weights[depth] += weight;
+				entries[depth] += distance(begin, end);
+				for (size_t c = 0; c < candidates.size(); ++c)
+				{
+					size_t b;
+					lines[depth][c] += weight * BakedNode::BakedNext::estimateCost(begin, end, candidates[c], b);
+					bytes[depth][c] += b;
+				}
+			}
+
+			LayoutCost& operator+=(const LayoutCost& o)
+			{
+				for (size_t d = 0; d < weights.size(); ++d)
+				{
+					for (size_t c = 0; c < candidates.size(); ++c)
+					{
+						lines[d][c] += o.lines[d][c];
+						bytes[d][c] += o.bytes[d][c];
+					}
+					weights[d] += o.weights[d];
+					entries[d] += o.entries[d];
+				}
+				return *this;
+			}
+
+			vector<BakedMapLayout> choose() const
+			{
+				vector<BakedMapLayout> layouts(weights.size(), candidates[0]);
+				for (size_t d = 0; d < weights.size(); ++d)
+				{
+					if (!entries[d]) continue;
+					double bestCost = INFINITY;
+					for (size_t c = 0; c < candidates.size(); ++c)
+					{
+						double cost = lines[d][c] / weights[d] + bytes[d][c] / entries[d] / 64;
+						if (cost < bestCost)
+						{
+							bestCost = cost;
+							layouts[d] = candidates[c];
+						}
+					}
+				}
+				return layouts;
+			}
+		};
+
 	protected:
 		vector<Node> nodes;
+		ViewableVector<BakedNode> bakedNodes;
+		// the first node of each depth in bakedNodes, and the end of the last depth
+		vector<const BakedNode*> levels;
+		// built by indexLevels() if filterBits is set. the root has none
+		vector<BloomFilter> filters;
+		size_t filterBits = 0;
+		shared_ptr<const MappedFile> image;
+		// the model whose nodes are viewed by a copy made by withFilterBits(), kept alive with it
+		shared_ptr<const KNLangModel> base;
 		size_t orderN;
 		size_t vocabSize = 0;
+		vector<BakedMapLayout> layouts;
+		Vocab vocab;
+		vector<_WType> idMap;
 
 		void prepareCapacity(size_t minFreeSize);
+		// orders n nodes depth by depth, keeping their order within a depth. fills order with the nodes in their new order
+		// and returns the index of each node within its depth
+		vector<uint32_t> orderByDepth(size_t n, const function<size_t(size_t)>& depthOf, vector<size_t>& order) const;
+		void indexLevels();
+		// marks the nodes whose states are shortened to their lower node. nodes viewed from an image have their marks already
+		void markRedundant();
+		void buildFilters();
+		// the nodes of the model as reorderNodes() lays them out, leaving the model as it is
+		ViewableVector<BakedNode> reorderedNodes(const vector<vector<_WType>>& profile) const;
+		// an empty model with the order, vocabulary, layouts and filter bits of this one, to be given nodes
+		shared_ptr<KNLangModel> emptyCopy() const;
+		Levels getLevels() const { return { levels.data(), filters.empty() ? nullptr : filters.data() }; }
+		// drops the depths from order on. lls are the likelihoods of the nodes of depth order, which become leaf values
+		void truncateOrder(size_t order, const vector<float>& lls);
+		void sortVocab();
 		void calcDiscountedValue(size_t order, const vector<uint32_t>& cntNodes);
+		vector<BakedMapLayout> selectLayouts(const vector<uint32_t>& cntNodes) const;
+		const BakedNode* nextState(const BakedNode* cNode, _WType n) const;
+
+		// calls fn(i, ll) for each word of seq using the specialized chain of the model's order.
+		// returns false without calling fn if the order has no specialization.
+		template<typename _Fn> bool walkFixed(const _WType* seq, size_t len, _Fn&& fn) const;
+		template<size_t _Leaf, typename _Fn> void walkFixed(const _WType* seq, size_t len, _Fn&& fn) const;
 	public:
 		KNLangModel(size_t _orderN = 3);
 		KNLangModel(KNLangModel&& o)
 		{
 			nodes.swap(o.nodes);
+			bakedNodes.swap(o.bakedNodes);
+			levels.swap(o.levels);
+			filters.swap(o.filters);
+			filterBits = o.filterBits;
 			orderN = o.orderN;
 			vocabSize = o.vocabSize;
+			layouts.swap(o.layouts);
+			swap(vocab, o.vocab);
+			image.swap(o.image);
+			base.swap(o.base);
 		}
+		size_t getWordSize() const override { return sizeof(_WType); }
 		size_t getVocabSize() const override { return vocabSize; }
 		size_t getOrder() const override { return orderN; }
+		const vector<BakedMapLayout>& getLayouts() const { return layouts; }
+		Vocab& getVocab() override { return vocab; }
+		const Vocab& getVocab() const override { return vocab; }
+		MemoryUsage getMemoryUsage() const override;
+		// before optimize(), predicts the sizes from the training counts. after it, measures them.
+		SizeEstimate estimateSize() const override;
+		bool isOptimized() const override { return !bakedNodes.empty(); }
 		void trainSequence(const _WType* seq, size_t len);
-		void optimize() override;
+		void optimize(bool sortVocab = false, bool sortNodes = false) override;
+		/*
+		Reorders the nodes of each depth of an optimized model, which scores as before. The children of a node follow each other,
+		in the order of their parents and then of their words, so that siblings and the contexts after them share cache lines.
+		With a profile of sentences, the nodes visited by scoring them come first within their depth, packing the hot part
+		of the model into fewer pages. Models viewed from an image cannot be reordered. Must not be called while other threads query the model.
+		*/
+		void reorderNodes(const vector<vector<_WType>>& profile = {});
+		/*
+		Copies to swap in for a model while other threads query it, as ModelHandle::update() does, instead of changing it.
+		withFilterBits() builds filters for a copy which views the nodes of mdl and keeps mdl alive,
+		and reordered() copies the nodes as reorderNodes() lays them out.
+		*/
+		static shared_ptr<KNLangModel> withFilterBits(shared_ptr<const KNLangModel> mdl, size_t bitsPerKey);
+		shared_ptr<KNLangModel> reordered(const vector<vector<_WType>>& profile = {}) const;
+		// the new id of each id given to trainSequence, if optimize() renumbered the words. empty otherwise.
+		// the vocabulary is renumbered with the model if it holds all the ids, so only callers keeping their own ids need it.
+		const vector<_WType>& getIdMap() const { return idMap; }
 		vector<float> predictNext(const _WType* history, size_t len) const;
 		float evaluateLL(const _WType* seq, size_t len) const;
 		float evaluateLLSent(const _WType* seq, size_t len, float minValue = -100.f) const;
+		void evaluateLLSentBatch(const _WType* const* seqs, const size_t* lens, size_t n, float* out, float minValue = -100.f, size_t groupSize = 16) const;
 		vector<float> evaluateLLEachWord(const _WType* seq, size_t len) const;
+		vector<float> evaluateLLNBest(const vector<vector<_WType>>& hyps, float minValue = -100.f, vector<vector<float>>* eachWord = nullptr) const;
+		vector<float> evaluateLLTree(const _WType* tokens, const int32_t* parents, size_t len, float minValue = -100.f) const;
+		float decodeLattice(const LatticeEdge* edges, size_t numEdges, size_t length, vector<size_t>& path,
+			_WType bos = npos, _WType eos = npos, float minValue = -100.f, size_t beamSize = 0) const;
 		float branchingEntropy(const _WType* seq, size_t len) const;
+		// for scoring word by word, such as in step with other models: the state before the first word,
+		// and the likelihood of n in a state, returning the state after it
+		const BakedNode* getInitState() const { return &bakedNodes[0]; }
+		const BakedNode* scoreNext(const BakedNode* state, _WType n, float& ll) const;
 
 		void writeToStream(ostream&& str) const override
 		{
+			writeToBinStream<uint32_t>(str, modelMagic);
 			writeToBinStream<uint32_t>(str, sizeof(_WType));
 			writeToBinStream<uint32_t>(str, orderN);
 			writeToBinStream<uint32_t>(str, vocabSize);
+			for (size_t i = 0; i < orderN; ++i)
+			{
+				auto layout = i < layouts.size() ? layouts[i] : BakedMapLayout{};
+				writeToBinStream(str, layout.denseFactor);
+				writeToBinStream(str, layout.denseBias);
+				writeToBinStream(str, layout.hashLevels);
+			}
+			for (size_t d = 0; d < orderN; ++d)
+			{
+				writeToBinStream<uint64_t>(str, levels.empty() ? 0 : levels[d + 1] - levels[d]);
+			}
+			writeToBinStream<uint32_t>(str, vocabTag);
+			vocab.writeToStream(str);
 
-			writeToBinStream<uint32_t>(str, nodes.size());
-			for (auto& p : nodes)
+			for (auto& p : bakedNodes)
 			{
 				p.writeToStream(str, orderN);
 			}
@@ -258,51 +691,258 @@ namespace knlm
 		KNLangModel& operator=(KNLangModel&& o)
 		{
 			nodes.swap(o.nodes);
+			bakedNodes.swap(o.bakedNodes);
+			levels.swap(o.levels);
+			filters.swap(o.filters);
+			filterBits = o.filterBits;
 			orderN = o.orderN;
 			vocabSize = o.vocabSize;
+			layouts.swap(o.layouts);
+			swap(vocab, o.vocab);
+			image.swap(o.image);
+			base.swap(o.base);
 			return *this;
 		}
 
-		void readFromStream(istream&& str) override
+		// maxOrder, if given and lower than the order of the model, reads only the n-grams up to maxOrder.
+		// the lower orders are smoothed for backing off, so the result scores close to, but not as, a model trained with maxOrder.
+		void readFromStream(istream&& str, size_t maxOrder = 0) override
 		{
+			if (maxOrder == 1) throw runtime_error{ "models of order less than 2 are not supported" };
 			str.exceptions(istream::failbit | istream::badbit);
 			nodes.clear();
-			if (readFromBinStream<uint32_t>(str) > sizeof(_WType))
+			bakedNodes.clear();
+			levels.clear();
+			image.reset();
+			base.reset();
+			vocab = Vocab{};
+			uint32_t magic = readFromBinStream<uint32_t>(str), head = magic;
+			bool hasLayouts = magic == modelMagic || magic == levelModelMagic || magic == offsetModelMagic;
+			if (hasLayouts) head = readFromBinStream<uint32_t>(str);
+			if (head > sizeof(_WType))
 			{
 				throw runtime_error{ "read failed. need wider size of _WType" };
 			}
 			orderN = readFromBinStream<uint32_t>(str);
 			vocabSize = readFromBinStream<uint32_t>(str);
+			layouts.assign(orderN, BakedMapLayout{});
+			if (hasLayouts) for (auto& layout : layouts)
+			{
+				readFromBinStream(str, layout.denseFactor);
+				readFromBinStream(str, layout.denseBias);
+				readFromBinStream(str, layout.hashLevels);
+			}
+			size_t keep = maxOrder && maxOrder < orderN ? maxOrder : orderN;
+			// the likelihoods of the nodes of the first depth not kept
+			vector<float> lls;
 
-			uint32_t size = readFromBinStream<uint32_t>(str);
-			nodes.reserve(size);
-			for (size_t i = 0; i < size; ++i)
+			if (magic == modelMagic)
 			{
-				nodes.emplace_back(Node::readFromStream(str, orderN));
+				vector<uint64_t> counts(orderN);
+				for (auto& c : counts) c = readFromBinStream<uint64_t>(str);
+				if (readFromBinStream<uint32_t>(str) != vocabTag) throw runtime_error{ "read failed. no vocabulary" };
+				vocab.readFromStream(str);
+				bakedNodes.reserve(accumulate(counts.begin(), counts.begin() + keep, (size_t)0));
+				for (size_t d = 0; d < keep; ++d)
+				{
+					for (size_t i = 0; i < counts[d]; ++i)
+					{
+						bakedNodes.emplace_back(BakedNode::readFromStream(str, orderN, layouts));
+						if (bakedNodes[bakedNodes.size() - 1].depth != d) throw runtime_error{ "read failed. nodes are not ordered by depth" };
+					}
+				}
+				// the rest of the file is left unread
+				if (keep < orderN)
+				{
+					lls.resize(counts[keep]);
+					for (auto& ll : lls) ll = BakedNode::readLL(str, orderN);
+				}
+			}
+			else if (magic == levelModelMagic)
+			{
+				uint64_t size = readFromBinStream<uint64_t>(str);
+				bakedNodes.reserve(size);
+				for (size_t i = 0; i < size; ++i)
+				{
+					bakedNodes.emplace_back(BakedNode::readFromStream(str, orderN, layouts));
+					if (i && bakedNodes[i].depth < bakedNodes[i - 1].depth) throw runtime_error{ "read failed. nodes are not ordered by depth" };
+				}
+			}
+			else
+			{
+				// nodes linked by relative offsets are ordered by depth and linked by their index instead
+				uint32_t size = readFromBinStream<uint32_t>(str);
+				vector<BakedNode> read;
+				read.reserve(size);
+				for (size_t i = 0; i < size; ++i)
+				{
+					read.emplace_back(BakedNode::readFromStream(str, orderN, layouts, true));
+				}
+				vector<size_t> order;
+				auto local = orderByDepth(size, [&](size_t i) { return read[i].depth; }, order);
+				bakedNodes.reserve(size);
+				vector<pair<_WType, uint32_t>> next;
+				for (auto i : order)
+				{
+					auto& node = read[i];
+					if (node.depth < orderN - 1)
+					{
+						next.clear();
+						for (auto p : node.next) next.emplace_back(p.first, local[i + (int32_t)p.second] + 1);
+						node.next = typename BakedNode::BakedNext{ next.begin(), next.end(), layouts[node.depth] };
+					}
+					node.lower = local[i + (int32_t)node.lower];
+					bakedNodes.emplace_back(move(node));
+				}
 			}
+			if (magic != modelMagic && str.peek() != EOF)
+			{
+				if (readFromBinStream<uint32_t>(str) != vocabTag) throw runtime_error{ "read failed. unknown data after nodes" };
+				vocab.readFromStream(str);
+			}
+			indexLevels();
+			if (keep < orderN)
+			{
+				if (magic != modelMagic) for (auto* p = levels[keep]; p != levels[keep + 1]; ++p) lls.emplace_back(p->ll);
+				truncateOrder(keep, lls);
+			}
+			markRedundant();
+		}
+
+		void writeToArpa(ostream& os, size_t numThreads = 0) const override;
+		void readFromArpa(const char* data, size_t size, size_t numThreads = 0) override;
+
+		void writeImage(ostream&& str) const override;
+		void viewImage(shared_ptr<const MappedFile> file) override;
+		void setFilterBits(size_t bitsPerKey) override
+		{
+			filterBits = bitsPerKey;
+			buildFilters();
 		}
+		const MappedFile* getImage() const override { return image.get(); }
 
 		void printStat() const;
 	};
 
-	template<typename _WType>
-	KNLangModel<_WType>::KNLangModel(size_t _orderN) : orderN(_orderN)
+	template<typename _WType, template<class, class> class _Map>
+	KNLangModel<_WType, _Map>::KNLangModel(size_t _orderN) : orderN(_orderN)
 	{
 		nodes.emplace_back();
 	}
 
-	template<typename _WType>
-	void KNLangModel<_WType>::prepareCapacity(size_t minFreeSize)
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::prepareCapacity(size_t minFreeSize)
 	{
+		// training nodes link each other by 32-bit offsets
+		if (nodes.size() + minFreeSize > (size_t)numeric_limits<int32_t>::max())
+		{
+			throw runtime_error{ "too many nodes to train. larger models can be read from ARPA files" };
+		}
 		if (nodes.capacity() < nodes.size() + minFreeSize)
 		{
 			nodes.reserve(max(nodes.size() + minFreeSize, nodes.capacity() + nodes.capacity() / 2));
 		}
 	}
 
-	template<typename _WType>
-	void KNLangModel<_WType>::trainSequence(const _WType * seq, size_t len)
+	template<typename _WType, template<class, class> class _Map>
+	vector<uint32_t> KNLangModel<_WType, _Map>::orderByDepth(size_t n, const function<size_t(size_t)>& depthOf, vector<size_t>& order) const
+	{
+		vector<size_t> begin(orderN + 1);
+		for (size_t i = 0; i < n; ++i) begin[depthOf(i) + 1]++;
+		for (size_t d = 0; d < orderN; ++d)
+		{
+			if (begin[d + 1] >= numeric_limits<uint32_t>::max()) throw runtime_error{ "too many nodes of depth " + to_string(d) };
+			begin[d + 1] += begin[d];
+		}
+		vector<uint32_t> local(n);
+		order.resize(n);
+		auto filled = begin;
+		for (size_t i = 0; i < n; ++i)
+		{
+			size_t d = depthOf(i), p = filled[d]++;
+			order[p] = i;
+			local[i] = p - begin[d];
+		}
+		return local;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::indexLevels()
+	{
+		// nodes are ordered by depth, so the first of each depth is found by bisection without touching the others
+		const auto& baked = bakedNodes;
+		levels.resize(orderN + 1);
+		for (size_t d = 0; d <= orderN; ++d)
+		{
+			levels[d] = partition_point(baked.begin(), baked.end(), [&](const BakedNode& n) { return n.depth < d; });
+		}
+		buildFilters();
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::markRedundant()
+	{
+		// the root always has to stay, as it backs off to nothing
+		for (size_t i = 1; i < bakedNodes.size(); ++i)
+		{
+			auto& node = bakedNodes[i];
+			node.redundant = node.gamma == 0 && node.next.begin() == node.next.end();
+		}
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::buildFilters()
+	{
+		filters.clear();
+		if (!filterBits || bakedNodes.empty()) return;
+		filters.resize(orderN);
+		for (size_t d = 1; d < orderN; ++d)
+		{
+			// only the keys searched for are looked up in the filter. the others are found at the first cache line of their map
+			size_t numKeys = 0;
+			for (auto* p = levels[d]; p != levels[d + 1]; ++p)
+			{
+				for (auto e : p->next) numKeys += p->next.needsSearch(e.first);
+			}
+			if (!numKeys) continue;
+			BloomFilter filter{ numKeys, filterBits };
+			for (auto* p = levels[d]; p != levels[d + 1]; ++p)
+			{
+				for (auto e : p->next)
+				{
+					if (p->next.needsSearch(e.first)) filter.insert(BakedNode::filterKey(p - levels[d], e.first));
+				}
+			}
+			filters[d] = move(filter);
+		}
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::truncateOrder(size_t order, const vector<float>& lls)
 	{
+		vector<pair<_WType, uint32_t>> next;
+		for (auto* p = levels[order - 1]; p != levels[order]; ++p)
+		{
+			auto& node = bakedNodes[p - levels[0]];
+			next.clear();
+			for (auto e : node.next)
+			{
+				uint32_t v;
+				memcpy(&v, &lls[e.second - 1], sizeof(v));
+				next.emplace_back(e.first, v);
+			}
+			node.next = typename BakedNode::BakedNext{ next.begin(), next.end(), layouts[order - 1] };
+		}
+		bakedNodes.resize(levels[order] - levels[0]);
+		orderN = order;
+		layouts.resize(order);
+		indexLevels();
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::trainSequence(const _WType * seq, size_t len)
+	{
+		if (!bakedNodes.empty()) throw runtime_error{ "cannot train an optimized model" };
 		prepareCapacity(len * orderN);
 		for (size_t i = 0; i < len; ++i)
 		{
@@ -315,8 +955,8 @@ namespace knlm
 		vocabSize = max((size_t)*max_element(seq, seq + len) + 1, vocabSize);
 	}
 
-	template<typename _WType>
-	void KNLangModel<_WType>::calcDiscountedValue(size_t order, const vector<uint32_t>& cntNodes)
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::calcDiscountedValue(size_t order, const vector<uint32_t>& cntNodes)
 	{
 		// modified unigram probability
 		if (order == 1)
@@ -410,9 +1050,11 @@ namespace knlm
 		}
 	}
 
-	template<typename _WType>
-	void KNLangModel<_WType>::optimize()
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::optimize(bool sortVocab, bool sortNodes)
 	{
+		if (!bakedNodes.empty()) return;
+		if (sortVocab) this->sortVocab();
 		{
 			vector<uint32_t> cntNodes(nodes.size());
 			transform(nodes.begin(), nodes.end(), cntNodes.begin(), [](const Node& n)
@@ -423,6 +1065,7 @@ namespace knlm
 			{
 				calcDiscountedValue(i, cntNodes);
 			}
+			layouts = selectLayouts(cntNodes);
 		}
 
 		// bake likelihoods to log
@@ -440,99 +1083,799 @@ namespace knlm
 					node.setLL(p.first, log(*(float*)&t));
 				}
 			}
-			node.optimize();
 		}
+
+		// move the hot fields into the compact array depth by depth, linking nodes by their index within a depth
+		vector<size_t> order;
+		auto local = orderByDepth(nodes.size(), [&](size_t i) { return nodes[i].depth; }, order);
+		bakedNodes.clear();
+		bakedNodes.reserve(nodes.size());
+		vector<pair<_WType, uint32_t>> next;
+		for (auto i : order)
+		{
+			auto& node = nodes[i];
+			next.clear();
+			for (auto& p : node.next) next.emplace_back(p.first, node.depth < orderN - 1 ? local[i + p.second] + 1 : (uint32_t)p.second);
+			bakedNodes.emplace_back(node, next.begin(), next.end(), local[i + node.lower], layouts[node.depth]);
+		}
+		vector<Node>{}.swap(nodes);
+		indexLevels();
+		markRedundant();
+		if (sortNodes) reorderNodes();
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	ViewableVector<typename KNLangModel<_WType, _Map>::BakedNode> KNLangModel<_WType, _Map>::reorderedNodes(const vector<vector<_WType>>& profile) const
+	{
+		if (bakedNodes.empty()) throw runtime_error{ "the model must be optimized" };
+		if (image) throw runtime_error{ "cannot reorder a model viewed from an image" };
+		auto lv = getLevels();
+
+		// visits of each node, by its index in bakedNodes: the backoff chain probed for each word, and the node found
+		vector<uint32_t> visits(profile.empty() ? 0 : bakedNodes.size());
+		for (auto& seq : profile)
+		{
+			const BakedNode* cNode = &bakedNodes[0];
+			for (auto w : seq)
+			{
+				for (auto* p = cNode; p; p = p->getLower(lv))
+				{
+					visits[p - levels[0]]++;
+					if (p->depth == orderN - 1)
+					{
+						if (p->findNext(lv, w)) break;
+					}
+					else if (auto* c = p->getNextFromBaked(lv, w))
+					{
+						visits[c - levels[0]]++;
+						break;
+					}
+				}
+				cNode = nextState(cNode, w);
+			}
+		}
+
+		// the new order of each depth, as indices within the depth, and the new index of each node
+		vector<vector<uint32_t>> order(orderN), local(orderN);
+		order[0] = local[0] = { 0 };
+		for (size_t d = 1; d < orderN; ++d)
+		{
+			auto& o = order[d];
+			for (auto parent : order[d - 1])
+			{
+				for (auto e : levels[d - 1][parent].next) o.emplace_back(e.second - 1);
+			}
+			if (o.size() != (size_t)(levels[d + 1] - levels[d])) throw runtime_error{ "some nodes have no parent" };
+			if (!visits.empty())
+			{
+				// sorting by the number of visits would scatter siblings, so the visited nodes only move ahead of the others
+				auto* v = &visits[levels[d] - levels[0]];
+				stable_partition(o.begin(), o.end(), [&](uint32_t i) { return v[i] > 0; });
+			}
+			local[d].resize(o.size());
+			for (size_t i = 0; i < o.size(); ++i) local[d][o[i]] = i;
+		}
+
+		// the nodes are rebuilt, not moved, so that the model can still be queried meanwhile
+		ViewableVector<BakedNode> reordered;
+		reordered.reserve(bakedNodes.size());
+		vector<pair<_WType, uint32_t>> next;
+		for (size_t d = 0; d < orderN; ++d)
+		{
+			for (auto i : order[d])
+			{
+				auto& node = bakedNodes[levels[d] - levels[0] + i];
+				next.clear();
+				// leaves keep their likelihoods, which do not link to other nodes
+				for (auto e : node.next) next.emplace_back(e.first, d < orderN - 1 ? local[d + 1][e.second - 1] + 1 : e.second);
+				reordered.emplace_back();
+				auto& copy = reordered[reordered.size() - 1];
+				copy.next = typename BakedNode::BakedNext{ next.begin(), next.end(), layouts[d] };
+				copy.lower = d > 1 ? local[d - 1][node.lower] : node.lower;
+				copy.ll = node.ll;
+				copy.gamma = node.gamma;
+				copy.depth = node.depth;
+				copy.redundant = node.redundant;
+			}
+		}
+		return reordered;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::reorderNodes(const vector<vector<_WType>>& profile)
+	{
+		auto reordered = reorderedNodes(profile);
+		bakedNodes.swap(reordered);
+		indexLevels();
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	shared_ptr<KNLangModel<_WType, _Map>> KNLangModel<_WType, _Map>::emptyCopy() const
+	{
+		auto ret = make_shared<KNLangModel>(orderN);
+		ret->nodes.clear();
+		ret->filterBits = filterBits;
+		ret->vocabSize = vocabSize;
+		ret->layouts = layouts;
+		ret->vocab = vocab;
+		ret->idMap = idMap;
+		return ret;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	shared_ptr<KNLangModel<_WType, _Map>> KNLangModel<_WType, _Map>::withFilterBits(shared_ptr<const KNLangModel> mdl, size_t bitsPerKey)
+	{
+		if (mdl->bakedNodes.empty()) throw runtime_error{ "the model must be optimized" };
+		auto ret = mdl->emptyCopy();
+		ret->filterBits = bitsPerKey;
+		// the vocabulary of an image is viewed from it as well
+		ret->image = mdl->image;
+		ret->base = mdl->base ? mdl->base : mdl;
+		ret->bakedNodes.view(mdl->bakedNodes.begin(), mdl->bakedNodes.size());
+		ret->indexLevels();
+		return ret;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	shared_ptr<KNLangModel<_WType, _Map>> KNLangModel<_WType, _Map>::reordered(const vector<vector<_WType>>& profile) const
+	{
+		auto nodes = reorderedNodes(profile);
+		auto ret = emptyCopy();
+		ret->bakedNodes.swap(nodes);
+		ret->indexLevels();
+		return ret;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::sortVocab()
+	{
+		// ids 0, 1 and 2 are kept. the others are ordered by the count of their unigram, which is their frequency
+		bool withVocab = vocab.size() >= vocabSize;
+		size_t n = withVocab ? vocab.size() : vocabSize;
+		vector<uint32_t> freq(n);
+		for (auto p : nodes[0]) freq[p.first] = p.second->count;
+		vector<size_t> order(n);
+		for (size_t i = 0; i < n; ++i) order[i] = i;
+		stable_sort(order.begin() + min(n, (size_t)3), order.end(), [&](size_t a, size_t b)
+		{
+			return freq[a] > freq[b];
+		});
+		idMap.assign(n, 0);
+		for (size_t i = 0; i < n; ++i) idMap[order[i]] = i;
+
+		// only keys change. nodes stay in place, so offsets are still valid
+		for (auto& node : nodes)
+		{
+			map<_WType, int32_t> next;
+			for (auto& p : node.next) next.emplace(idMap[p.first], p.second);
+			node.next.swap(next);
+		}
+
+		if (!withVocab) return;
+		Vocab sorted;
+		sorted.clear();
+		for (auto i : order) sorted.add(vocab.data(i), vocab.length(i));
+		vocab = move(sorted);
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	vector<BakedMapLayout> KNLangModel<_WType, _Map>::selectLayouts(const vector<uint32_t>& cntNodes) const
+	{
+		// weighted by how often each context was seen in training
+		LayoutCost cost{ orderN };
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			auto& node = nodes[i];
+			cost.add(node.depth, node.next.begin(), node.next.end(), cntNodes[i]);
+		}
+		return cost.choose();
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	MemoryUsage KNLangModel<_WType, _Map>::getMemoryUsage() const
+	{
+		MemoryUsage ret;
+		ret.levels.resize(orderN);
+		if (!bakedNodes.empty())
+		{
+			for (auto& node : bakedNodes)
+			{
+				auto& l = ret.levels[node.depth];
+				size_t dense, sparse, overhead;
+				node.next.bytesUsed(dense, sparse, overhead);
+				l.nodes++;
+				l.nodeBytes += sizeof(BakedNode);
+				l.denseBytes += dense;
+				l.sparseBytes += sparse;
+				l.overheadBytes += overhead;
+			}
+			for (size_t d = 0; d < filters.size(); ++d) ret.levels[d].filterBytes = filters[d].bytesUsed();
+			ret.slackBytes = (bakedNodes.capacity() - bakedNodes.size()) * sizeof(BakedNode);
+			ret.vocabBytes = vocab.bytesUsed();
+			if (image) ret.mappedBytes = image->size();
+			return ret;
+		}
+
+		// a tree node of std::map holds a color and three links besides the pair
+		size_t entry = sizeof(typename map<_WType, int32_t>::value_type) + sizeof(void*) * 4;
+		for (auto& node : nodes)
+		{
+			auto& l = ret.levels[node.depth];
+			l.nodes++;
+			l.nodeBytes += sizeof(Node);
+			l.sparseBytes += node.next.size() * entry;
+			l.overheadBytes += node.next.size() * heapOverhead(entry);
+		}
+		ret.slackBytes = (nodes.capacity() - nodes.size()) * sizeof(Node);
+		ret.vocabBytes = vocab.bytesUsed();
+		return ret;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	SizeEstimate KNLangModel<_WType, _Map>::estimateSize() const
+	{
+		SizeEstimate ret;
+		ret.bakedLevels.resize(orderN);
+		if (!bakedNodes.empty())
+		{
+			auto usage = getMemoryUsage();
+			for (size_t d = 0; d < orderN; ++d)
+			{
+				auto& l = usage.levels[d];
+				ret.bakedLevels[d] = l.nodeBytes + l.denseBytes + l.sparseBytes + l.overheadBytes;
+				ret.baked += ret.bakedLevels[d];
+			}
+			CountingStreamBuf buf;
+			writeToStream(ostream{ &buf });
+			ret.serialized = buf.size();
+			return ret;
+		}
+
+		vector<uint32_t> cntNodes(nodes.size());
+		transform(nodes.begin(), nodes.end(), cntNodes.begin(), [](const Node& n)
+		{
+			return n.count;
+		});
+		auto layouts = selectLayouts(cntNodes);
+
+		// the header, the vocabulary, then each node as writeToStream lays it out
+		vector<size_t> order;
+		auto local = orderByDepth(nodes.size(), [&](size_t i) { return nodes[i].depth; }, order);
+		ret.serialized = sizeof(uint32_t) * 5 + (sizeof(uint64_t) + 3) * orderN + vocab.serializedSize();
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			auto& node = nodes[i];
+			size_t bytes;
+			BakedNode::BakedNext::estimateCost(node.next.begin(), node.next.end(), layouts[node.depth], bytes);
+			bytes -= sizeof(typename BakedNode::BakedNext);
+			ret.bakedLevels[node.depth] += sizeof(BakedNode) + bytes + heapOverhead(bytes);
+
+			ret.serialized += sizeVToBinStream(local[i + node.lower]) + 5 + sizeVToBinStream(node.next.size());
+			for (auto& p : node.next)
+			{
+				ret.serialized += sizeVToBinStream(p.first);
+				ret.serialized += node.depth < orderN - 1 ? sizeVToBinStream(local[i + p.second]) : 2;
+			}
+		}
+		for (auto b : ret.bakedLevels) ret.baked += b;
+		return ret;
 	}
 
-	template<typename _WType>
-	vector<float> KNLangModel<_WType>::predictNext(const _WType * history, size_t len) const
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::writeImage(ostream&& str) const
 	{
+		if (bakedNodes.empty()) throw runtime_error{ "only an optimized model can be written as an image" };
+		auto align = [](size_t n, size_t a) { return (n + a - 1) & ~(a - 1); };
+		size_t pos = 0;
+		auto pad = [&](size_t to)
+		{
+			for (; pos < to; ++pos) str.put(0);
+		};
+
+		ImageHeader head;
+		head.wordSize = sizeof(_WType);
+		head.order = orderN;
+		head.vocabSize = vocabSize;
+		head.nodeSize = sizeof(BakedNode);
+		head.numNodes = bakedNodes.size();
+		head.nodesOffset = align(sizeof(ImageHeader) + orderN * sizeof(BakedMapLayout), 64);
+		size_t elemsBegin = head.nodesOffset + bakedNodes.size() * sizeof(BakedNode), elemsEnd = elemsBegin;
+		for (auto& node : bakedNodes) elemsEnd = align(elemsEnd, 8) + node.next.imageBytes();
+		head.vocabOffset = align(elemsEnd, 8);
+		head.vocabBytes = vocab.serializedSize();
+
+		str.write((const char*)&head, sizeof(ImageHeader));
+		for (size_t i = 0; i < orderN; ++i)
+		{
+			auto layout = i < layouts.size() ? layouts[i] : BakedMapLayout{};
+			str.write((const char*)&layout, sizeof(BakedMapLayout));
+		}
+		pos = sizeof(ImageHeader) + orderN * sizeof(BakedMapLayout);
+		pad(head.nodesOffset);
+
+		// nodes with their maps pointing to the elems, which are written after all the nodes in the same order
+		size_t nextOffset = (const char*)&bakedNodes[0].next - (const char*)&bakedNodes[0], elemsPos = elemsBegin;
+		char raw[sizeof(BakedNode)];
+		for (auto& node : bakedNodes)
+		{
+			elemsPos = align(elemsPos, 8);
+			memcpy(raw, (const void*)&node, sizeof(BakedNode));
+			node.next.writeImageHeader(raw + nextOffset, elemsPos - (pos + nextOffset));
+			str.write(raw, sizeof(BakedNode));
+			pos += sizeof(BakedNode);
+			elemsPos += node.next.imageBytes();
+		}
+		for (auto& node : bakedNodes)
+		{
+			pad(align(pos, 8));
+			str.write((const char*)node.next.imageData(), node.next.imageBytes());
+			pos += node.next.imageBytes();
+		}
+		pad(head.vocabOffset);
+		vocab.writeToStream(str);
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::viewImage(shared_ptr<const MappedFile> file)
+	{
+		const char* base = file->data();
+		ImageHeader head;
+		if (file->size() < sizeof(ImageHeader)) throw runtime_error{ "not a model image" };
+		memcpy(&head, base, sizeof(ImageHeader));
+		if (head.magic != imageMagic) throw runtime_error{ "not a model image" };
+		if (head.wordSize != sizeof(_WType)) throw runtime_error{ "the image has another width of word ids" };
+		if (head.nodeSize != sizeof(BakedNode) || head.version != imageVersion) throw runtime_error{ "the image was written by an incompatible build" };
+		if (head.nodesOffset + head.numNodes * sizeof(BakedNode) > file->size()
+			|| head.vocabOffset + head.vocabBytes > file->size()) throw runtime_error{ "the image is truncated" };
+
+		nodes.clear();
+		idMap.clear();
+		orderN = head.order;
+		vocabSize = head.vocabSize;
+		layouts.assign(orderN, BakedMapLayout{});
+		memcpy((void*)layouts.data(), base + sizeof(ImageHeader), orderN * sizeof(BakedMapLayout));
+		bakedNodes.view((const BakedNode*)(base + head.nodesOffset), head.numNodes);
+		indexLevels();
+		vocab.view(base + head.vocabOffset, head.vocabBytes);
+		image = move(file);
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	vector<float> KNLangModel<_WType, _Map>::predictNext(const _WType * history, size_t len) const
+	{
+		KNLM_STAT(stats::CallScope scope{ stats::Query::predict });
 		vector<float> prob(vocabSize);
-		const Node* n = nullptr;
-		for (size_t i = max(len, orderN - 1) - orderN + 1; i < len && !(n = nodes[0].getFromBaked(history + i, history + len)); ++i);
-		if (!n) n = &nodes[0];
+		const BakedNode* n = nullptr;
+		for (size_t i = max(len, orderN - 1) - orderN + 1; i < len && !(n = bakedNodes[0].getFromBaked(getLevels(), history + i, history + len)); ++i);
+		if (!n) n = &bakedNodes[0];
 		for (size_t i = 0; i < vocabSize; ++i)
 		{
-			prob[i] = n->getLL(i, orderN - 1);
+			prob[i] = n->getLL(getLevels(), i, orderN - 1);
 		}
 		return prob;
 	}
 
-	template<typename _WType>
-	float KNLangModel<_WType>::evaluateLL(const _WType * seq, size_t len) const
+	template<typename _WType, template<class, class> class _Map>
+	float KNLangModel<_WType, _Map>::evaluateLL(const _WType * seq, size_t len) const
 	{
-		const Node* n = nullptr;
-		for (size_t i = max(len - 1, orderN - 1) - orderN + 1; i < len - 1 && !(n = nodes[0].getFromBaked(seq + i, seq + len - 1)); ++i);
-		if (!n) n = &nodes[0];
-		return n->getLL(seq[len - 1], orderN - 1);
+		KNLM_STAT(stats::CallScope scope{ stats::Query::evaluate });
+		const BakedNode* n = nullptr;
+		for (size_t i = max(len - 1, orderN - 1) - orderN + 1; i < len - 1 && !(n = bakedNodes[0].getFromBaked(getLevels(), seq + i, seq + len - 1)); ++i);
+		if (!n) n = &bakedNodes[0];
+		return n->getLL(getLevels(), seq[len - 1], orderN - 1);
 	}
 
-	template<typename _WType>
-	float KNLangModel<_WType>::evaluateLLSent(const _WType * seq, size_t len, float minValue) const
+	template<typename _WType, template<class, class> class _Map>
+	auto KNLangModel<_WType, _Map>::nextState(const BakedNode* cNode, _WType n) const -> const BakedNode*
 	{
-		const KNLangModel::Node* cNode = &nodes[0];
+		auto lv = getLevels();
+		if (cNode->depth == orderN - 1) cNode = cNode->getLower(lv);
+		auto nextNode = cNode->getNextFromBaked(lv, n);
+		while (!nextNode)
+		{
+			cNode = cNode->getLower(lv);
+			if (!cNode) break;
+			nextNode = cNode->getNextFromBaked(lv, n);
+		}
+		return nextNode ? nextNode->getState(lv) : &bakedNodes[0];
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	auto KNLangModel<_WType, _Map>::scoreNext(const BakedNode* state, _WType n, float& ll) const -> const BakedNode*
+	{
+		auto lv = getLevels();
+		const BakedNode* next;
+		switch (orderN)
+		{
+		case 2: next = FixedOrder<1, 1>::dispatch(lv, state, n, ll); break;
+		case 3: next = FixedOrder<2, 2>::dispatch(lv, state, n, ll); break;
+		case 4: next = FixedOrder<3, 3>::dispatch(lv, state, n, ll); break;
+		case 5: next = FixedOrder<4, 4>::dispatch(lv, state, n, ll); break;
+		case 6: next = FixedOrder<5, 5>::dispatch(lv, state, n, ll); break;
+		default:
+			ll = state->getLL(lv, n, orderN - 1);
+			return nextState(state, n);
+		}
+		KNLM_STAT(stats::local().endToken(ll));
+		return next;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	template<typename _Fn>
+	bool KNLangModel<_WType, _Map>::walkFixed(const _WType * seq, size_t len, _Fn&& fn) const
+	{
+		switch (orderN)
+		{
+		case 2: walkFixed<1>(seq, len, fn); return true;
+		case 3: walkFixed<2>(seq, len, fn); return true;
+		case 4: walkFixed<3>(seq, len, fn); return true;
+		case 5: walkFixed<4>(seq, len, fn); return true;
+		case 6: walkFixed<5>(seq, len, fn); return true;
+		}
+		return false;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	template<size_t _Leaf, typename _Fn>
+	void KNLangModel<_WType, _Map>::walkFixed(const _WType * seq, size_t len, _Fn&& fn) const
+	{
+		const BakedNode* cNode = &bakedNodes[0];
+		for (size_t i = 0; i < len; ++i)
+		{
+			float ll;
+			cNode = FixedOrder<_Leaf, _Leaf>::dispatch(getLevels(), cNode, seq[i], ll);
+			KNLM_STAT(stats::local().endToken(ll));
+			fn(i, ll);
+		}
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	float KNLangModel<_WType, _Map>::evaluateLLSent(const _WType * seq, size_t len, float minValue) const
+	{
+		KNLM_STAT(stats::CallScope scope{ stats::Query::sent });
 		float score = 0;
+		if (walkFixed(seq, len, [&](size_t i, float ll)
+		{
+			if (i) score += max(ll, minValue);
+		})) return score;
+
+		const KNLangModel::BakedNode* cNode = &bakedNodes[0];
 		for (size_t i = 0; i < len; ++i)
 		{
-			if(i) score += max(cNode->getLL(seq[i], orderN - 1), minValue);
-			if (cNode->depth == orderN - 1) cNode = cNode->getLower();
-			auto nextNode = cNode->getNextFromBaked(seq[i]);
-			while (!nextNode)
+			if(i) score += max(cNode->getLL(getLevels(), seq[i], orderN - 1), minValue);
+			cNode = nextState(cNode, seq[i]);
+		}
+		return score;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::evaluateLLSentBatch(const _WType* const* seqs, const size_t* lens, size_t n, float* out, float minValue, size_t groupSize) const
+	{
+		KNLM_STAT(stats::CallScope scope{ stats::Query::batch });
+		// Scores many sentences at once, advancing up to groupSize of them in round-robin.
+		// Each step of a query issues a prefetch for the memory its next step will touch and yields to the others,
+		// so the cache misses of independent queries overlap instead of being paid one after another.
+		enum class Phase : uint8_t { fetchMap, probe, readLL };
+		struct Query
+		{
+			size_t idx, i;
+			const BakedNode *cNode, *probe;
+			size_t numBackoff;
+			float score;
+			Phase phase;
+		};
+
+		auto lv = getLevels();
+		size_t nextIdx = 0;
+		auto startQuery = [&](Query& q) -> bool
+		{
+			for (; nextIdx < n; ++nextIdx)
 			{
-				cNode = cNode->getLower();
-				if (!cNode) break;
-				nextNode = cNode->getNextFromBaked(seq[i]);
+				if (lens[nextIdx] <= 1)
+				{
+					out[nextIdx] = 0;
+					continue;
+				}
+				q.idx = nextIdx++;
+				q.i = 1;
+				q.cNode = q.probe = nextState(&bakedNodes[0], seqs[q.idx][0]);
+				q.numBackoff = 0;
+				q.score = 0;
+				q.phase = Phase::fetchMap;
+				prefetchRead(q.probe);
+				return true;
+			}
+			return false;
+		};
+
+		vector<Query> group(max(groupSize, (size_t)1));
+		size_t active = 0;
+		while (active < group.size() && startQuery(group[active])) ++active;
+
+		while (active)
+		{
+			for (size_t g = 0; g < active; )
+			{
+				Query& q = group[g];
+				_WType w = seqs[q.idx][q.i];
+				const BakedNode* found = nullptr;
+				float ll;
+				if (q.phase == Phase::fetchMap)
+				{
+					q.probe->prefetchNext(lv, w);
+					q.phase = Phase::probe;
+					++g;
+					continue;
+				}
+				else if (q.phase == Phase::probe)
+				{
+					if (q.probe->depth == orderN - 1)
+					{
+						union { uint32_t t; float u; };
+						t = q.probe->findNext(lv, w);
+						if (!t)
+						{
+							q.probe = q.probe->getLower(lv);
+							if (q.probe)
+							{
+								++q.numBackoff;
+								prefetchRead(q.probe);
+								q.phase = Phase::fetchMap;
+								++g;
+								continue;
+							}
+							u = -INFINITY;
+						}
+						ll = u;
+					}
+					else
+					{
+						found = q.probe->getNextFromBaked(lv, w);
+						if (found)
+						{
+							prefetchRead(&found->ll);
+							q.probe = found;
+							q.phase = Phase::readLL;
+							++g;
+							continue;
+						}
+						q.probe = q.probe->getLower(lv);
+						if (q.probe)
+						{
+							++q.numBackoff;
+							prefetchRead(q.probe);
+							q.phase = Phase::fetchMap;
+							++g;
+							continue;
+						}
+						ll = -INFINITY;
+					}
+				}
+				else
+				{
+					found = q.probe;
+					ll = found->ll;
+				}
+
+				if (q.probe) ll = q.cNode->addBackoff(lv, q.numBackoff, ll);
+				KNLM_STAT(stats::local().endToken(ll, q.probe ? q.numBackoff : 0));
+				q.score += max(ll, minValue);
+				// the node found while scoring is exactly the next state unless the context was a leaf
+				if (q.cNode->depth == orderN - 1 || !found) q.cNode = nextState(q.cNode, w);
+				else q.cNode = found->getState(lv);
+
+				if (++q.i < lens[q.idx])
+				{
+					q.probe = q.cNode;
+					q.numBackoff = 0;
+					q.phase = Phase::fetchMap;
+					prefetchRead(q.probe);
+					++g;
+					continue;
+				}
+				out[q.idx] = q.score;
+				if (!startQuery(q))
+				{
+					q = group[--active];
+				}
+				else ++g;
 			}
-			cNode = nextNode ? nextNode : &nodes[0];
 		}
-		return score;
 	}
 
-	template<typename _WType>
-	vector<float> KNLangModel<_WType>::evaluateLLEachWord(const _WType * seq, size_t len) const
+	template<typename _WType, template<class, class> class _Map>
+	vector<float> KNLangModel<_WType, _Map>::evaluateLLEachWord(const _WType * seq, size_t len) const
 	{
-		const KNLangModel::Node* cNode = &nodes[0];
+		KNLM_STAT(stats::CallScope scope{ stats::Query::eachWord });
 		vector<float> score;
+		if (walkFixed(seq, len, [&](size_t, float ll)
+		{
+			score.emplace_back(ll);
+		})) return score;
+
+		const KNLangModel::BakedNode* cNode = &bakedNodes[0];
 		for (size_t i = 0; i < len; ++i)
 		{
-			score.emplace_back(cNode->getLL(seq[i], orderN - 1));
-			if (cNode->depth == orderN - 1) cNode = cNode->getLower();
-			auto nextNode = cNode->getNextFromBaked(seq[i]);
-			while (!nextNode)
+			score.emplace_back(cNode->getLL(getLevels(), seq[i], orderN - 1));
+			cNode = nextState(cNode, seq[i]);
+		}
+		return score;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	vector<float> KNLangModel<_WType, _Map>::evaluateLLNBest(const vector<vector<_WType>>& hyps, float minValue, vector<vector<float>>* eachWord) const
+	{
+		KNLM_STAT(stats::CallScope scope{ stats::Query::nbest });
+		// visit hypotheses in lexicographic order so that each one only has to walk
+		// the part which differs from the previous one.
+		vector<size_t> order(hyps.size());
+		for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+		sort(order.begin(), order.end(), [&](size_t a, size_t b)
+		{
+			return hyps[a] < hyps[b];
+		});
+
+		vector<float> ret(hyps.size());
+		if (eachWord) eachWord->resize(hyps.size());
+		// states[k] and scores[k] hold the context node and the total score after consuming k words
+		vector<const BakedNode*> states{ &bakedNodes[0] };
+		vector<float> scores{ 0 }, lls{ 0 };
+		const vector<_WType>* prev = nullptr;
+		for (auto i : order)
+		{
+			auto& seq = hyps[i];
+			size_t common = 0;
+			if (prev)
+			{
+				size_t maxCommon = min(prev->size(), seq.size());
+				while (common < maxCommon && (*prev)[common] == seq[common]) ++common;
+			}
+			states.resize(common + 1);
+			scores.resize(common + 1);
+			lls.resize(common + 1);
+			for (size_t j = common; j < seq.size(); ++j)
 			{
-				cNode = cNode->getLower();
-				if (!cNode) break;
-				nextNode = cNode->getNextFromBaked(seq[i]);
+				const BakedNode* cNode = states.back();
+				float ll = j ? cNode->getLL(getLevels(), seq[j], orderN - 1) : 0;
+				lls.emplace_back(ll);
+				scores.emplace_back(j ? scores.back() + max(ll, minValue) : 0);
+				states.emplace_back(nextState(cNode, seq[j]));
 			}
-			cNode = nextNode ? nextNode : &nodes[0];
+			ret[i] = scores[seq.size()];
+			if (eachWord && !seq.empty()) (*eachWord)[i].assign(lls.begin() + 2, lls.begin() + seq.size() + 1);
+			prev = &seq;
 		}
-		return score;
+		return ret;
 	}
 
-	template<typename _WType>
-	float KNLangModel<_WType>::branchingEntropy(const _WType * seq, size_t len) const
+	template<typename _WType, template<class, class> class _Map>
+	vector<float> KNLangModel<_WType, _Map>::evaluateLLTree(const _WType* tokens, const int32_t* parents, size_t len, float minValue) const
 	{
-		const Node* n = nullptr;
-		for (size_t i = max(len, orderN - 1) - orderN + 1; i < len && !(n = nodes[0].getFromBaked(seq + i, seq + len)); ++i);
-		if (!n) n = &nodes[0];
+		KNLM_STAT(stats::CallScope scope{ stats::Query::tree });
+		// each entry extends the hypothesis ending at parents[i] (or starts a new one if it is negative) with tokens[i].
+		// parents have to precede their children. returns the total score of the hypothesis ending at each entry.
+		vector<const BakedNode*> states(len);
+		vector<float> scores(len);
+		for (size_t i = 0; i < len; ++i)
+		{
+			if (parents[i] < 0)
+			{
+				scores[i] = 0;
+				states[i] = nextState(&bakedNodes[0], tokens[i]);
+				continue;
+			}
+			assert((size_t)parents[i] < i);
+			const BakedNode* cNode = states[parents[i]];
+			scores[i] = scores[parents[i]] + max(cNode->getLL(getLevels(), tokens[i], orderN - 1), minValue);
+			states[i] = nextState(cNode, tokens[i]);
+		}
+		return scores;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	float KNLangModel<_WType, _Map>::decodeLattice(const LatticeEdge* edges, size_t numEdges, size_t length, vector<size_t>& path,
+		_WType bos, _WType eos, float minValue, size_t beamSize) const
+	{
+		KNLM_STAT(stats::CallScope scope{ stats::Query::lattice });
+		// Viterbi search over positions [0, length]. hypotheses reaching the same position with the same context node
+		// are recombined, so the search is exact unless beamSize limits the number of hypotheses kept per position.
+		struct Hypothesis
+		{
+			float score;
+			const BakedNode* state;
+			size_t edge, prev;
+		};
+
+		vector<vector<size_t>> edgesFrom(length + 1);
+		for (size_t i = 0; i < numEdges; ++i)
+		{
+			if (edges[i].begin >= edges[i].end || edges[i].end > length) throw out_of_range{ "invalid lattice edge" };
+			edgesFrom[edges[i].begin].emplace_back(i);
+		}
+
+		vector<Hypothesis> hyps;
+		vector<unordered_map<const BakedNode*, size_t>> chart(length + 1);
+		hyps.push_back({ 0, bos == npos ? &bakedNodes[0] : nextState(&bakedNodes[0], bos), (size_t)-1, (size_t)-1 });
+		chart[0].emplace(hyps[0].state, 0);
+		vector<size_t> alive;
+		for (size_t pos = 0; pos < length; ++pos)
+		{
+			alive.clear();
+			for (auto& p : chart[pos]) alive.emplace_back(p.second);
+			if (beamSize && alive.size() > beamSize)
+			{
+				nth_element(alive.begin(), alive.begin() + beamSize, alive.end(), [&](size_t a, size_t b)
+				{
+					return hyps[a].score > hyps[b].score;
+				});
+				alive.resize(beamSize);
+			}
+
+			for (auto h : alive)
+			{
+				for (auto e : edgesFrom[pos])
+				{
+					const BakedNode* cNode = hyps[h].state;
+					float score = hyps[h].score + max(cNode->getLL(getLevels(), edges[e].wid, orderN - 1), minValue);
+					const BakedNode* state = nextState(cNode, edges[e].wid);
+					auto it = chart[edges[e].end].find(state);
+					if (it == chart[edges[e].end].end())
+					{
+						chart[edges[e].end].emplace(state, hyps.size());
+						hyps.push_back({ score, state, e, h });
+					}
+					else if (hyps[it->second].score < score)
+					{
+						hyps[it->second] = { score, state, e, h };
+					}
+				}
+			}
+		}
+
+		path.clear();
+		size_t best = (size_t)-1;
+		float bestScore = -INFINITY;
+		for (auto& p : chart[length])
+		{
+			float score = hyps[p.second].score;
+			if (eos != npos) score += max(p.first->getLL(getLevels(), eos, orderN - 1), minValue);
+			if (best == (size_t)-1 || score > bestScore)
+			{
+				best = p.second;
+				bestScore = score;
+			}
+		}
+		if (best == (size_t)-1) return -INFINITY;
+		for (size_t h = best; hyps[h].edge != (size_t)-1; h = hyps[h].prev) path.emplace_back(hyps[h].edge);
+		reverse(path.begin(), path.end());
+		return bestScore;
+	}
+
+	template<typename _WType, template<class, class> class _Map>
+	float KNLangModel<_WType, _Map>::branchingEntropy(const _WType * seq, size_t len) const
+	{
+		KNLM_STAT(stats::CallScope scope{ stats::Query::entropy });
+		const BakedNode* n = nullptr;
+		for (size_t i = max(len, orderN - 1) - orderN + 1; i < len && !(n = bakedNodes[0].getFromBaked(getLevels(), seq + i, seq + len)); ++i);
+		if (!n) n = &bakedNodes[0];
 		float entropy = 0;
-		for (_WType w = 0; w < vocabSize; ++w)
+		for (size_t w = 0; w < vocabSize; ++w)
 		{
-			float p = n->getLL(w, orderN - 1);
+			float p = n->getLL(getLevels(), w, orderN - 1);
 			if (isinf(p)) continue;
 			entropy -= p * exp(p);
 		}
 		return entropy;
 	}
 
-	template<typename _WType>
-	void KNLangModel<_WType>::printStat() const
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::printStat() const
 	{
 		float llMin = INFINITY, llMax = -INFINITY;
 		float gMin = INFINITY, gMax = -INFINITY;
-		for (size_t i = 0; i < nodes.size(); ++i)
+		for (size_t i = 0; i < bakedNodes.size(); ++i)
 		{
-			auto& n = nodes[i];
+			auto& n = bakedNodes[i];
 			if (isnormal(n.ll))
 			{
 				llMin = min(n.ll, llMin);
@@ -546,67 +1889,100 @@ namespace knlm
 		}
 		cout << llMin << '\t' << llMax << endl;
 		cout << gMin << '\t' << gMax << endl;
+		cout << bakedNodes.size() << " nodes * " << sizeof(BakedNode) << " bytes" << endl;
 	}
 
-	void writeNegFixed16(ostream& os, float v)
-	{
-		assert(v <= 0);
-		auto dv = (uint16_t)min(-v * (1 << 12), 65535.f);
-		writeToBinStream(os, dv);
-	}
-
-	float readNegFixed16(istream& is)
-	{
-		auto dv = readFromBinStream<uint16_t>(is);
-		return -(dv / float(1 << 12));
-	}
+	void writeNegFixed16(ostream& os, float v);
+	float readNegFixed16(istream& is);
 
-	template<typename _WType>
-	void KNLangModel<_WType>::Node::writeToStream(ostream & str, size_t leafDepth) const
+	template<typename _WType, template<class, class> class _Map>
+	void KNLangModel<_WType, _Map>::BakedNode::writeToStream(ostream & str, size_t leafDepth) const
 	{
-		writeVToBinStream(str, -parent);
-		writeSVToBinStream(str, lower);
+		writeVToBinStream(str, lower);
 		writeNegFixed16(str, ll);
 		writeNegFixed16(str, gamma);
 		writeToBinStream(str, depth);
 
-		uint32_t size = bakedNext.size();
+		uint32_t size = next.size();
 		writeVToBinStream(str, size);
-		for (auto p : bakedNext)
+		for (auto p : next)
 		{
 			writeVToBinStream(str, p.first);
-			if (depth < leafDepth - 1) writeVToBinStream(str, p.second);
+			if (depth < leafDepth - 1) writeVToBinStream(str, p.second - 1);
 			else writeNegFixed16(str, *(float*)&p.second);
 		}
 	}
 
-	template<typename _WType>
-	typename KNLangModel<_WType>::Node KNLangModel<_WType>::Node::readFromStream(istream & str, size_t leafDepth)
+	template<typename _WType, template<class, class> class _Map>
+	typename KNLangModel<_WType, _Map>::BakedNode KNLangModel<_WType, _Map>::BakedNode::readFromStream(istream & str, size_t leafDepth, const vector<BakedMapLayout>& layouts, bool relative)
 	{
-		Node n(true);
-		n.parent = -(int32_t)readVFromBinStream(str);
-		n.lower = readSVFromBinStream(str);
+		BakedNode n;
+		if (relative)
+		{
+			readVFromBinStream(str); // parent
+			n.lower = readSVFromBinStream(str);
+		}
+		else n.lower = readVFromBinStream(str);
 		n.ll = readNegFixed16(str);
 		n.gamma = readNegFixed16(str);
 		readFromBinStream(str, n.depth);
 
 		uint32_t size = readVFromBinStream(str);
-		vector<pair<_WType, int32_t>> tNext;
+		vector<pair<_WType, uint32_t>> tNext;
 		tNext.reserve(size);
 		for (size_t i = 0; i < size; ++i)
 		{
-			pair<_WType, int32_t> p;
+			pair<_WType, uint32_t> p;
 			p.first = readVFromBinStream(str);
-			if (n.depth < leafDepth - 1) p.second = readVFromBinStream(str);
+			if (n.depth < leafDepth - 1) p.second = readVFromBinStream(str) + (relative ? 0 : 1);
 			else
 			{
 				float f = readNegFixed16(str);
-				p.second = *(int32_t*)&f;
+				memcpy(&p.second, &f, sizeof(f));
 			}
 			tNext.emplace_back(move(p));
 		}
-		n.bakedNext = BakedMap<_WType, int32_t>{ tNext.begin(), tNext.end(), true };
+		if (!is_sorted(tNext.begin(), tNext.end())) sort(tNext.begin(), tNext.end());
+		n.next = BakedNext{ tNext.begin(), tNext.end(), n.depth < layouts.size() ? layouts[n.depth] : BakedMapLayout{} };
 		return n;
 	}
 
-}
\ No newline at end of file
+	template<typename _WType, template<class, class> class _Map>
+	float KNLangModel<_WType, _Map>::BakedNode::readLL(istream & str, size_t leafDepth)
+	{
+		readVFromBinStream(str);
+		float ll = readNegFixed16(str);
+		readNegFixed16(str);
+		uint8_t depth = readFromBinStream<uint8_t>(str);
+		uint32_t size = readVFromBinStream(str);
+		for (size_t i = 0; i < size; ++i)
+		{
+			readVFromBinStream(str);
+			if (depth < leafDepth - 1) readVFromBinStream(str);
+			else str.ignore(sizeof(uint16_t));
+		}
+		return ll;
+	}
+
+	// reads the size of word ids from the head of a model file, leaving the stream where it was
+	size_t readWordSize(istream& is);
+
+	// a model with word ids of wordSize bytes (1, 2 or 4)
+	unique_ptr<IModel> createModel(size_t wordSize, size_t order = 3);
+	// a model read from the stream, with the word width it was written with and with the n-grams up to maxOrder if it is given
+	unique_ptr<IModel> readModel(istream&& is, size_t maxOrder = 0);
+	// a model viewing the image file written by IModel::writeImage
+	unique_ptr<IModel> mapModel(const string& path);
+	// KNLangModel::withFilterBits() of a model of any word width
+	shared_ptr<IModel> withFilterBits(shared_ptr<const IModel> mdl, size_t bitsPerKey);
+	// writes the image of the model to a temporary file renamed over path, so that processes mapping the old image keep it intact
+	void writeImageFile(const IModel& mdl, const string& path);
+	bool isModelImage(const string& path);
+	// a model from either a model file or an image. images are mapped with all their orders, so maxOrder applies to model files only
+	unique_ptr<IModel> loadModel(const string& path, size_t maxOrder = 0);
+
+	// instantiated in KNLangModel.cpp
+	extern template class KNLangModel<uint8_t>;
+	extern template class KNLangModel<uint16_t>;
+	extern template class KNLangModel<uint32_t>;
+}
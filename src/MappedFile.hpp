@@ -0,0 +1,167 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cassert>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace knlm
+{
+	/*
+	A file mapped read-only into memory. Processes mapping the same file share its pages,
+	so a file on a memory filesystem such as /dev/shm works as a named shared memory segment.
+	*/
+	class MappedFile
+	{
+		std::string path;
+		const char* ptr = nullptr;
+		size_t length = 0;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+
+	public:
+		explicit MappedFile(const std::string& _path) : path(_path)
+		{
+#ifdef _WIN32
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE) throw std::runtime_error{ "cannot read " + path };
+			LARGE_INTEGER size;
+			GetFileSizeEx(file, &size);
+			length = (size_t)size.QuadPart;
+			if (length) mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping) ptr = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			if (length && !ptr)
+			{
+				if (mapping) CloseHandle(mapping);
+				CloseHandle(file);
+				throw std::runtime_error{ "cannot map " + path };
+			}
+#else
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) throw std::runtime_error{ "cannot read " + path };
+			struct stat st;
+			if (fstat(fd, &st) < 0)
+			{
+				close(fd);
+				throw std::runtime_error{ "cannot read " + path };
+			}
+			length = st.st_size;
+			void* p = length ? mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+			close(fd);
+			if (p == MAP_FAILED) throw std::runtime_error{ "cannot map " + path };
+			ptr = (const char*)p;
+#endif
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		~MappedFile()
+		{
+#ifdef _WIN32
+			if (ptr) UnmapViewOfFile(ptr);
+			if (mapping) CloseHandle(mapping);
+			CloseHandle(file);
+#else
+			if (ptr) munmap((void*)ptr, length);
+#endif
+		}
+
+		const std::string& getPath() const { return path; }
+		const char* data() const { return ptr; }
+		size_t size() const { return length; }
+	};
+
+	/*
+	Elements owned in a vector, or viewed read-only in memory kept alive by someone else, such as a mapped model image.
+	Viewed elements are never destroyed nor modified. Mutating the array drops the view first.
+	*/
+	template<class T>
+	class ViewableVector
+	{
+		std::vector<T> owned;
+		T* viewed = nullptr;
+		size_t numViewed = 0;
+
+	public:
+		ViewableVector() = default;
+
+		explicit ViewableVector(size_t n) : owned(n)
+		{
+		}
+
+		void view(const T* p, size_t n)
+		{
+			std::vector<T>{}.swap(owned);
+			viewed = (T*)p;
+			numViewed = n;
+		}
+
+		bool isView() const { return viewed != nullptr; }
+
+		size_t size() const { return viewed ? numViewed : owned.size(); }
+		bool empty() const { return !size(); }
+		size_t capacity() const { return viewed ? numViewed : owned.capacity(); }
+
+		T* begin()
+		{
+			assert(!viewed);
+			return owned.data();
+		}
+		T* end() { return begin() + size(); }
+		const T* begin() const { return viewed ? viewed : owned.data(); }
+		const T* end() const { return begin() + size(); }
+
+		T& operator[](size_t i)
+		{
+			assert(!viewed);
+			return owned[i];
+		}
+		const T& operator[](size_t i) const { return begin()[i]; }
+
+		void clear()
+		{
+			std::vector<T>{}.swap(owned);
+			viewed = nullptr;
+			numViewed = 0;
+		}
+
+		void reserve(size_t n)
+		{
+			if (viewed) clear();
+			owned.reserve(n);
+		}
+
+		void resize(size_t n)
+		{
+			if (viewed) clear();
+			owned.resize(n);
+		}
+
+		template<typename... Args>
+		void emplace_back(Args&&... args)
+		{
+			if (viewed) clear();
+			owned.emplace_back(std::forward<Args>(args)...);
+		}
+
+		void swap(ViewableVector& o)
+		{
+			owned.swap(o.owned);
+			std::swap(viewed, o.viewed);
+			std::swap(numViewed, o.numViewed);
+		}
+	};
+}
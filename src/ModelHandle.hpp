@@ -0,0 +1,163 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include "KNLangModel.hpp"
+
+namespace knlm
+{
+	/*
+	A model served to queries, which can be replaced while they are running.
+	Queries take a reference to the current model with get() and keep it until they are done,
+	so a swap never waits for them: queries started before it finish on the old model,
+	which is freed when the last of them drops its reference, and later ones see the new model.
+	A model is never changed once it is served. Changes are made on a copy swapped in by update().
+	*/
+	class ModelHandle
+	{
+		struct State
+		{
+			std::shared_ptr<IModel> model;
+			std::atomic<size_t> requests{ 0 };
+			std::mutex updating; // held by update() from deriving the model to swapping it in, so that no update drops another
+			std::mutex lock; // serializes swaps and guards the members below
+			size_t installed = 0, generation = 0;
+			std::string error;
+			std::function<void(IModel&)> prepare;
+			// increases with every change of prepare
+			size_t prepareVersion = 0;
+		};
+		std::shared_ptr<State> state = std::make_shared<State>();
+		static constexpr size_t unprepared = (size_t)-1;
+
+		/*
+		Swaps in mdl, prepared by the version of prepare given. A model prepared by an older version, such as one read
+		by a reload while prepare was being changed, is prepared again before it is served.
+		A reload finishing after a later set(), update() or reload() must not overwrite its model.
+		*/
+		static void install(State& s, size_t request, std::shared_ptr<IModel> mdl, size_t prepared)
+		{
+			while (true)
+			{
+				std::function<void(IModel&)> prepare;
+				{
+					std::lock_guard<std::mutex> guard{ s.lock };
+					if (request < s.installed) return;
+					if (prepared == s.prepareVersion)
+					{
+						std::atomic_store(&s.model, std::move(mdl));
+						s.installed = request;
+						++s.generation;
+						s.error.clear();
+						return;
+					}
+					prepare = s.prepare;
+					prepared = s.prepareVersion;
+				}
+				if (prepare) prepare(*mdl);
+			}
+		}
+
+		static void load(State& s, size_t request, const std::string& path, size_t maxOrder)
+		{
+			install(s, request, loadModel(path, maxOrder), unprepared);
+		}
+
+	public:
+		ModelHandle() = default;
+		explicit ModelHandle(std::shared_ptr<IModel> mdl)
+		{
+			set(std::move(mdl));
+		}
+
+		// the current model, which stays valid while the returned pointer is held
+		std::shared_ptr<IModel> get() const
+		{
+			return std::atomic_load(&state->model);
+		}
+
+		// swaps in mdl, which must not be served yet, after preparing it as setPrepare() asks
+		void set(std::shared_ptr<IModel> mdl)
+		{
+			install(*state, ++state->requests, std::move(mdl), unprepared);
+		}
+
+		/*
+		Swaps in derive(the current model), a changed copy which the queries running on the current one never see.
+		With prepare, it becomes the hook of setPrepare(), so the models of later reloads are changed in the same way,
+		as are the ones read by reloads running meanwhile. derive() must return a copy already prepared so.
+		Updates run one at a time, each deriving from the model swapped in by the one before.
+		*/
+		void update(const std::function<std::shared_ptr<IModel>(const std::shared_ptr<IModel>&)>& derive, std::function<void(IModel&)> prepare = {})
+		{
+			std::lock_guard<std::mutex> serial{ state->updating };
+			size_t request = ++state->requests;
+			auto mdl = derive(get());
+			size_t version;
+			{
+				std::lock_guard<std::mutex> guard{ state->lock };
+				if (prepare)
+				{
+					state->prepare = std::move(prepare);
+					++state->prepareVersion;
+				}
+				version = state->prepareVersion;
+			}
+			install(*state, request, std::move(mdl), version);
+		}
+
+		// increases with every model swapped in
+		size_t getGeneration() const
+		{
+			std::lock_guard<std::mutex> guard{ state->lock };
+			return state->generation;
+		}
+
+		// why the last background reload failed, or empty if the last one succeeded
+		std::string getError() const
+		{
+			std::lock_guard<std::mutex> guard{ state->lock };
+			return state->error;
+		}
+
+		// called on each model read by reload() or given to set() before it is swapped in, such as to build its filters
+		void setPrepare(std::function<void(IModel&)> prepare)
+		{
+			std::lock_guard<std::mutex> guard{ state->lock };
+			state->prepare = std::move(prepare);
+			++state->prepareVersion;
+		}
+
+		/*
+		Reads the model file, or maps the model image, and swaps it in.
+		In the background, the current model keeps serving until the new one is ready, and a failure leaves it in place
+		and is reported by getError(). Otherwise the model is read on this thread and failures are thrown.
+		maxOrder, if given, reads the n-grams of a model file up to it only.
+		*/
+		void reload(const std::string& path, bool background = true, size_t maxOrder = 0)
+		{
+			size_t request = ++state->requests;
+			if (!background)
+			{
+				load(*state, request, path, maxOrder);
+				return;
+			}
+			std::shared_ptr<State> s = state;
+			std::thread{ [s, path, request, maxOrder]()
+			{
+				try
+				{
+					load(*s, request, path, maxOrder);
+				}
+				catch (const std::exception& e)
+				{
+					std::lock_guard<std::mutex> guard{ s->lock };
+					if (request >= s->installed) s->error = e.what();
+				}
+			} }.detach();
+		}
+	};
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+
+/*
+Counters of the query paths, compiled in only when KNLM_STATS is defined.
+Each thread counts into its own slot without locking. collect() sums the slots of all threads.
+Counts of finished threads are kept, and reset() only moves the baseline, so it never races with the counting threads.
+*/
+#ifdef KNLM_STATS
+#define KNLM_STAT(stmt) stmt
+#else
+#define KNLM_STAT(stmt)
+#endif
+
+namespace knlm
+{
+	using namespace std;
+
+	namespace stats
+	{
+		enum class Query : uint8_t
+		{
+			evaluate, sent, eachWord, batch, nbest, tree, lattice, predict, entropy, size
+		};
+
+		static const size_t numQueries = (size_t)Query::size;
+		static const size_t maxBackoff = 8;
+		// bucket i counts calls taking [2^i, 2^(i+1)) nanoseconds
+		static const size_t latencyBuckets = 32;
+
+		inline const char* queryName(Query q)
+		{
+			static const char* names[] = { "evaluate", "evaluateSent", "evaluateEachWord", "evaluateSentBatch",
+				"evaluateNBest", "evaluateTree", "decodeLattice", "predictNext", "branchingEntropy" };
+			return names[(size_t)q];
+		}
+
+		struct Snapshot
+		{
+			enum : size_t
+			{
+				tokens, oov, denseHits, sparseSearches,
+				// lookups a filter ruled out, lookups it let through, and those of them which found nothing
+				filterNegatives, filterPositives, filterFalsePositives,
+				backoff, // histogram of backoffs per scored token. the last bucket also counts longer chains
+				calls = backoff + maxBackoff,
+				latency = calls + numQueries,
+				size = latency + numQueries * latencyBuckets,
+			};
+
+			uint64_t v[size] = { 0, };
+
+			uint64_t callsOf(Query q) const { return v[calls + (size_t)q]; }
+			const uint64_t* latencyOf(Query q) const { return v + latency + (size_t)q * latencyBuckets; }
+
+			Snapshot& operator+=(const Snapshot& o)
+			{
+				for (size_t i = 0; i < size; ++i) v[i] += o.v[i];
+				return *this;
+			}
+
+			Snapshot& operator-=(const Snapshot& o)
+			{
+				for (size_t i = 0; i < size; ++i) v[i] -= o.v[i];
+				return *this;
+			}
+		};
+
+		class ThreadCounters;
+
+		class Registry
+		{
+			friend class ThreadCounters;
+			mutex m;
+			set<const ThreadCounters*> live;
+			Snapshot retired, base;
+		public:
+			static Registry& get()
+			{
+				static Registry r;
+				return r;
+			}
+
+			Snapshot collect();
+			void reset();
+		};
+
+		class ThreadCounters
+		{
+			atomic<uint64_t> v[Snapshot::size];
+			size_t pendingBackoff = 0;
+
+			void inc(size_t i, uint64_t n = 1)
+			{
+				// only the owner thread writes, so no locked instruction is needed
+				v[i].store(v[i].load(memory_order_relaxed) + n, memory_order_relaxed);
+			}
+		public:
+			ThreadCounters()
+			{
+				for (auto& c : v) c.store(0, memory_order_relaxed);
+				auto& r = Registry::get();
+				lock_guard<mutex> lock{ r.m };
+				r.live.insert(this);
+			}
+
+			~ThreadCounters()
+			{
+				auto& r = Registry::get();
+				lock_guard<mutex> lock{ r.m };
+				addTo(r.retired);
+				r.live.erase(this);
+			}
+
+			void addTo(Snapshot& s) const
+			{
+				for (size_t i = 0; i < Snapshot::size; ++i) s.v[i] += v[i].load(memory_order_relaxed);
+			}
+
+			void denseHit() { inc(Snapshot::denseHits); }
+			void sparseSearch() { inc(Snapshot::sparseSearches); }
+			void filterNegative() { inc(Snapshot::filterNegatives); }
+
+			void filterPositive(bool missing)
+			{
+				inc(Snapshot::filterPositives);
+				if (missing) inc(Snapshot::filterFalsePositives);
+			}
+
+			void backoff() { ++pendingBackoff; }
+
+			void endToken(float ll)
+			{
+				endToken(ll, pendingBackoff);
+				pendingBackoff = 0;
+			}
+
+			void endToken(float ll, size_t numBackoff)
+			{
+				inc(Snapshot::tokens);
+				if (ll == -INFINITY) inc(Snapshot::oov);
+				inc(Snapshot::backoff + min(numBackoff, maxBackoff - 1));
+			}
+
+			void endCall(Query q, uint64_t ns)
+			{
+				size_t bucket = 0;
+				while (bucket < latencyBuckets - 1 && (ns >> (bucket + 1))) ++bucket;
+				inc(Snapshot::calls + (size_t)q);
+				inc(Snapshot::latency + (size_t)q * latencyBuckets + bucket);
+			}
+		};
+
+		inline Snapshot Registry::collect()
+		{
+			lock_guard<mutex> lock{ m };
+			Snapshot s = retired;
+			for (auto* t : live) t->addTo(s);
+			s -= base;
+			return s;
+		}
+
+		inline void Registry::reset()
+		{
+			Snapshot s = collect();
+			lock_guard<mutex> lock{ m };
+			base += s;
+		}
+
+		inline ThreadCounters& local()
+		{
+			static thread_local ThreadCounters t;
+			return t;
+		}
+
+		inline Snapshot collect()
+		{
+			return Registry::get().collect();
+		}
+
+		inline void reset()
+		{
+			Registry::get().reset();
+		}
+
+		// records one call of q with its latency when it goes out of scope
+		class CallScope
+		{
+			Query q;
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		public:
+			CallScope(Query _q) : q(_q)
+			{
+			}
+
+			~CallScope()
+			{
+				auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+				local().endCall(q, ns);
+			}
+		};
+	}
+}
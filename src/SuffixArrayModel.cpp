@@ -0,0 +1,30 @@
+#include "SuffixArrayModel.hpp"
+
+namespace knlm
+{
+	unique_ptr<ISuffixArrayModel> createSuffixArrayModel(size_t wordSize, size_t order)
+	{
+		switch (wordSize)
+		{
+		case 1: return unique_ptr<ISuffixArrayModel>{ new SuffixArrayModel<uint8_t>{ order } };
+		case 2: return unique_ptr<ISuffixArrayModel>{ new SuffixArrayModel<uint16_t>{ order } };
+		case 4: return unique_ptr<ISuffixArrayModel>{ new SuffixArrayModel<uint32_t>{ order } };
+		default: throw runtime_error{ "wordSize must be 1, 2 or 4" };
+		}
+	}
+
+	unique_ptr<ISuffixArrayModel> readSuffixArrayModel(istream&& is)
+	{
+		is.exceptions(istream::failbit | istream::badbit);
+		auto pos = is.tellg();
+		if (readFromBinStream<uint32_t>(is) != suffixArrayMagic) throw runtime_error{ "read failed. not a suffix array model" };
+		auto mdl = createSuffixArrayModel(readFromBinStream<uint32_t>(is));
+		is.seekg(pos);
+		mdl->readFromStream(move(is));
+		return mdl;
+	}
+
+	template class SuffixArrayModel<uint8_t>;
+	template class SuffixArrayModel<uint16_t>;
+	template class SuffixArrayModel<uint32_t>;
+}
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include "KNLangModel.hpp"
+
+namespace knlm
+{
+	using namespace std;
+
+	// "KNSA" at the head of suffix array model files
+	static const uint32_t suffixArrayMagic = 0x41534E4B;
+
+	class ISuffixArrayModel
+	{
+	public:
+		// the byte width of word ids
+		virtual size_t getWordSize() const = 0;
+		virtual size_t getVocabSize() const = 0;
+		// the longest n-gram used, or 0 if there is no limit
+		virtual size_t getOrder() const = 0;
+		// words of the training text, with a separator after each sentence
+		virtual size_t getNumTokens() const = 0;
+		virtual size_t getCachedContexts() const = 0;
+		virtual Vocab& getVocab() = 0;
+		virtual const Vocab& getVocab() const = 0;
+		// builds the suffix array and the discounts of every order from the training text
+		virtual void optimize() = 0;
+		virtual void writeToStream(ostream&& str) const = 0;
+		virtual void readFromStream(istream&& str) = 0;
+
+		virtual ~ISuffixArrayModel() {};
+	};
+
+	/*
+	A Kneser-Ney model of unbounded order, estimated at query time from a suffix array of the training text
+	instead of a trie of every n-gram. Its size grows with the text, not with the order.
+	Estimates are those of KNLangModel: modified discounts of each order, raw counts for contexts and continuation counts
+	for unigrams, so both models give the same scores for the same order. The context of a word is the longest suffix
+	of its history occurring in the text, up to order - 1 words, or of any length if order is 0.
+	Counting the followers of a context takes a search for each distinct one, so backoff weights of contexts hit by queries are cached.
+	*/
+	template<typename _WType = uint16_t>
+	class SuffixArrayModel : public ISuffixArrayModel
+	{
+	public:
+		using WID = _WType;
+		// follows each sentence in the text. it is greater than any word, so no pattern matches across it
+		static constexpr _WType sep = (_WType)-1;
+
+	protected:
+		// suffixes sa[begin, end) start with the same pattern
+		struct Range
+		{
+			size_t begin, end;
+
+			size_t size() const { return end - begin; }
+		};
+
+		size_t orderN;
+		size_t vocabSize = 0;
+		vector<_WType> text;
+		vector<uint32_t> sa;
+		// D1, D2 and D3+ of k-grams at [k]
+		vector<array<float, 3>> discounts;
+		// the number of distinct words preceding each word, and the number of distinct bigrams
+		vector<uint32_t> cont;
+		uint64_t numBigrams = 0;
+		Vocab vocab;
+
+		mutable mutex cacheLock;
+		// backoff weights by the first suffix and the length of their context
+		mutable unordered_map<uint64_t, float> gammas;
+		size_t cacheLimit = 1 << 20;
+
+		Range extend(const Range& r, size_t len, _WType w) const;
+		float gamma(const Range& r, size_t len) const;
+
+		// calls fn(i, ll) for each word of seq
+		template<typename _Fn> void walk(const _WType* seq, size_t len, _Fn&& fn) const;
+	public:
+		SuffixArrayModel(size_t _orderN = 0) : orderN(_orderN)
+		{
+		}
+
+		size_t getWordSize() const override { return sizeof(_WType); }
+		size_t getVocabSize() const override { return vocabSize; }
+		size_t getOrder() const override { return orderN; }
+		size_t getNumTokens() const override { return text.size(); }
+		size_t getCachedContexts() const override
+		{
+			lock_guard<mutex> guard{ cacheLock };
+			return gammas.size();
+		}
+		Vocab& getVocab() override { return vocab; }
+		const Vocab& getVocab() const override { return vocab; }
+		// the cache is emptied when it holds more contexts than this
+		void setCacheLimit(size_t limit) { cacheLimit = limit; }
+
+		void trainSequence(const _WType* seq, size_t len);
+		void optimize() override;
+		float evaluateLLSent(const _WType* seq, size_t len, float minValue = -100.f) const;
+		vector<float> evaluateLLEachWord(const _WType* seq, size_t len) const;
+
+		void writeToStream(ostream&& str) const override;
+		void readFromStream(istream&& str) override;
+	};
+
+	template<typename _WType>
+	constexpr _WType SuffixArrayModel<_WType>::sep;
+
+	template<typename _WType>
+	void SuffixArrayModel<_WType>::trainSequence(const _WType* seq, size_t len)
+	{
+		if (!sa.empty()) throw runtime_error{ "cannot train an optimized model" };
+		if (text.size() + len + 1 > numeric_limits<uint32_t>::max()) throw runtime_error{ "too many words for 32-bit suffix indices" };
+		if (find(seq, seq + len, sep) != seq + len) throw runtime_error{ "the last word id is reserved as the separator of sentences" };
+		text.insert(text.end(), seq, seq + len);
+		text.emplace_back(sep);
+		if (len) vocabSize = max((size_t)*max_element(seq, seq + len) + 1, vocabSize);
+	}
+
+	template<typename _WType>
+	void SuffixArrayModel<_WType>::optimize()
+	{
+		if (!sa.empty() || text.empty()) return;
+		size_t n = text.size();
+
+		// prefix doubling. each separator ranks apart from the others, so suffixes are told apart
+		// within their sentence and it takes log2 of the longest sentence rounds
+		auto key = [&](uint32_t i) -> uint64_t { return text[i] == sep ? (uint64_t)vocabSize + i : text[i]; };
+		vector<uint32_t> rank(n), tmp(n);
+		sa.resize(n);
+		for (size_t i = 0; i < n; ++i) sa[i] = i;
+		sort(sa.begin(), sa.end(), [&](uint32_t a, uint32_t b) { return key(a) < key(b); });
+		rank[sa[0]] = 0;
+		for (size_t i = 1; i < n; ++i) rank[sa[i]] = rank[sa[i - 1]] + (key(sa[i - 1]) < key(sa[i]));
+		for (size_t k = 1; rank[sa[n - 1]] < n - 1; k *= 2)
+		{
+			auto less = [&](uint32_t a, uint32_t b)
+			{
+				if (rank[a] != rank[b]) return rank[a] < rank[b];
+				return (a + k < n ? (int64_t)rank[a + k] : -1) < (b + k < n ? (int64_t)rank[b + k] : -1);
+			};
+			sort(sa.begin(), sa.end(), less);
+			tmp[sa[0]] = 0;
+			for (size_t i = 1; i < n; ++i) tmp[sa[i]] = tmp[sa[i - 1]] + less(sa[i - 1], sa[i]);
+			rank.swap(tmp);
+		}
+
+		// lcp[r] is the number of words shared by the suffixes at r - 1 and r before a separator (Kasai et al.)
+		vector<uint32_t> lcp(n + 1);
+		for (size_t i = 0, h = 0; i < n; ++i)
+		{
+			size_t r = rank[i];
+			if (!r)
+			{
+				h = 0;
+				continue;
+			}
+			size_t j = sa[r - 1];
+			while (text[i + h] == text[j + h] && text[i + h] != sep) ++h;
+			lcp[r] = h;
+			if (h) --h;
+		}
+		// the number of words from each position to the end of its sentence
+		auto& avail = tmp;
+		size_t maxLen = 0;
+		for (size_t i = n; i-- > 0; )
+		{
+			avail[i] = text[i] == sep ? 0 : avail[i + 1] + 1;
+			maxLen = max(maxLen, (size_t)avail[i]);
+		}
+		if (orderN) maxLen = min(maxLen, orderN);
+
+		// k-grams occurring c times are runs of c suffixes sharing k words, with fewer shared on either side.
+		// a run of c suffixes is one for every k between the lcp at its edges and the lcp inside it
+		vector<array<int64_t, 4>> numCount(maxLen + 2);
+		for (size_t i = 0; i < n; ++i)
+		{
+			size_t inner = avail[sa[i]];
+			for (size_t c = 1; c <= 4 && i + c <= n; ++c)
+			{
+				if (c > 1) inner = min(inner, (size_t)lcp[i + c - 1]);
+				size_t lo = max(lcp[i], lcp[i + c]) + 1, hi = min(inner, maxLen);
+				if (lo > hi) continue;
+				numCount[lo][c - 1]++;
+				numCount[hi + 1][c - 1]--;
+			}
+		}
+		discounts.assign(maxLen + 1, array<float, 3>{});
+		for (size_t k = 1; k <= maxLen; ++k)
+		{
+			for (size_t c = 0; c < 4; ++c) numCount[k][c] += numCount[k - 1][c];
+			auto& m = numCount[k];
+			float y = m[0] + 2 * m[1] ? m[0] / (m[0] + 2.f * m[1]) : 0;
+			for (size_t i = 0; i < 3; ++i)
+			{
+				discounts[k][i] = m[i] ? (i + 1.f - (i + 2.f) * y * m[i + 1] / m[i]) : 0;
+			}
+		}
+
+		// distinct bigrams are the suffixes sharing less than two words with the previous one
+		cont.assign(vocabSize, 0);
+		numBigrams = 0;
+		for (size_t r = 0; r < n; ++r)
+		{
+			size_t p = sa[r];
+			if (avail[p] < 2 || lcp[r] >= 2) continue;
+			cont[text[p + 1]]++;
+			numBigrams++;
+		}
+	}
+
+	template<typename _WType>
+	auto SuffixArrayModel<_WType>::extend(const Range& r, size_t len, _WType w) const -> Range
+	{
+		auto b = lower_bound(sa.begin() + r.begin, sa.begin() + r.end, w, [&](uint32_t s, _WType v) { return text[s + len] < v; });
+		auto e = upper_bound(b, sa.begin() + r.end, w, [&](_WType v, uint32_t s) { return v < text[s + len]; });
+		return { (size_t)(b - sa.begin()), (size_t)(e - sa.begin()) };
+	}
+
+	template<typename _WType>
+	float SuffixArrayModel<_WType>::gamma(const Range& r, size_t len) const
+	{
+		uint64_t cacheKey = ((uint64_t)r.begin << 24) | min(len, (size_t)0xFFFFFF);
+		{
+			lock_guard<mutex> guard{ cacheLock };
+			auto it = gammas.find(cacheKey);
+			if (it != gammas.end()) return it->second;
+		}
+
+		// followers of the context are sorted in its range, so each distinct one is found by a search
+		size_t numFollowers[3] = { 0, };
+		for (size_t i = r.begin; i < r.end; )
+		{
+			_WType w = text[sa[i] + len];
+			if (w == sep) break;
+			size_t e = upper_bound(sa.begin() + i, sa.begin() + r.end, w, [&](_WType v, uint32_t s) { return v < text[s + len]; }) - sa.begin();
+			numFollowers[min(e - i, (size_t)3) - 1]++;
+			i = e;
+		}
+		float g = 0;
+		if (len + 1 < discounts.size())
+		{
+			for (size_t i = 0; i < 3; ++i) g += discounts[len + 1][i] * numFollowers[i];
+			g /= r.size();
+		}
+
+		lock_guard<mutex> guard{ cacheLock };
+		if (gammas.size() >= cacheLimit) gammas.clear();
+		gammas.emplace(cacheKey, g);
+		return g;
+	}
+
+	template<typename _WType>
+	template<typename _Fn>
+	void SuffixArrayModel<_WType>::walk(const _WType* seq, size_t len, _Fn&& fn) const
+	{
+		if (sa.empty()) throw runtime_error{ "the model is not optimized" };
+		size_t maxContext = orderN ? orderN - 1 : (size_t)-1;
+		// ranges of the last j words of the context at [j], and of them followed by the next word
+		vector<Range> ranges{ Range{ 0, sa.size() } }, next;
+		for (size_t i = 0; i < len; ++i)
+		{
+			_WType w = seq[i];
+			next.clear();
+			if (w != sep)
+			{
+				for (size_t j = 0; j < ranges.size(); ++j)
+				{
+					auto r = extend(ranges[j], j, w);
+					if (!r.size()) break;
+					next.emplace_back(r);
+				}
+			}
+
+			// interpolated from the unigram up, as KNLangModel bakes its likelihoods
+			double p = w < cont.size() && numBigrams ? cont[w] / (double)numBigrams : 0;
+			for (size_t j = 1; j < ranges.size(); ++j)
+			{
+				double g = gamma(ranges[j], j);
+				if (j < next.size())
+				{
+					size_t c = next[j].size();
+					p = (c - discounts[j + 1][min(c, (size_t)3) - 1]) / (double)ranges[j].size() + g * p;
+				}
+				else p = g * p;
+			}
+			fn(i, (float)log(p));
+
+			// the next context is the longest suffix of this one followed by w which occurs, up to maxContext words
+			ranges.resize(1);
+			for (size_t j = 0; j < next.size() && j < maxContext; ++j) ranges.emplace_back(next[j]);
+		}
+	}
+
+	template<typename _WType>
+	float SuffixArrayModel<_WType>::evaluateLLSent(const _WType* seq, size_t len, float minValue) const
+	{
+		float score = 0;
+		walk(seq, len, [&](size_t i, float ll)
+		{
+			if (i) score += max(ll, minValue);
+		});
+		return score;
+	}
+
+	template<typename _WType>
+	vector<float> SuffixArrayModel<_WType>::evaluateLLEachWord(const _WType* seq, size_t len) const
+	{
+		vector<float> score;
+		walk(seq, len, [&](size_t, float ll)
+		{
+			score.emplace_back(ll);
+		});
+		return score;
+	}
+
+	template<typename _WType>
+	void SuffixArrayModel<_WType>::writeToStream(ostream&& str) const
+	{
+		if (sa.empty()) throw runtime_error{ "only an optimized model can be written" };
+		writeToBinStream<uint32_t>(str, suffixArrayMagic);
+		writeToBinStream<uint32_t>(str, sizeof(_WType));
+		writeToBinStream<uint32_t>(str, orderN);
+		writeToBinStream<uint32_t>(str, vocabSize);
+		writeToBinStream<uint64_t>(str, text.size());
+		str.write((const char*)text.data(), text.size() * sizeof(_WType));
+		str.write((const char*)sa.data(), sa.size() * sizeof(uint32_t));
+		writeToBinStream<uint32_t>(str, discounts.size());
+		str.write((const char*)discounts.data(), discounts.size() * sizeof(discounts[0]));
+		str.write((const char*)cont.data(), cont.size() * sizeof(uint32_t));
+		writeToBinStream<uint64_t>(str, numBigrams);
+		writeToBinStream<uint32_t>(str, vocabTag);
+		vocab.writeToStream(str);
+	}
+
+	template<typename _WType>
+	void SuffixArrayModel<_WType>::readFromStream(istream&& str)
+	{
+		str.exceptions(istream::failbit | istream::badbit);
+		if (readFromBinStream<uint32_t>(str) != suffixArrayMagic) throw runtime_error{ "read failed. not a suffix array model" };
+		if (readFromBinStream<uint32_t>(str) != sizeof(_WType)) throw runtime_error{ "read failed. the model has another width of word ids" };
+		orderN = readFromBinStream<uint32_t>(str);
+		vocabSize = readFromBinStream<uint32_t>(str);
+		text.resize(readFromBinStream<uint64_t>(str));
+		str.read((char*)text.data(), text.size() * sizeof(_WType));
+		sa.resize(text.size());
+		str.read((char*)sa.data(), sa.size() * sizeof(uint32_t));
+		discounts.resize(readFromBinStream<uint32_t>(str));
+		str.read((char*)discounts.data(), discounts.size() * sizeof(discounts[0]));
+		cont.resize(vocabSize);
+		str.read((char*)cont.data(), cont.size() * sizeof(uint32_t));
+		numBigrams = readFromBinStream<uint64_t>(str);
+		if (readFromBinStream<uint32_t>(str) != vocabTag) throw runtime_error{ "read failed. no vocabulary after the suffix array" };
+		vocab.readFromStream(str);
+		lock_guard<mutex> guard{ cacheLock };
+		gammas.clear();
+	}
+
+	// a suffix array model with word ids of wordSize bytes (1, 2 or 4). order 0 has no limit
+	unique_ptr<ISuffixArrayModel> createSuffixArrayModel(size_t wordSize, size_t order = 0);
+	// a suffix array model read from the stream, with the word width it was written with
+	unique_ptr<ISuffixArrayModel> readSuffixArrayModel(istream&& is);
+
+	// instantiated in SuffixArrayModel.cpp
+	extern template class SuffixArrayModel<uint8_t>;
+	extern template class SuffixArrayModel<uint16_t>;
+	extern template class SuffixArrayModel<uint32_t>;
+}
@@ -5,6 +5,19 @@
 #include <map>
 #include <typeinfo>
 
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#endif
+
+inline void prefetchRead(const void* p)
+{
+#ifdef _MSC_VER
+	_mm_prefetch((const char*)p, _MM_HINT_T0);
+#else
+	__builtin_prefetch(p, 0, 3);
+#endif
+}
+
 template<class _Ty> inline void writeToBinStream(std::ostream& os, const _Ty& v);
 template<class _Ty> inline _Ty readFromBinStream(std::istream& is);
 template<class _Ty> inline void readFromBinStream(std::istream& is, _Ty& v);
@@ -154,3 +167,53 @@ inline void writeSVToBinStream(std::ostream & os, int32_t v)
 		u >>= 7;
 	}
 }
+
+inline size_t sizeVToBinStream(uint32_t v)
+{
+	static uint32_t vSize[] = { 0, 0x80, 0x4080, 0x204080, 0x10204080 };
+	size_t i;
+	for (i = 1; i <= 4; ++i)
+	{
+		if (v < vSize[i]) break;
+	}
+	return i;
+}
+
+inline size_t sizeSVToBinStream(int32_t v)
+{
+	static int32_t vSize[] = { 0, 0x40, 0x2000, 0x100000, 0x8000000 };
+	size_t i;
+	for (i = 1; i <= 4; ++i)
+	{
+		if (-vSize[i] <= v && v < vSize[i]) break;
+	}
+	return i;
+}
+
+// bytes the allocator spends beyond a request of n bytes, assuming 16-byte aligned blocks with an 8-byte header
+inline size_t heapOverhead(size_t n)
+{
+	if (!n) return 0;
+	size_t block = (n + 8 + 15) & ~(size_t)15;
+	return (block < 32 ? 32 : block) - n;
+}
+
+// a stream buffer which only counts the bytes written to it
+class CountingStreamBuf : public std::streambuf
+{
+	size_t count = 0;
+protected:
+	int_type overflow(int_type c) override
+	{
+		if (c != traits_type::eof()) ++count;
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize xsputn(const char*, std::streamsize n) override
+	{
+		count += n;
+		return n;
+	}
+public:
+	size_t size() const { return count; }
+};
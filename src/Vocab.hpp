@@ -0,0 +1,187 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include "Utils.hpp"
+
+namespace knlm
+{
+	/*
+	Words of a model and their ids, kept in the model file after the nodes.
+	Words are UTF-8 strings interned back to back in one arena, in the order of their ids.
+	The index is an open addressing table of ids, hashed with FNV-1a so that it is the same on every platform.
+	It is stored as it is in memory, so loading needs no rehashing and the arrays can be used from a mapped file.
+	Ids 0, 1 and 2 are the unknown word, the beginning and the end of a sentence.
+	*/
+	class Vocab
+	{
+		std::string chars;
+		std::vector<uint32_t> offsets{ 0 }; // word i is chars[offsets[i], offsets[i + 1])
+		std::vector<uint32_t> slots; // id + 1 of the word hashed to each slot, or 0 if empty
+
+		// the same arrays in a mapped model image, used instead of the members above if set
+		const char* viewChars = nullptr;
+		const uint32_t* viewOffsets = nullptr;
+		const uint32_t* viewSlots = nullptr;
+		size_t viewSize = 0, viewNumSlots = 0;
+
+		const char* getChars() const { return viewOffsets ? viewChars : chars.data(); }
+		const uint32_t* getOffsets() const { return viewOffsets ? viewOffsets : offsets.data(); }
+		const uint32_t* getSlots() const { return viewOffsets ? viewSlots : slots.data(); }
+		size_t numSlots() const { return viewOffsets ? viewNumSlots : slots.size(); }
+
+		// copies a viewed vocabulary before it is modified
+		void own()
+		{
+			if (!viewOffsets) return;
+			chars.assign(viewChars, viewOffsets[viewSize]);
+			offsets.assign(viewOffsets, viewOffsets + viewSize + 1);
+			slots.assign(viewSlots, viewSlots + viewNumSlots);
+			viewOffsets = nullptr;
+		}
+
+		static uint64_t hash(const char* s, size_t len)
+		{
+			uint64_t h = 14695981039346656037ull;
+			for (size_t i = 0; i < len; ++i) h = (h ^ (uint8_t)s[i]) * 1099511628211ull;
+			return h;
+		}
+
+		// the slot holding the word, or the empty slot where it would go
+		size_t probe(const char* s, size_t len) const
+		{
+			const char* chars = getChars();
+			const uint32_t *offsets = getOffsets(), *slots = getSlots();
+			size_t mask = numSlots() - 1;
+			for (size_t i = hash(s, len) & mask;; i = (i + 1) & mask)
+			{
+				uint32_t id = slots[i];
+				if (!id) return i;
+				--id;
+				if (offsets[id + 1] - offsets[id] == len && !memcmp(chars + offsets[id], s, len)) return i;
+			}
+		}
+
+		void rehash(size_t numSlots)
+		{
+			slots.assign(numSlots, 0);
+			for (size_t id = 0; id < size(); ++id)
+			{
+				slots[probe(&chars[offsets[id]], offsets[id + 1] - offsets[id])] = id + 1;
+			}
+		}
+
+	public:
+		static constexpr size_t npos = (size_t)-1;
+
+		static const char* special(size_t id)
+		{
+			static const char* words[] = { "___UNK___", "___BEG___", "___END___" };
+			return words[id];
+		}
+
+		Vocab()
+		{
+			for (size_t i = 0; i < 3; ++i) add(special(i));
+		}
+
+		size_t size() const { return viewOffsets ? viewSize : offsets.size() - 1; }
+
+		void clear()
+		{
+			viewOffsets = nullptr;
+			chars.clear();
+			offsets.assign(1, 0);
+			slots.clear();
+		}
+
+		size_t add(const char* s, size_t len)
+		{
+			own();
+			if (slots.size() < (size() + 1) * 2) rehash(std::max(slots.size() * 2, (size_t)64));
+			size_t i = probe(s, len);
+			if (slots[i]) return slots[i] - 1;
+			if (chars.size() + len > 0xFFFFFFFFu) throw std::runtime_error{ "the vocabulary exceeds 4GB" };
+			chars.append(s, len);
+			offsets.emplace_back(chars.size());
+			slots[i] = size();
+			return size() - 1;
+		}
+
+		size_t add(const std::string& s)
+		{
+			return add(s.data(), s.size());
+		}
+
+		// npos for unknown words
+		size_t find(const char* s, size_t len) const
+		{
+			if (!numSlots()) return npos;
+			return (size_t)getSlots()[probe(s, len)] - 1;
+		}
+
+		size_t find(const std::string& s) const
+		{
+			return find(s.data(), s.size());
+		}
+
+		const char* data(size_t id) const { return getChars() + getOffsets()[id]; }
+		size_t length(size_t id) const { return getOffsets()[id + 1] - getOffsets()[id]; }
+		std::string word(size_t id) const { return { data(id), length(id) }; }
+
+		size_t bytesUsed() const
+		{
+			return sizeof(Vocab) + chars.capacity() + (offsets.capacity() + slots.capacity()) * sizeof(uint32_t);
+		}
+
+		static size_t serializedSizeOf(size_t size, size_t numSlots, size_t numChars)
+		{
+			return sizeof(uint32_t) * (3 + size + 1 + numSlots) + numChars;
+		}
+
+		size_t serializedSize() const
+		{
+			return serializedSizeOf(size(), numSlots(), getOffsets()[size()]);
+		}
+
+		void writeToStream(std::ostream& str) const
+		{
+			writeToBinStream<uint32_t>(str, size());
+			writeToBinStream<uint32_t>(str, numSlots());
+			writeToBinStream<uint32_t>(str, getOffsets()[size()]);
+			str.write((const char*)getOffsets(), (size() + 1) * sizeof(uint32_t));
+			str.write((const char*)getSlots(), numSlots() * sizeof(uint32_t));
+			str.write(getChars(), getOffsets()[size()]);
+		}
+
+		// views the vocabulary as writeToStream wrote it at data, which must be 4-byte aligned and outlive the vocabulary
+		void view(const char* data, size_t bytes)
+		{
+			const uint32_t* head = (const uint32_t*)data;
+			if (bytes < sizeof(uint32_t) * 3 || bytes < serializedSizeOf(head[0], head[1], head[2])
+				|| !head[1] || (head[1] & (head[1] - 1))) throw std::runtime_error{ "corrupted vocabulary" };
+			clear();
+			viewSize = head[0];
+			viewNumSlots = head[1];
+			viewOffsets = head + 3;
+			viewSlots = viewOffsets + viewSize + 1;
+			viewChars = (const char*)(viewSlots + viewNumSlots);
+		}
+
+		void readFromStream(std::istream& str)
+		{
+			viewOffsets = nullptr;
+			size_t n = readFromBinStream<uint32_t>(str);
+			slots.resize(readFromBinStream<uint32_t>(str));
+			chars.resize(readFromBinStream<uint32_t>(str));
+			if (slots.size() & (slots.size() - 1)) throw std::runtime_error{ "corrupted vocabulary" };
+			offsets.resize(n + 1);
+			str.read((char*)offsets.data(), offsets.size() * sizeof(uint32_t));
+			str.read((char*)slots.data(), slots.size() * sizeof(uint32_t));
+			str.read(&chars[0], chars.size());
+		}
+	};
+}
@@ -2,42 +2,31 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <tuple>
+#include <limits>
 #include <Python.h>
 
 #include "KNLangModel.hpp"
+#include "Arpa.hpp"
+#include "ModelHandle.hpp"
+#include "SuffixArrayModel.hpp"
+#include "Ensemble.hpp"
+#include "BatchScorer.hpp"
 
 using namespace std;
 
-static PyObject *gModule, *gClass;
+static PyObject *gModule, *gClass, *gSAClass;
 static PyObject* knlm__init(PyObject* self, PyObject* args)
 {
 	PyObject* argSelf;
 	size_t numOrder = 3, wordSize = 2;
 	if (!PyArg_ParseTuple(args, "O|nn", &argSelf, &numOrder, &wordSize)) return nullptr;
+	// set before anything can fail, so that __del__ finds it
+	PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong(0));
 	try
 	{
-		ssize_t inst = 0;
-		switch (wordSize)
-		{
-		case 1:
-			inst = (ssize_t)new knlm::KNLangModel<uint8_t>{ numOrder };
-			break;
-		case 2:
-			inst = (ssize_t)new knlm::KNLangModel<uint16_t>{ numOrder };
-			break;
-		case 4:
-			inst = (ssize_t)new knlm::KNLangModel<uint32_t>{ numOrder };
-			break;
-		default:
-			throw runtime_error{ "wordSize must be 1, 2 or 4" };
-		}
-		PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong(inst));
-		PyObject_SetAttrString(argSelf, "_wsize", Py_BuildValue("n", wordSize));
-		PyObject* dict = PyDict_New();
-		PyDict_SetItemString(dict, "___UNK___", Py_BuildValue("n", 0));
-		PyDict_SetItemString(dict, "___BEG___", Py_BuildValue("n", 1));
-		PyDict_SetItemString(dict, "___END___", Py_BuildValue("n", 2));
-		PyObject_SetAttrString(argSelf, "_dict", dict);
+		auto* handle = new knlm::ModelHandle{ knlm::createModel(wordSize, numOrder) };
+		PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong((ssize_t)handle));
 	}
 	catch (const exception& e)
 	{
@@ -56,12 +45,10 @@ static PyObject* knlm__del(PyObject* self, PyObject* args)
 	{
 		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
 		if (!instObj) throw runtime_error{ "_inst is null" };
-		PyObject* wsizeObj = PyObject_GetAttrString(argSelf, "_wsize");
-		knlm::IModel* inst = (knlm::IModel*)PyLong_AsLongLong(instObj);
-		size_t wsize = PyLong_AsLong(wsizeObj);
+		auto* handle = (knlm::ModelHandle*)PyLong_AsLongLong(instObj);
 		Py_DECREF(instObj);
-		Py_DECREF(wsizeObj);
-		if (inst) delete inst;
+		// queries still running on other threads keep their model alive
+		if (handle) delete handle;
 		PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong(0));
 	}
 	catch (const exception& e)
@@ -74,27 +61,77 @@ static PyObject* knlm__del(PyObject* self, PyObject* args)
 	return Py_None;
 }
 
+static knlm::ModelHandle* getHandle(PyObject* argSelf)
+{
+	PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
+	if (!instObj) throw runtime_error{ "_inst is null" };
+	auto* handle = (knlm::ModelHandle*)PyLong_AsLongLong(instObj);
+	Py_DECREF(instObj);
+	if (!handle) throw runtime_error{ "_inst is null" };
+	return handle;
+}
+
+// the model currently served by the object. holding the returned pointer keeps it alive across a reload
+static shared_ptr<knlm::IModel> getModel(PyObject* argSelf)
+{
+	return getHandle(argSelf)->get();
+}
+
+// the UTF-8 bytes of a word, which must be str
+static const char* wordToUTF8(PyObject* word, size_t& len)
+{
+	Py_ssize_t size;
+	const char* s = PyUnicode_Check(word) ? PyUnicode_AsUTF8AndSize(word, &size) : nullptr;
+	if (!s) throw invalid_argument{ "words must be str" };
+	len = size;
+	return s;
+}
+
+// 0 for unknown words
+static size_t findWord(const knlm::Vocab& vocab, PyObject* word)
+{
+	size_t len;
+	const char* s = wordToUTF8(word, len);
+	size_t id = vocab.find(s, len);
+	return id == knlm::Vocab::npos ? 0 : id;
+}
+
+// thrown by makeSeqList when a new word would not fit in the width of word ids
+struct VocabOverflow : public runtime_error
+{
+	VocabOverflow() : runtime_error{ "vocab size overflow" }
+	{
+	}
+};
+
 template<typename _WType>
-vector<_WType> makeSeqList(PyObject *iter, PyObject* dict)
+vector<_WType> makeSeqList(PyObject *iter, knlm::Vocab& vocab, size_t maxId = numeric_limits<_WType>::max())
 {
 	PyObject* item;
 	vector<_WType> seq;
 	seq.emplace_back(1);
-	while (item = PyIter_Next(iter))
+	while ((item = PyIter_Next(iter)))
 	{
-		PyObject* idx = PyDict_GetItem(dict, item);
-		size_t id = 0;
-		if (idx)
+		size_t len;
+		const char* s;
+		try
 		{
-			id = PyLong_AsLong(idx);
+			s = wordToUTF8(item, len);
 		}
-		else
+		catch (const exception&)
+		{
+			Py_DECREF(item);
+			throw;
+		}
+		size_t id = vocab.find(s, len);
+		if (id == knlm::Vocab::npos)
 		{
-			PyDict_SetItem(dict, item, Py_BuildValue("n", id = PyDict_Size(dict)));
-			if (sizeof(_WType) < 4 && id >= (1 << (sizeof(_WType) * 8)))
+			if (vocab.size() > maxId)
 			{
-				throw runtime_error{ "" };
+				Py_DECREF(item);
+				throw VocabOverflow{};
 			}
+			id = vocab.add(s, len);
 		}
 		seq.emplace_back(id);
 		Py_DECREF(item);
@@ -104,16 +141,23 @@ vector<_WType> makeSeqList(PyObject *iter, PyObject* dict)
 }
 
 template<typename _WType>
-vector<_WType> makeSeqListConst(PyObject *iter, PyObject* dict, bool end = true)
+vector<_WType> makeSeqListConst(PyObject *iter, const knlm::Vocab& vocab, bool end = true)
 {
 	PyObject* item;
 	vector<_WType> seq;
 	seq.emplace_back(1);
-	while (item = PyIter_Next(iter))
+	while ((item = PyIter_Next(iter)))
 	{
-		PyObject* idx = PyDict_GetItem(dict, item);
-		size_t id = 0;
-		if (idx) id = PyLong_AsLong(idx);
+		size_t id;
+		try
+		{
+			id = findWord(vocab, item);
+		}
+		catch (const exception&)
+		{
+			Py_DECREF(item);
+			throw;
+		}
 		seq.emplace_back(id);
 		Py_DECREF(item);
 	}
@@ -121,52 +165,128 @@ vector<_WType> makeSeqListConst(PyObject *iter, PyObject* dict, bool end = true)
 	return seq;
 }
 
+// releases the GIL for its scope, in which no Python object may be touched
+class GILRelease
+{
+	PyThreadState* state;
+public:
+	GILRelease() : state{ PyEval_SaveThread() }
+	{
+	}
+
+	~GILRelease()
+	{
+		PyEval_RestoreThread(state);
+	}
+};
+
+// the UTF-8 bytes of a list of sentences, copied out of their str objects so that they can be encoded without the GIL
+struct SentenceText
+{
+	string chars;
+	vector<size_t> wordEnds{ 0 }; // word i is chars[wordEnds[i], wordEnds[i + 1])
+	vector<size_t> sentEnds{ 0 }; // sentence j is the words [sentEnds[j], sentEnds[j + 1])
+
+	size_t size() const { return sentEnds.size() - 1; }
+
+	// reads an iterable of sentences, each an iterable of str
+	void read(PyObject* iter, const char* notIterable)
+	{
+		PyObject* item;
+		while ((item = PyIter_Next(iter)))
+		{
+			PyObject* wordIter = PyObject_GetIter(item);
+			Py_DECREF(item);
+			if (!wordIter) throw runtime_error{ notIterable };
+			PyObject* word;
+			while ((word = PyIter_Next(wordIter)))
+			{
+				size_t len;
+				const char* s;
+				try
+				{
+					s = wordToUTF8(word, len);
+				}
+				catch (const exception&)
+				{
+					Py_DECREF(word);
+					Py_DECREF(wordIter);
+					throw;
+				}
+				chars.append(s, len);
+				Py_DECREF(word);
+				wordEnds.emplace_back(chars.size());
+			}
+			Py_DECREF(wordIter);
+			sentEnds.emplace_back(wordEnds.size() - 1);
+		}
+	}
+
+	// word ids of each sentence between ___BEG___ and ___END___, with 0 for unknown words
+	template<typename _WType>
+	vector<vector<_WType>> encode(const knlm::Vocab& vocab) const
+	{
+		vector<vector<_WType>> ret(size());
+		for (size_t j = 0; j < size(); ++j)
+		{
+			auto& seq = ret[j];
+			seq.emplace_back(1);
+			for (size_t i = sentEnds[j]; i < sentEnds[j + 1]; ++i)
+			{
+				size_t id = vocab.find(&chars[wordEnds[i]], wordEnds[i + 1] - wordEnds[i]);
+				seq.emplace_back(id == knlm::Vocab::npos ? 0 : id);
+			}
+			seq.emplace_back(2);
+		}
+		return ret;
+	}
+};
+
 
 static PyObject* knlm__train(PyObject* self, PyObject* args)
 {
-	PyObject *argSelf, *argIter, *item;
+	PyObject *argSelf, *argIter;
 	if (!PyArg_ParseTuple(args, "OO", &argSelf, &argIter)) return nullptr;
 	try
 	{
-		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
-		if (!instObj) throw runtime_error{ "_inst is null" };
-		PyObject* wsizeObj = PyObject_GetAttrString(argSelf, "_wsize");
-		knlm::IModel* inst = (knlm::IModel*)PyLong_AsLongLong(instObj);
-		size_t wsize = PyLong_AsLong(wsizeObj);
-		Py_DECREF(instObj);
-		Py_DECREF(wsizeObj);
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
 		if (!(argIter = PyObject_GetIter(argIter)))
 		{
 			throw runtime_error{ "argIter is not iterable" };
 		}
 
-		PyObject* dict = PyObject_GetAttrString(argSelf, "_dict");
+		auto& vocab = inst->getVocab();
 		try
 		{
 			if (wsize == 1)
 			{
-				auto seq = makeSeqList<uint8_t>(argIter, dict);
+				auto seq = makeSeqList<uint8_t>(argIter, vocab);
 				((knlm::KNLangModel<uint8_t>*)inst)->trainSequence(&seq[0], seq.size());
 			}
 			else if (wsize == 2)
 			{
-				auto seq = makeSeqList<uint16_t>(argIter, dict);
+				auto seq = makeSeqList<uint16_t>(argIter, vocab);
 				((knlm::KNLangModel<uint16_t>*)inst)->trainSequence(&seq[0], seq.size());
 			}
 			else if (wsize == 4)
 			{
-				auto seq = makeSeqList<uint32_t>(argIter, dict);
+				auto seq = makeSeqList<uint32_t>(argIter, vocab);
 				((knlm::KNLangModel<uint32_t>*)inst)->trainSequence(&seq[0], seq.size());
 			}
 		}
-		catch (const runtime_error&)
+		catch (const VocabOverflow&)
 		{
-			Py_DECREF(dict);
 			Py_DECREF(argIter);
 			PyErr_Format(PyExc_RuntimeError, "vocab size overflow. use bigger 'wsize' than %d", wsize);
 			return nullptr;
 		}
-		Py_DECREF(dict);
+		catch (const exception&)
+		{
+			Py_DECREF(argIter);
+			throw;
+		}
 		Py_DECREF(argIter);
 		Py_INCREF(Py_None);
 		return Py_None;
@@ -178,20 +298,103 @@ static PyObject* knlm__train(PyObject* self, PyObject* args)
 	}
 }
 
-static PyObject* knlm__optimize(PyObject* self, PyObject* args)
+static PyObject* knlm__optimize(PyObject* self, PyObject* args, PyObject* kwargs)
 {
+	static const char* kwlist[] = { "self", "sortVocab", "sortNodes", nullptr };
 	PyObject *argSelf;
-	if (!PyArg_ParseTuple(args, "O", &argSelf)) return nullptr;
+	int sortVocab = 0, sortNodes = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|pp", (char**)kwlist, &argSelf, &sortVocab, &sortNodes)) return nullptr;
 	try
 	{
-		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
-		if (!instObj) throw runtime_error{ "_inst is null" };
-		PyObject* wsizeObj = PyObject_GetAttrString(argSelf, "_wsize");
-		knlm::IModel* inst = (knlm::IModel*)PyLong_AsLongLong(instObj);
-		size_t wsize = PyLong_AsLong(wsizeObj);
-		Py_DECREF(instObj);
-		Py_DECREF(wsizeObj);
-		inst->optimize();
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		inst->optimize(sortVocab, sortNodes);
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+template<typename _WType>
+shared_ptr<knlm::IModel> reorderedModel(const knlm::IModel& mdl, const SentenceText& profile)
+{
+	return ((const knlm::KNLangModel<_WType>&)mdl).reordered(profile.encode<_WType>(mdl.getVocab()));
+}
+
+static PyObject* knlm__reorderNodes(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argIter = nullptr;
+	if (!PyArg_ParseTuple(args, "O|O", &argSelf, &argIter)) return nullptr;
+	try
+	{
+		auto* handle = getHandle(argSelf);
+		if (argIter == Py_None) argIter = nullptr;
+		SentenceText profile;
+		if (argIter)
+		{
+			if (!(argIter = PyObject_GetIter(argIter)))
+			{
+				throw runtime_error{ "argIter is not iterable" };
+			}
+			try
+			{
+				profile.read(argIter, "each sentence must be iterable");
+			}
+			catch (const exception&)
+			{
+				Py_DECREF(argIter);
+				throw;
+			}
+			Py_DECREF(argIter);
+			if (PyErr_Occurred()) return nullptr;
+		}
+
+		// the nodes are reordered on a copy, swapped in when done, so that queries meanwhile keep the old ones
+		{
+			GILRelease nogil;
+			handle->update([&](const shared_ptr<knlm::IModel>& mdl)
+			{
+				switch (mdl->getWordSize())
+				{
+				case 1: return reorderedModel<uint8_t>(*mdl, profile);
+				case 2: return reorderedModel<uint16_t>(*mdl, profile);
+				default: return reorderedModel<uint32_t>(*mdl, profile);
+				}
+			});
+		}
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__setFilterBits(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	size_t bits = 0;
+	if (!PyArg_ParseTuple(args, "On", &argSelf, &bits)) return nullptr;
+	try
+	{
+		// the filters are built for a copy swapped in when done, and models swapped in later by reload() get the same filters
+		auto* handle = getHandle(argSelf);
+		GILRelease nogil;
+		handle->update([bits](const shared_ptr<knlm::IModel>& mdl)
+		{
+			if (!mdl->isOptimized())
+			{
+				mdl->setFilterBits(bits);
+				return mdl;
+			}
+			return knlm::withFilterBits(mdl, bits);
+		}, [bits](knlm::IModel& mdl) { mdl.setFilterBits(bits); });
 		Py_INCREF(Py_None);
 		return Py_None;
 	}
@@ -204,41 +407,44 @@ static PyObject* knlm__optimize(PyObject* self, PyObject* args)
 
 static PyObject* knlm__evaluate(PyObject* self, PyObject* args)
 {
-	PyObject *argSelf, *argIter, *item;
+	PyObject *argSelf, *argIter;
 	if (!PyArg_ParseTuple(args, "OO", &argSelf, &argIter)) return nullptr;
 	try
 	{
-		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
-		if (!instObj) throw runtime_error{ "_inst is null" };
-		PyObject* wsizeObj = PyObject_GetAttrString(argSelf, "_wsize");
-		knlm::IModel* inst = (knlm::IModel*)PyLong_AsLongLong(instObj);
-		size_t wsize = PyLong_AsLong(wsizeObj);
-		Py_DECREF(instObj);
-		Py_DECREF(wsizeObj);
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
 
 		if (!(argIter = PyObject_GetIter(argIter)))
 		{
 			throw runtime_error{ "argIter is not iterable" };
 		}
 
-		PyObject* dict = PyObject_GetAttrString(argSelf, "_dict");
+		auto& vocab = inst->getVocab();
 		float score = 0;
-		if (wsize == 1)
-		{
-			auto seq = makeSeqListConst<uint8_t>(argIter, dict, false);
-			score = ((knlm::KNLangModel<uint8_t>*)inst)->evaluateLL(&seq[0], seq.size());
-		}
-		else if (wsize == 2)
+		try
 		{
-			auto seq = makeSeqListConst<uint16_t>(argIter, dict, false);
-			score = ((knlm::KNLangModel<uint16_t>*)inst)->evaluateLL(&seq[0], seq.size());
+			if (wsize == 1)
+			{
+				auto seq = makeSeqListConst<uint8_t>(argIter, vocab, false);
+				score = ((knlm::KNLangModel<uint8_t>*)inst)->evaluateLL(&seq[0], seq.size());
+			}
+			else if (wsize == 2)
+			{
+				auto seq = makeSeqListConst<uint16_t>(argIter, vocab, false);
+				score = ((knlm::KNLangModel<uint16_t>*)inst)->evaluateLL(&seq[0], seq.size());
+			}
+			else if (wsize == 4)
+			{
+				auto seq = makeSeqListConst<uint32_t>(argIter, vocab, false);
+				score = ((knlm::KNLangModel<uint32_t>*)inst)->evaluateLL(&seq[0], seq.size());
+			}
 		}
-		else if (wsize == 4)
+		catch (const exception&)
 		{
-			auto seq = makeSeqListConst<uint32_t>(argIter, dict, false);
-			score = ((knlm::KNLangModel<uint32_t>*)inst)->evaluateLL(&seq[0], seq.size());
+			Py_DECREF(argIter);
+			throw;
 		}
-		Py_DECREF(dict);
 		Py_DECREF(argIter);
 		return Py_BuildValue("f", score);
 	}
@@ -251,42 +457,45 @@ static PyObject* knlm__evaluate(PyObject* self, PyObject* args)
 
 static PyObject* knlm__evaluateSent(PyObject* self, PyObject* args)
 {
-	PyObject *argSelf, *argIter, *item;
+	PyObject *argSelf, *argIter;
 	float minValue = -100;
 	if (!PyArg_ParseTuple(args, "OO|f", &argSelf, &argIter, &minValue)) return nullptr;
 	try
 	{
-		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
-		if (!instObj) throw runtime_error{ "_inst is null" };
-		PyObject* wsizeObj = PyObject_GetAttrString(argSelf, "_wsize");
-		knlm::IModel* inst = (knlm::IModel*)PyLong_AsLongLong(instObj);
-		size_t wsize = PyLong_AsLong(wsizeObj);
-		Py_DECREF(instObj);
-		Py_DECREF(wsizeObj);
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
 
 		if (!(argIter = PyObject_GetIter(argIter)))
 		{
 			throw runtime_error{ "argIter is not iterable" };
 		}
 
-		PyObject* dict = PyObject_GetAttrString(argSelf, "_dict");
+		auto& vocab = inst->getVocab();
 		float score = 0;
-		if (wsize == 1)
-		{
-			auto seq = makeSeqListConst<uint8_t>(argIter, dict);
-			score = ((knlm::KNLangModel<uint8_t>*)inst)->evaluateLLSent(&seq[0], seq.size(), minValue);
-		}
-		else if (wsize == 2)
+		try
 		{
-			auto seq = makeSeqListConst<uint16_t>(argIter, dict);
-			score = ((knlm::KNLangModel<uint16_t>*)inst)->evaluateLLSent(&seq[0], seq.size(), minValue);
+			if (wsize == 1)
+			{
+				auto seq = makeSeqListConst<uint8_t>(argIter, vocab);
+				score = ((knlm::KNLangModel<uint8_t>*)inst)->evaluateLLSent(&seq[0], seq.size(), minValue);
+			}
+			else if (wsize == 2)
+			{
+				auto seq = makeSeqListConst<uint16_t>(argIter, vocab);
+				score = ((knlm::KNLangModel<uint16_t>*)inst)->evaluateLLSent(&seq[0], seq.size(), minValue);
+			}
+			else if (wsize == 4)
+			{
+				auto seq = makeSeqListConst<uint32_t>(argIter, vocab);
+				score = ((knlm::KNLangModel<uint32_t>*)inst)->evaluateLLSent(&seq[0], seq.size(), minValue);
+			}
 		}
-		else if (wsize == 4)
+		catch (const exception&)
 		{
-			auto seq = makeSeqListConst<uint32_t>(argIter, dict);
-			score = ((knlm::KNLangModel<uint32_t>*)inst)->evaluateLLSent(&seq[0], seq.size(), minValue);
+			Py_DECREF(argIter);
+			throw;
 		}
-		Py_DECREF(dict);
 		Py_DECREF(argIter);
 		return Py_BuildValue("f", score);
 	}
@@ -299,42 +508,45 @@ static PyObject* knlm__evaluateSent(PyObject* self, PyObject* args)
 
 static PyObject* knlm__evaluateEachWord(PyObject* self, PyObject* args)
 {
-	PyObject *argSelf, *argIter, *item;
+	PyObject *argSelf, *argIter;
 	float minValue = -INFINITY;
 	if (!PyArg_ParseTuple(args, "OO|f", &argSelf, &argIter, &minValue)) return nullptr;
 	try
 	{
-		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
-		if (!instObj) throw runtime_error{ "_inst is null" };
-		PyObject* wsizeObj = PyObject_GetAttrString(argSelf, "_wsize");
-		knlm::IModel* inst = (knlm::IModel*)PyLong_AsLongLong(instObj);
-		size_t wsize = PyLong_AsLong(wsizeObj);
-		Py_DECREF(instObj);
-		Py_DECREF(wsizeObj); 
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
 
 		if (!(argIter = PyObject_GetIter(argIter)))
 		{
 			throw runtime_error{ "argIter is not iterable" };
 		}
 
-		PyObject* dict = PyObject_GetAttrString(argSelf, "_dict");
+		auto& vocab = inst->getVocab();
 		vector<float> scores;
-		if (wsize == 1)
-		{
-			auto seq = makeSeqListConst<uint8_t>(argIter, dict, false);
-			scores = ((knlm::KNLangModel<uint8_t>*)inst)->evaluateLLEachWord(&seq[0], seq.size());
-		}
-		else if (wsize == 2)
+		try
 		{
-			auto seq = makeSeqListConst<uint16_t>(argIter, dict, false);
-			scores = ((knlm::KNLangModel<uint16_t>*)inst)->evaluateLLEachWord(&seq[0], seq.size());
+			if (wsize == 1)
+			{
+				auto seq = makeSeqListConst<uint8_t>(argIter, vocab, false);
+				scores = ((knlm::KNLangModel<uint8_t>*)inst)->evaluateLLEachWord(&seq[0], seq.size());
+			}
+			else if (wsize == 2)
+			{
+				auto seq = makeSeqListConst<uint16_t>(argIter, vocab, false);
+				scores = ((knlm::KNLangModel<uint16_t>*)inst)->evaluateLLEachWord(&seq[0], seq.size());
+			}
+			else if (wsize == 4)
+			{
+				auto seq = makeSeqListConst<uint32_t>(argIter, vocab, false);
+				scores = ((knlm::KNLangModel<uint32_t>*)inst)->evaluateLLEachWord(&seq[0], seq.size());
+			}
 		}
-		else if (wsize == 4)
+		catch (const exception&)
 		{
-			auto seq = makeSeqListConst<uint32_t>(argIter, dict, false);
-			scores = ((knlm::KNLangModel<uint32_t>*)inst)->evaluateLLEachWord(&seq[0], seq.size());
+			Py_DECREF(argIter);
+			throw;
 		}
-		Py_DECREF(dict);
 		Py_DECREF(argIter);
 		PyObject* ret = PyList_New(scores.size() - 1);
 		for (size_t i = 1; i < scores.size(); ++i)
@@ -350,45 +562,61 @@ static PyObject* knlm__evaluateEachWord(PyObject* self, PyObject* args)
 	}
 }
 
-static PyObject* knlm__branchingEntropy(PyObject* self, PyObject* args)
+template<typename _WType>
+PyObject* evaluateSentBatch(knlm::IModel* inst, const SentenceText& text, float minValue)
 {
-	PyObject *argSelf, *argIter, *item;
-	if (!PyArg_ParseTuple(args, "OO", &argSelf, &argIter)) return nullptr;
+	vector<float> scores(text.size());
+	{
+		GILRelease nogil;
+		auto sents = text.encode<_WType>(inst->getVocab());
+		vector<const _WType*> seqs;
+		vector<size_t> lens;
+		for (auto& s : sents)
+		{
+			seqs.emplace_back(s.data());
+			lens.emplace_back(s.size());
+		}
+		((knlm::KNLangModel<_WType>*)inst)->evaluateLLSentBatch(seqs.data(), lens.data(), sents.size(), scores.data(), minValue);
+	}
+	PyObject* ret = PyList_New(scores.size());
+	for (size_t i = 0; i < scores.size(); ++i)
+	{
+		PyList_SetItem(ret, i, Py_BuildValue("f", scores[i]));
+	}
+	return ret;
+}
+
+static PyObject* knlm__evaluateSentBatch(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argIter;
+	float minValue = -100;
+	if (!PyArg_ParseTuple(args, "OO|f", &argSelf, &argIter, &minValue)) return nullptr;
 	try
 	{
-		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
-		if (!instObj) throw runtime_error{ "_inst is null" };
-		PyObject* wsizeObj = PyObject_GetAttrString(argSelf, "_wsize");
-		knlm::IModel* inst = (knlm::IModel*)PyLong_AsLongLong(instObj);
-		size_t wsize = PyLong_AsLong(wsizeObj);
-		Py_DECREF(instObj);
-		Py_DECREF(wsizeObj);
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
 
 		if (!(argIter = PyObject_GetIter(argIter)))
 		{
 			throw runtime_error{ "argIter is not iterable" };
 		}
 
-		PyObject* dict = PyObject_GetAttrString(argSelf, "_dict");
-		float score = 0;
-		if (wsize == 1)
-		{
-			auto seq = makeSeqListConst<uint8_t>(argIter, dict, false);
-			score = ((knlm::KNLangModel<uint8_t>*)inst)->branchingEntropy(&seq[0], seq.size());
-		}
-		else if (wsize == 2)
+		SentenceText text;
+		try
 		{
-			auto seq = makeSeqListConst<uint16_t>(argIter, dict, false);
-			score = ((knlm::KNLangModel<uint16_t>*)inst)->branchingEntropy(&seq[0], seq.size());
+			text.read(argIter, "each sentence must be iterable");
 		}
-		else if (wsize == 4)
+		catch (const exception&)
 		{
-			auto seq = makeSeqListConst<uint32_t>(argIter, dict, false);
-			score = ((knlm::KNLangModel<uint32_t>*)inst)->branchingEntropy(&seq[0], seq.size());
+			Py_DECREF(argIter);
+			throw;
 		}
-		Py_DECREF(dict);
 		Py_DECREF(argIter);
-		return Py_BuildValue("f", score);
+		if (PyErr_Occurred()) return nullptr;
+		if (wsize == 1) return evaluateSentBatch<uint8_t>(inst, text, minValue);
+		if (wsize == 2) return evaluateSentBatch<uint16_t>(inst, text, minValue);
+		return evaluateSentBatch<uint32_t>(inst, text, minValue);
 	}
 	catch (const exception& e)
 	{
@@ -397,111 +625,65 @@ static PyObject* knlm__branchingEntropy(PyObject* self, PyObject* args)
 	}
 }
 
-static PyObject* knlm__save(PyObject* self, PyObject* args)
+template<typename _WType>
+PyObject* evaluateNBest(knlm::IModel* inst, const SentenceText& text, float minValue, bool eachWord)
 {
-	PyObject *argSelf;
-	const char* path;
-	if (!PyArg_ParseTuple(args, "Os", &argSelf, &path)) return nullptr;
-	try
+	vector<vector<float>> wordScores;
+	vector<float> scores;
 	{
-		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
-		if (!instObj) throw runtime_error{ "_inst is null" };
-		PyObject* wsizeObj = PyObject_GetAttrString(argSelf, "_wsize");
-		knlm::IModel* inst = (knlm::IModel*)PyLong_AsLongLong(instObj);
-		size_t wsize = PyLong_AsLong(wsizeObj);
-		Py_DECREF(instObj);
-		Py_DECREF(wsizeObj);
-		inst->writeToStream(ofstream{ path + string{".mdl"}, ios_base::binary });
-
-		PyObject *pickle = PyImport_ImportModule("pickle"), *io = PyImport_ImportModule("io");
-		PyObject *file = PyObject_CallMethod(io, "open", "ss", (path + string{".dict"}).c_str(), "wb");
-		if (!file)
-		{
-			Py_XDECREF(io);
-			Py_XDECREF(pickle);
-			return nullptr;
-		}
-		PyObject* dict = PyObject_GetAttrString(argSelf, "_dict");
-		PyObject_CallMethod(pickle, "dump", "OO", dict, file);
-		Py_DECREF(dict);
-		Py_XDECREF(file);
-		Py_XDECREF(io);
-		Py_XDECREF(pickle);
-
-		Py_INCREF(Py_None);
-		return Py_None;
+		GILRelease nogil;
+		auto hyps = text.encode<_WType>(inst->getVocab());
+		scores = ((knlm::KNLangModel<_WType>*)inst)->evaluateLLNBest(hyps, minValue, eachWord ? &wordScores : nullptr);
 	}
-	catch (const exception& e)
+	PyObject* ret = PyList_New(scores.size());
+	for (size_t i = 0; i < scores.size(); ++i)
 	{
-		PyErr_SetString(PyExc_Exception, e.what());
-		return nullptr;
+		if (eachWord)
+		{
+			PyObject* words = PyList_New(wordScores[i].size());
+			for (size_t j = 0; j < wordScores[i].size(); ++j)
+			{
+				PyList_SetItem(words, j, Py_BuildValue("f", max(wordScores[i][j], minValue)));
+			}
+			PyList_SetItem(ret, i, Py_BuildValue("(fN)", scores[i], words));
+		}
+		else PyList_SetItem(ret, i, Py_BuildValue("f", scores[i]));
 	}
+	return ret;
 }
 
-
-static PyObject* knlm__load(PyObject* self, PyObject* args)
+static PyObject* knlm__evaluateNBest(PyObject* self, PyObject* args)
 {
-	const char* path;
-	if (!PyArg_ParseTuple(args, "s", &path)) return nullptr;
+	PyObject *argSelf, *argIter;
+	float minValue = -100;
+	int eachWord = 0;
+	if (!PyArg_ParseTuple(args, "OO|fp", &argSelf, &argIter, &minValue, &eachWord)) return nullptr;
 	try
 	{
-		PyObject* newInst = PyObject_CallFunction(gClass, nullptr);
-		if (!newInst) return nullptr;
-		PyObject* instObj = PyObject_GetAttrString(newInst, "_inst");
-		if (!instObj) throw runtime_error{ "_inst is null" };
-		PyObject* wsizeObj = PyObject_GetAttrString(newInst, "_wsize");
-		knlm::IModel* inst = (knlm::IModel*)PyLong_AsLongLong(instObj);
-		size_t wsize = PyLong_AsLong(wsizeObj);
-		Py_DECREF(instObj);
-		Py_DECREF(wsizeObj);
-		delete inst;
-		do
-		{
-			inst = new knlm::KNLangModel<uint8_t>;
-			try
-			{
-				inst->readFromStream(ifstream{ path + string{".mdl"}, ios_base::binary });
-				wsize = 1;
-				break;
-			}
-			catch (const runtime_error& e)
-			{
-				delete inst;
-			}
-
-			inst = new knlm::KNLangModel<uint16_t>;
-			try
-			{
-				inst->readFromStream(ifstream{ path + string{".mdl"}, ios_base::binary });
-				wsize = 2;
-				break;
-			}
-			catch (const runtime_error& e)
-			{
-				delete inst;
-			}
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
 
-			inst = new knlm::KNLangModel<uint32_t>;
-			inst->readFromStream(ifstream{ path + string{".mdl"}, ios_base::binary });
-			wsize = 4;
-		} while (0);
+		if (!(argIter = PyObject_GetIter(argIter)))
+		{
+			throw runtime_error{ "argIter is not iterable" };
+		}
 
-		PyObject_SetAttrString(newInst, "_inst", PyLong_FromLongLong((ssize_t)inst));
-		PyObject_SetAttrString(newInst, "_wsize", Py_BuildValue("n", wsize));
-		PyObject *pickle = PyImport_ImportModule("pickle"), *io = PyImport_ImportModule("io");
-		PyObject *file = PyObject_CallMethod(io, "open", "ss", (path + string{ ".dict" }).c_str(), "rb");
-		if (!file)
+		SentenceText text;
+		try
 		{
-			Py_XDECREF(io);
-			Py_XDECREF(pickle);
-			return nullptr;
+			text.read(argIter, "each hypothesis must be iterable");
 		}
-		PyObject_SetAttrString(newInst, "_dict",  PyObject_CallMethod(pickle, "load", "O", file));
-		Py_XDECREF(file);
-		Py_XDECREF(io);
-		Py_XDECREF(pickle);
-		
-		return newInst;
+		catch (const exception&)
+		{
+			Py_DECREF(argIter);
+			throw;
+		}
+		Py_DECREF(argIter);
+		if (PyErr_Occurred()) return nullptr;
+		if (wsize == 1) return evaluateNBest<uint8_t>(inst, text, minValue, eachWord);
+		if (wsize == 2) return evaluateNBest<uint16_t>(inst, text, minValue, eachWord);
+		return evaluateNBest<uint32_t>(inst, text, minValue, eachWord);
 	}
 	catch (const exception& e)
 	{
@@ -510,21 +692,930 @@ static PyObject* knlm__load(PyObject* self, PyObject* args)
 	}
 }
 
-static PyObject* knlm__getattr(PyObject* self, PyObject* args)
+// a prefix tree of hypotheses as flat arrays. a word of None is the end of a sentence
+struct TreeText
 {
-	PyObject *argSelf;
-	const char* name;
-	if (!PyArg_ParseTuple(args, "Os", &argSelf, &name)) return nullptr;
-	try
+	vector<string> words;
+	vector<char> ends;
+	vector<int32_t> parents;
+
+	void read(PyObject* argTokens, PyObject* argParents)
 	{
-		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
-		if (!instObj) throw runtime_error{ "_inst is null" };
-		PyObject* wsizeObj = PyObject_GetAttrString(argSelf, "_wsize");
-		knlm::IModel* inst = (knlm::IModel*)PyLong_AsLongLong(instObj);
-		size_t wsize = PyLong_AsLong(wsizeObj);
-		Py_DECREF(instObj);
-		Py_DECREF(wsizeObj);
-		if (name == string("order"))
+		PyObject* tokens = PySequence_Fast(argTokens, "tokens must be a sequence");
+		if (!tokens) throw runtime_error{ "tokens must be a sequence" };
+		PyObject* ps = PySequence_Fast(argParents, "parents must be a sequence");
+		if (!ps)
+		{
+			Py_DECREF(tokens);
+			throw runtime_error{ "parents must be a sequence" };
+		}
+		try
+		{
+			size_t len = PySequence_Fast_GET_SIZE(tokens);
+			if ((size_t)PySequence_Fast_GET_SIZE(ps) != len) throw invalid_argument{ "tokens and parents must have the same length" };
+			for (size_t i = 0; i < len; ++i)
+			{
+				PyObject* word = PySequence_Fast_GET_ITEM(tokens, i);
+				long parent = PyLong_AsLong(PySequence_Fast_GET_ITEM(ps, i));
+				if (parent == -1 && PyErr_Occurred()) throw invalid_argument{ "parents must be int" };
+				if (parent >= (long)i) throw invalid_argument{ "parents must precede their children" };
+				ends.emplace_back(word == Py_None);
+				if (word == Py_None) words.emplace_back();
+				else
+				{
+					size_t wlen;
+					const char* w = wordToUTF8(word, wlen);
+					words.emplace_back(w, wlen);
+				}
+				parents.emplace_back(parent < 0 ? -1 : (int32_t)parent);
+			}
+		}
+		catch (const exception&)
+		{
+			Py_DECREF(tokens);
+			Py_DECREF(ps);
+			throw;
+		}
+		Py_DECREF(tokens);
+		Py_DECREF(ps);
+	}
+};
+
+template<typename _WType>
+PyObject* evaluateTree(knlm::IModel* inst, const TreeText& tree, float minValue)
+{
+	vector<float> scores;
+	{
+		GILRelease nogil;
+		// entry 0 is ___BEG___, which the hypotheses starting at a root follow
+		auto& vocab = inst->getVocab();
+		size_t len = tree.words.size();
+		vector<_WType> tokens{ 1 };
+		vector<int32_t> parents{ -1 };
+		for (size_t i = 0; i < len; ++i)
+		{
+			size_t id = tree.ends[i] ? 2 : vocab.find(tree.words[i]);
+			tokens.emplace_back(id == knlm::Vocab::npos ? 0 : id);
+			parents.emplace_back(tree.parents[i] + 1);
+		}
+		scores = ((knlm::KNLangModel<_WType>*)inst)->evaluateLLTree(tokens.data(), parents.data(), tokens.size(), minValue);
+	}
+	PyObject* ret = PyList_New(scores.size() - 1);
+	for (size_t i = 1; i < scores.size(); ++i) PyList_SetItem(ret, i - 1, Py_BuildValue("f", scores[i]));
+	return ret;
+}
+
+static PyObject* knlm__evaluateTree(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argTokens, *argParents;
+	float minValue = -100;
+	if (!PyArg_ParseTuple(args, "OOO|f", &argSelf, &argTokens, &argParents, &minValue)) return nullptr;
+	try
+	{
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
+
+		TreeText tree;
+		tree.read(argTokens, argParents);
+		if (wsize == 1) return evaluateTree<uint8_t>(inst, tree, minValue);
+		if (wsize == 2) return evaluateTree<uint16_t>(inst, tree, minValue);
+		return evaluateTree<uint32_t>(inst, tree, minValue);
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+template<typename _WType>
+float decodeLattice(knlm::IModel* inst, const vector<tuple<uint32_t, uint32_t, size_t>>& rawEdges, vector<size_t>& path, float minValue, size_t beamSize)
+{
+	typedef typename knlm::KNLangModel<_WType>::LatticeEdge LatticeEdge;
+	vector<LatticeEdge> edges;
+	size_t length = 0;
+	for (auto& e : rawEdges)
+	{
+		edges.emplace_back(get<0>(e), get<1>(e), get<2>(e));
+		length = max(length, (size_t)get<1>(e));
+	}
+	return ((knlm::KNLangModel<_WType>*)inst)->decodeLattice(edges.data(), edges.size(), length, path, 1, 2, minValue, beamSize);
+}
+
+static float decodeLattice(knlm::IModel* inst, size_t wsize, const vector<tuple<uint32_t, uint32_t, size_t>>& rawEdges, vector<size_t>& path, float minValue, size_t beamSize)
+{
+	if (wsize == 1) return decodeLattice<uint8_t>(inst, rawEdges, path, minValue, beamSize);
+	if (wsize == 2) return decodeLattice<uint16_t>(inst, rawEdges, path, minValue, beamSize);
+	return decodeLattice<uint32_t>(inst, rawEdges, path, minValue, beamSize);
+}
+
+static PyObject* knlm__decodeLattice(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argIter, *item;
+	float minValue = -100;
+	size_t beamSize = 0;
+	if (!PyArg_ParseTuple(args, "OO|fn", &argSelf, &argIter, &minValue, &beamSize)) return nullptr;
+	try
+	{
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
+
+		if (!(argIter = PyObject_GetIter(argIter)))
+		{
+			throw runtime_error{ "argIter is not iterable" };
+		}
+
+		auto& vocab = inst->getVocab();
+		vector<tuple<uint32_t, uint32_t, size_t>> edges;
+		while ((item = PyIter_Next(argIter)))
+		{
+			unsigned int b, e;
+			PyObject* word;
+			if (!PyArg_ParseTuple(item, "IIO", &b, &e, &word))
+			{
+				Py_DECREF(item);
+				Py_DECREF(argIter);
+				return nullptr;
+			}
+			edges.emplace_back(b, e, findWord(vocab, word));
+			Py_DECREF(item);
+		}
+		Py_DECREF(argIter);
+
+		vector<size_t> path;
+		float score = decodeLattice(inst, wsize, edges, path, minValue, beamSize);
+		PyObject* ret = PyList_New(path.size());
+		for (size_t i = 0; i < path.size(); ++i)
+		{
+			PyList_SetItem(ret, i, Py_BuildValue("n", path[i]));
+		}
+		return Py_BuildValue("(Nf)", ret, score);
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__segment(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argText;
+	size_t maxLen = 10, beamSize = 0;
+	float minValue = -100;
+	if (!PyArg_ParseTuple(args, "OU|nfn", &argSelf, &argText, &maxLen, &minValue, &beamSize)) return nullptr;
+	try
+	{
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
+
+		// every substring found in the vocabulary becomes an edge of the lattice.
+		// single characters are always added (as unknown words if needed) so that at least one path exists.
+		// substrings are looked up in the UTF-8 of the text, where pos[i] is the byte offset of the i-th character
+		auto& vocab = inst->getVocab();
+		size_t bytes;
+		const char* text = wordToUTF8(argText, bytes);
+		vector<size_t> pos;
+		for (size_t i = 0; i < bytes; ++i)
+		{
+			if ((text[i] & 0xC0) != 0x80) pos.emplace_back(i);
+		}
+		size_t length = pos.size();
+		pos.emplace_back(bytes);
+		vector<tuple<uint32_t, uint32_t, size_t>> edges;
+		for (size_t b = 0; b < length; ++b)
+		{
+			for (size_t e = b + 1; e <= min(length, b + maxLen); ++e)
+			{
+				size_t id = vocab.find(text + pos[b], pos[e] - pos[b]);
+				if (id != knlm::Vocab::npos) edges.emplace_back(b, e, id);
+				else if (e == b + 1) edges.emplace_back(b, e, 0);
+			}
+		}
+
+		vector<size_t> path;
+		float score = decodeLattice(inst, wsize, edges, path, minValue, beamSize);
+		PyObject* ret = PyList_New(path.size());
+		for (size_t i = 0; i < path.size(); ++i)
+		{
+			auto& e = edges[path[i]];
+			PyList_SetItem(ret, i, PyUnicode_Substring(argText, get<0>(e), get<1>(e)));
+		}
+		return Py_BuildValue("(Nf)", ret, score);
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__branchingEntropy(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argIter;
+	if (!PyArg_ParseTuple(args, "OO", &argSelf, &argIter)) return nullptr;
+	try
+	{
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
+
+		if (!(argIter = PyObject_GetIter(argIter)))
+		{
+			throw runtime_error{ "argIter is not iterable" };
+		}
+
+		auto& vocab = inst->getVocab();
+		float score = 0;
+		try
+		{
+			if (wsize == 1)
+			{
+				auto seq = makeSeqListConst<uint8_t>(argIter, vocab, false);
+				score = ((knlm::KNLangModel<uint8_t>*)inst)->branchingEntropy(&seq[0], seq.size());
+			}
+			else if (wsize == 2)
+			{
+				auto seq = makeSeqListConst<uint16_t>(argIter, vocab, false);
+				score = ((knlm::KNLangModel<uint16_t>*)inst)->branchingEntropy(&seq[0], seq.size());
+			}
+			else if (wsize == 4)
+			{
+				auto seq = makeSeqListConst<uint32_t>(argIter, vocab, false);
+				score = ((knlm::KNLangModel<uint32_t>*)inst)->branchingEntropy(&seq[0], seq.size());
+			}
+		}
+		catch (const exception&)
+		{
+			Py_DECREF(argIter);
+			throw;
+		}
+		Py_DECREF(argIter);
+		return Py_BuildValue("f", score);
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__save(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	const char* path;
+	if (!PyArg_ParseTuple(args, "Os", &argSelf, &path)) return nullptr;
+	try
+	{
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		// the vocabulary is written in the same file, after the nodes
+		inst->writeToStream(ofstream{ path + string{".mdl"}, ios_base::binary });
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+
+static PyObject* knlm__load(PyObject* self, PyObject* args)
+{
+	const char* path;
+	size_t maxOrder = 0, firstOrder = 0;
+	if (!PyArg_ParseTuple(args, "s|nn", &path, &maxOrder, &firstOrder)) return nullptr;
+	try
+	{
+		string mdlPath = path + string{ ".mdl" };
+		ifstream ifs{ mdlPath, ios_base::binary };
+		if (!ifs) throw runtime_error{ "cannot read " + mdlPath };
+		// with firstOrder, the model up to it serves at once and the rest is read in the background as reload() does
+		if (!firstOrder || (maxOrder && firstOrder >= maxOrder)) firstOrder = maxOrder;
+		shared_ptr<knlm::IModel> model = knlm::readModel(move(ifs), firstOrder);
+		bool progressive = firstOrder != maxOrder && model->getOrder() == firstOrder;
+		// older models without vocabulary in the file are read whole, so that the vocabulary below is given to the whole model
+		if (progressive && model->getVocab().size() <= 3)
+		{
+			model = knlm::loadModel(mdlPath, maxOrder);
+			progressive = false;
+		}
+		PyObject* newInst = PyObject_CallFunction(gClass, nullptr);
+		if (!newInst) return nullptr;
+		getHandle(newInst)->set(model);
+		if (progressive) getHandle(newInst)->reload(mdlPath, true, maxOrder);
+
+		// older models keep their vocabulary in a pickled dict next to the model file
+		auto& vocab = model->getVocab();
+		if (vocab.size() <= 3)
+		{
+			PyObject *pickle = PyImport_ImportModule("pickle"), *io = PyImport_ImportModule("io");
+			PyObject *file = PyObject_CallMethod(io, "open", "ss", (path + string{ ".dict" }).c_str(), "rb");
+			PyObject *dict = file ? PyObject_CallMethod(pickle, "load", "O", file) : nullptr;
+			Py_XDECREF(file);
+			Py_XDECREF(io);
+			Py_XDECREF(pickle);
+			if (!dict) PyErr_Clear();
+			else
+			{
+				vector<PyObject*> words;
+				PyObject *key, *value;
+				Py_ssize_t pos = 0;
+				while (PyDict_Next(dict, &pos, &key, &value))
+				{
+					size_t id = PyLong_AsSize_t(value);
+					if (id >= words.size()) words.resize(id + 1);
+					words[id] = key;
+				}
+				vocab.clear();
+				for (size_t i = 0; i < words.size(); ++i)
+				{
+					size_t len = 0;
+					const char* s = words[i] ? wordToUTF8(words[i], len) : "";
+					if (vocab.add(s, len) != i) throw runtime_error{ "duplicated words in " + (path + string{ ".dict" }) };
+				}
+				Py_DECREF(dict);
+			}
+		}
+		return newInst;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__reload(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* kwlist[] = { "self", "path", "wait", "maxOrder", nullptr };
+	PyObject *argSelf;
+	const char* path;
+	int wait = 0;
+	size_t maxOrder = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os|pn", (char**)kwlist, &argSelf, &path, &wait, &maxOrder)) return nullptr;
+	try
+	{
+		// without waiting, the model is read on another thread while the current one keeps serving
+		string file = knlm::isModelImage(path) ? path : path + string{ ".mdl" };
+		getHandle(argSelf)->reload(file, !wait, maxOrder);
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__share(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	const char* path;
+	if (!PyArg_ParseTuple(args, "Os", &argSelf, &path)) return nullptr;
+	try
+	{
+		// the file is replaced, not rewritten, so the image of this or other processes mapping path stays valid
+		knlm::writeImageFile(*getModel(argSelf), path);
+		// the object serves the mapped image from now on, so that processes forked after this share its pages
+		getHandle(argSelf)->set(knlm::mapModel(path));
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__loadShared(PyObject* self, PyObject* args)
+{
+	const char* path;
+	if (!PyArg_ParseTuple(args, "s", &path)) return nullptr;
+	try
+	{
+		shared_ptr<knlm::IModel> model = knlm::mapModel(path);
+		PyObject* newInst = PyObject_CallFunction(gClass, nullptr);
+		if (!newInst) return nullptr;
+		getHandle(newInst)->set(model);
+		return newInst;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+// only shared models can be pickled, and they are pickled as the path of their image
+static PyObject* knlm__reduce(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	if (!PyArg_ParseTuple(args, "O", &argSelf)) return nullptr;
+	try
+	{
+		auto model = getModel(argSelf);
+		if (!model->getImage())
+		{
+			PyErr_SetString(PyExc_TypeError, "only a shared model can be pickled. call share(path) first");
+			return nullptr;
+		}
+		return Py_BuildValue("(O()s)", gClass, model->getImage()->getPath().c_str());
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__setstate(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	const char* path;
+	if (!PyArg_ParseTuple(args, "Os", &argSelf, &path)) return nullptr;
+	try
+	{
+		getHandle(argSelf)->set(knlm::mapModel(path));
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__saveArpa(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	const char* path;
+	size_t numThreads = 0;
+	if (!PyArg_ParseTuple(args, "Os|n", &argSelf, &path, &numThreads)) return nullptr;
+	try
+	{
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+
+		ofstream ofs{ path, ios_base::binary };
+		if (!ofs) throw runtime_error{ string{ "cannot write " } + path };
+		inst->writeToArpa(ofs, numThreads);
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__loadArpa(PyObject* self, PyObject* args)
+{
+	const char* path;
+	size_t numThreads = 0;
+	if (!PyArg_ParseTuple(args, "s|n", &path, &numThreads)) return nullptr;
+	try
+	{
+		ifstream ifs{ path, ios_base::binary };
+		if (!ifs) throw runtime_error{ string{ "cannot read " } + path };
+		string data{ istreambuf_iterator<char>{ ifs }, istreambuf_iterator<char>{} };
+
+		// the narrowest width of word ids that fits the 1-grams
+		size_t vocabSize = knlm::arpa::readVocabSize(data.data(), data.size()), wsize = 4;
+		if (vocabSize <= 0x100) wsize = 1;
+		else if (vocabSize <= 0x10000) wsize = 2;
+		PyObject* newInst = PyObject_CallFunction(gClass, "nn", (Py_ssize_t)2, (Py_ssize_t)wsize);
+		if (!newInst) return nullptr;
+
+		try
+		{
+			getModel(newInst)->readFromArpa(data.data(), data.size(), numThreads);
+		}
+		catch (const exception&)
+		{
+			Py_DECREF(newInst);
+			throw;
+		}
+		return newInst;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__stats(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	int reset = 0;
+	if (!PyArg_ParseTuple(args, "O|p", &argSelf, &reset)) return nullptr;
+	try
+	{
+		PyObject* ret = PyDict_New();
+		auto setItem = [&](PyObject* dict, const char* key, PyObject* value)
+		{
+			PyDict_SetItemString(dict, key, value);
+			Py_DECREF(value);
+		};
+#ifdef KNLM_STATS
+		using namespace knlm::stats;
+		auto s = collect();
+		if (reset) knlm::stats::reset();
+		setItem(ret, "enabled", PyBool_FromLong(1));
+		setItem(ret, "tokens", PyLong_FromUnsignedLongLong(s.v[Snapshot::tokens]));
+		setItem(ret, "oov", PyLong_FromUnsignedLongLong(s.v[Snapshot::oov]));
+		setItem(ret, "oovRate", PyFloat_FromDouble(s.v[Snapshot::tokens] ? s.v[Snapshot::oov] / (double)s.v[Snapshot::tokens] : 0));
+		setItem(ret, "denseHits", PyLong_FromUnsignedLongLong(s.v[Snapshot::denseHits]));
+		setItem(ret, "sparseSearches", PyLong_FromUnsignedLongLong(s.v[Snapshot::sparseSearches]));
+		setItem(ret, "filterNegatives", PyLong_FromUnsignedLongLong(s.v[Snapshot::filterNegatives]));
+		setItem(ret, "filterPositives", PyLong_FromUnsignedLongLong(s.v[Snapshot::filterPositives]));
+		setItem(ret, "filterFalsePositives", PyLong_FromUnsignedLongLong(s.v[Snapshot::filterFalsePositives]));
+		PyObject* backoff = PyList_New(maxBackoff);
+		for (size_t i = 0; i < maxBackoff; ++i) PyList_SetItem(backoff, i, PyLong_FromUnsignedLongLong(s.v[Snapshot::backoff + i]));
+		setItem(ret, "backoff", backoff);
+		PyObject* calls = PyDict_New();
+		PyObject* latency = PyDict_New();
+		for (size_t q = 0; q < numQueries; ++q)
+		{
+			if (!s.callsOf((Query)q)) continue;
+			setItem(calls, queryName((Query)q), PyLong_FromUnsignedLongLong(s.callsOf((Query)q)));
+			PyObject* hist = PyList_New(latencyBuckets);
+			for (size_t i = 0; i < latencyBuckets; ++i) PyList_SetItem(hist, i, PyLong_FromUnsignedLongLong(s.latencyOf((Query)q)[i]));
+			setItem(latency, queryName((Query)q), hist);
+		}
+		setItem(ret, "calls", calls);
+		setItem(ret, "latency", latency);
+#else
+		setItem(ret, "enabled", PyBool_FromLong(0));
+#endif
+		return ret;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knlm__getattr(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	const char* name;
+	if (!PyArg_ParseTuple(args, "Os", &argSelf, &name)) return nullptr;
+	try
+	{
+		auto model = getModel(argSelf);
+		knlm::IModel* inst = model.get();
+		size_t wsize = inst->getWordSize();
+		if (name == string("_wsize"))
+		{
+			return Py_BuildValue("n", wsize);
+		}
+		else if (name == string("generation"))
+		{
+			return Py_BuildValue("n", getHandle(argSelf)->getGeneration());
+		}
+		else if (name == string("reloadError"))
+		{
+			auto error = getHandle(argSelf)->getError();
+			if (error.empty())
+			{
+				Py_INCREF(Py_None);
+				return Py_None;
+			}
+			return PyUnicode_FromStringAndSize(error.data(), error.size());
+		}
+		else if (name == string("order"))
+		{
+			return Py_BuildValue("n", inst->getOrder());
+		}
+		else if (name == string("vocabs"))
+		{
+			return Py_BuildValue("n", inst->getVocabSize());
+		}
+		else if (name == string("memoryUsage"))
+		{
+			auto usage = inst->getMemoryUsage();
+			PyObject* levels = PyList_New(usage.levels.size());
+			for (size_t i = 0; i < usage.levels.size(); ++i)
+			{
+				auto& l = usage.levels[i];
+				PyList_SetItem(levels, i, Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n}", "nodes", l.nodes, "nodeBytes", l.nodeBytes,
+					"denseBytes", l.denseBytes, "sparseBytes", l.sparseBytes, "overheadBytes", l.overheadBytes, "filterBytes", l.filterBytes));
+			}
+			return Py_BuildValue("{s:N,s:n,s:n,s:n,s:n}", "levels", levels, "slackBytes", usage.slackBytes,
+				"vocabBytes", usage.vocabBytes, "mappedBytes", usage.mappedBytes, "total", usage.total());
+		}
+		else if (name == string("estimatedSize"))
+		{
+			auto est = inst->estimateSize();
+			PyObject* levels = PyList_New(est.bakedLevels.size());
+			for (size_t i = 0; i < est.bakedLevels.size(); ++i) PyList_SetItem(levels, i, PyLong_FromSize_t(est.bakedLevels[i]));
+			return Py_BuildValue("{s:n,s:N,s:n}", "baked", est.baked, "bakedLevels", levels, "serialized", est.serialized);
+		}
+		else
+		{
+			return PyErr_Format(PyExc_AttributeError, "%s", name);
+		}
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static knlm::ISuffixArrayModel* getSAModel(PyObject* argSelf)
+{
+	PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
+	if (!instObj) throw runtime_error{ "_inst is null" };
+	auto* inst = (knlm::ISuffixArrayModel*)PyLong_AsLongLong(instObj);
+	Py_DECREF(instObj);
+	if (!inst) throw runtime_error{ "_inst is null" };
+	return inst;
+}
+
+static PyObject* knsa__init(PyObject* self, PyObject* args)
+{
+	PyObject* argSelf;
+	size_t numOrder = 0, wordSize = 2;
+	if (!PyArg_ParseTuple(args, "O|nn", &argSelf, &numOrder, &wordSize)) return nullptr;
+	try
+	{
+		auto* inst = knlm::createSuffixArrayModel(wordSize, numOrder).release();
+		PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong((ssize_t)inst));
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject* knsa__del(PyObject* self, PyObject* args)
+{
+	PyObject* argSelf;
+	if (!PyArg_ParseTuple(args, "O", &argSelf)) return nullptr;
+	try
+	{
+		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
+		if (!instObj) throw runtime_error{ "_inst is null" };
+		auto* inst = (knlm::ISuffixArrayModel*)PyLong_AsLongLong(instObj);
+		Py_DECREF(instObj);
+		if (inst) delete inst;
+		PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong(0));
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject* knsa__train(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argIter;
+	if (!PyArg_ParseTuple(args, "OO", &argSelf, &argIter)) return nullptr;
+	try
+	{
+		auto* inst = getSAModel(argSelf);
+		size_t wsize = inst->getWordSize();
+		if (!(argIter = PyObject_GetIter(argIter)))
+		{
+			throw runtime_error{ "argIter is not iterable" };
+		}
+
+		auto& vocab = inst->getVocab();
+		try
+		{
+			// the last id of the width separates sentences, so one word fewer fits than in KneserNey
+			if (wsize == 1)
+			{
+				auto seq = makeSeqList<uint8_t>(argIter, vocab, numeric_limits<uint8_t>::max() - 1);
+				((knlm::SuffixArrayModel<uint8_t>*)inst)->trainSequence(&seq[0], seq.size());
+			}
+			else if (wsize == 2)
+			{
+				auto seq = makeSeqList<uint16_t>(argIter, vocab, numeric_limits<uint16_t>::max() - 1);
+				((knlm::SuffixArrayModel<uint16_t>*)inst)->trainSequence(&seq[0], seq.size());
+			}
+			else if (wsize == 4)
+			{
+				auto seq = makeSeqList<uint32_t>(argIter, vocab, numeric_limits<uint32_t>::max() - 1);
+				((knlm::SuffixArrayModel<uint32_t>*)inst)->trainSequence(&seq[0], seq.size());
+			}
+		}
+		catch (const VocabOverflow&)
+		{
+			Py_DECREF(argIter);
+			PyErr_Format(PyExc_RuntimeError, "vocab size overflow. use bigger 'wsize' than %d", wsize);
+			return nullptr;
+		}
+		catch (const exception&)
+		{
+			Py_DECREF(argIter);
+			throw;
+		}
+		Py_DECREF(argIter);
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knsa__optimize(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	if (!PyArg_ParseTuple(args, "O", &argSelf)) return nullptr;
+	try
+	{
+		getSAModel(argSelf)->optimize();
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knsa__evaluateSent(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argIter;
+	float minValue = -100;
+	if (!PyArg_ParseTuple(args, "OO|f", &argSelf, &argIter, &minValue)) return nullptr;
+	try
+	{
+		auto* inst = getSAModel(argSelf);
+		size_t wsize = inst->getWordSize();
+		if (!(argIter = PyObject_GetIter(argIter)))
+		{
+			throw runtime_error{ "argIter is not iterable" };
+		}
+
+		auto& vocab = inst->getVocab();
+		float score = 0;
+		try
+		{
+			if (wsize == 1)
+			{
+				auto seq = makeSeqListConst<uint8_t>(argIter, vocab);
+				score = ((knlm::SuffixArrayModel<uint8_t>*)inst)->evaluateLLSent(&seq[0], seq.size(), minValue);
+			}
+			else if (wsize == 2)
+			{
+				auto seq = makeSeqListConst<uint16_t>(argIter, vocab);
+				score = ((knlm::SuffixArrayModel<uint16_t>*)inst)->evaluateLLSent(&seq[0], seq.size(), minValue);
+			}
+			else if (wsize == 4)
+			{
+				auto seq = makeSeqListConst<uint32_t>(argIter, vocab);
+				score = ((knlm::SuffixArrayModel<uint32_t>*)inst)->evaluateLLSent(&seq[0], seq.size(), minValue);
+			}
+		}
+		catch (const exception&)
+		{
+			Py_DECREF(argIter);
+			throw;
+		}
+		Py_DECREF(argIter);
+		return Py_BuildValue("f", score);
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knsa__evaluateEachWord(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argIter;
+	float minValue = -INFINITY;
+	if (!PyArg_ParseTuple(args, "OO|f", &argSelf, &argIter, &minValue)) return nullptr;
+	try
+	{
+		auto* inst = getSAModel(argSelf);
+		size_t wsize = inst->getWordSize();
+		if (!(argIter = PyObject_GetIter(argIter)))
+		{
+			throw runtime_error{ "argIter is not iterable" };
+		}
+
+		auto& vocab = inst->getVocab();
+		vector<float> scores;
+		try
+		{
+			if (wsize == 1)
+			{
+				auto seq = makeSeqListConst<uint8_t>(argIter, vocab, false);
+				scores = ((knlm::SuffixArrayModel<uint8_t>*)inst)->evaluateLLEachWord(&seq[0], seq.size());
+			}
+			else if (wsize == 2)
+			{
+				auto seq = makeSeqListConst<uint16_t>(argIter, vocab, false);
+				scores = ((knlm::SuffixArrayModel<uint16_t>*)inst)->evaluateLLEachWord(&seq[0], seq.size());
+			}
+			else if (wsize == 4)
+			{
+				auto seq = makeSeqListConst<uint32_t>(argIter, vocab, false);
+				scores = ((knlm::SuffixArrayModel<uint32_t>*)inst)->evaluateLLEachWord(&seq[0], seq.size());
+			}
+		}
+		catch (const exception&)
+		{
+			Py_DECREF(argIter);
+			throw;
+		}
+		Py_DECREF(argIter);
+		PyObject* ret = PyList_New(scores.size() - 1);
+		for (size_t i = 1; i < scores.size(); ++i)
+		{
+			PyList_SetItem(ret, i - 1, Py_BuildValue("f", max(scores[i], minValue)));
+		}
+		return ret;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knsa__save(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	const char* path;
+	if (!PyArg_ParseTuple(args, "Os", &argSelf, &path)) return nullptr;
+	try
+	{
+		getSAModel(argSelf)->writeToStream(ofstream{ path + string{ ".sa" }, ios_base::binary });
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knsa__load(PyObject* self, PyObject* args)
+{
+	const char* path;
+	if (!PyArg_ParseTuple(args, "s", &path)) return nullptr;
+	try
+	{
+		string saPath = path + string{ ".sa" };
+		ifstream ifs{ saPath, ios_base::binary };
+		if (!ifs) throw runtime_error{ "cannot read " + saPath };
+		auto model = knlm::readSuffixArrayModel(move(ifs));
+		PyObject* newInst = PyObject_CallFunction(gSAClass, nullptr);
+		if (!newInst) return nullptr;
+		delete getSAModel(newInst);
+		PyObject_SetAttrString(newInst, "_inst", PyLong_FromLongLong((ssize_t)model.release()));
+		return newInst;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knsa__getattr(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	const char* name;
+	if (!PyArg_ParseTuple(args, "Os", &argSelf, &name)) return nullptr;
+	try
+	{
+		auto* inst = getSAModel(argSelf);
+		if (name == string("_wsize"))
+		{
+			return Py_BuildValue("n", inst->getWordSize());
+		}
+		else if (name == string("order"))
 		{
 			return Py_BuildValue("n", inst->getOrder());
 		}
@@ -532,6 +1623,399 @@ static PyObject* knlm__getattr(PyObject* self, PyObject* args)
 		{
 			return Py_BuildValue("n", inst->getVocabSize());
 		}
+		else if (name == string("tokens"))
+		{
+			return Py_BuildValue("n", inst->getNumTokens());
+		}
+		else if (name == string("cachedContexts"))
+		{
+			return Py_BuildValue("n", inst->getCachedContexts());
+		}
+		else
+		{
+			return PyErr_Format(PyExc_AttributeError, "%s", name);
+		}
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static knlm::Ensemble* getEnsemble(PyObject* argSelf)
+{
+	PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
+	if (!instObj) throw runtime_error{ "_inst is null" };
+	auto* inst = (knlm::Ensemble*)PyLong_AsLongLong(instObj);
+	Py_DECREF(instObj);
+	if (!inst) throw runtime_error{ "_inst is null" };
+	return inst;
+}
+
+static PyObject* knen__init(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argModels, *argWeights;
+	if (!PyArg_ParseTuple(args, "OOO", &argSelf, &argModels, &argWeights)) return nullptr;
+	PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong(0));
+	try
+	{
+		vector<shared_ptr<const knlm::IModel>> models;
+		vector<float> weights;
+		PyObject *iter, *item;
+		if (!(iter = PyObject_GetIter(argModels))) throw runtime_error{ "models must be iterable" };
+		while ((item = PyIter_Next(iter)))
+		{
+			int isModel = PyObject_IsInstance(item, gClass);
+			// the models served at this moment. reloading them later does not change the ensemble
+			if (isModel > 0) models.emplace_back(getModel(item));
+			Py_DECREF(item);
+			if (isModel <= 0)
+			{
+				Py_DECREF(iter);
+				throw runtime_error{ "models must be KneserNey" };
+			}
+		}
+		Py_DECREF(iter);
+		if (!(iter = PyObject_GetIter(argWeights))) throw runtime_error{ "weights must be iterable" };
+		while ((item = PyIter_Next(iter)))
+		{
+			weights.emplace_back(PyFloat_AsDouble(item));
+			Py_DECREF(item);
+		}
+		Py_DECREF(iter);
+		if (PyErr_Occurred()) return nullptr;
+
+		auto* inst = new knlm::Ensemble{ models, weights };
+		PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong((ssize_t)inst));
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject* knen__del(PyObject* self, PyObject* args)
+{
+	PyObject* argSelf;
+	if (!PyArg_ParseTuple(args, "O", &argSelf)) return nullptr;
+	try
+	{
+		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
+		if (!instObj) throw runtime_error{ "_inst is null" };
+		auto* inst = (knlm::Ensemble*)PyLong_AsLongLong(instObj);
+		Py_DECREF(instObj);
+		if (inst) delete inst;
+		PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong(0));
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject* knen__evaluateSent(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argIter;
+	float minValue = -100;
+	if (!PyArg_ParseTuple(args, "OO|f", &argSelf, &argIter, &minValue)) return nullptr;
+	try
+	{
+		auto* inst = getEnsemble(argSelf);
+		if (!(argIter = PyObject_GetIter(argIter)))
+		{
+			throw runtime_error{ "argIter is not iterable" };
+		}
+		auto seq = makeSeqListConst<uint32_t>(argIter, inst->getVocab());
+		Py_DECREF(argIter);
+		return Py_BuildValue("f", inst->evaluateLLSent(&seq[0], seq.size(), minValue));
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knen__evaluateEachWord(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argIter;
+	float minValue = -INFINITY;
+	if (!PyArg_ParseTuple(args, "OO|f", &argSelf, &argIter, &minValue)) return nullptr;
+	try
+	{
+		auto* inst = getEnsemble(argSelf);
+		if (!(argIter = PyObject_GetIter(argIter)))
+		{
+			throw runtime_error{ "argIter is not iterable" };
+		}
+		auto seq = makeSeqListConst<uint32_t>(argIter, inst->getVocab(), false);
+		Py_DECREF(argIter);
+		auto scores = inst->evaluateLLEachWord(&seq[0], seq.size());
+		PyObject* ret = PyList_New(scores.size() - 1);
+		for (size_t i = 1; i < scores.size(); ++i)
+		{
+			PyList_SetItem(ret, i - 1, Py_BuildValue("f", max(scores[i], minValue)));
+		}
+		return ret;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knen__getattr(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	const char* name;
+	if (!PyArg_ParseTuple(args, "Os", &argSelf, &name)) return nullptr;
+	try
+	{
+		auto* inst = getEnsemble(argSelf);
+		if (name == string("vocabs"))
+		{
+			return Py_BuildValue("n", inst->getVocab().size());
+		}
+		else if (name == string("weights"))
+		{
+			PyObject* ret = PyList_New(inst->size());
+			for (size_t i = 0; i < inst->size(); ++i) PyList_SetItem(ret, i, PyFloat_FromDouble(inst->getWeight(i)));
+			return ret;
+		}
+		else
+		{
+			return PyErr_Format(PyExc_AttributeError, "%s", name);
+		}
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static knlm::BatchScorer* getScorer(PyObject* argSelf)
+{
+	PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
+	if (!instObj) throw runtime_error{ "_inst is null" };
+	auto* inst = (knlm::BatchScorer*)PyLong_AsLongLong(instObj);
+	Py_DECREF(instObj);
+	if (!inst) throw runtime_error{ "the scorer is closed" };
+	return inst;
+}
+
+static PyObject *gAsyncio, *gResolve;
+
+// sets the result of each future to its value, or its exception if the value is one, unless it was cancelled meanwhile.
+// runs on the loop of the futures
+static PyObject* resolveFutures(PyObject* self, PyObject* args)
+{
+	PyObject *futs, *values;
+	if (!PyArg_ParseTuple(args, "OO", &futs, &values)) return nullptr;
+	for (Py_ssize_t i = 0; i < PyList_Size(futs); ++i)
+	{
+		PyObject *fut = PyList_GetItem(futs, i), *value = PyList_GetItem(values, i);
+		PyObject* done = PyObject_CallMethod(fut, "done", nullptr);
+		if (!done) return nullptr;
+		int isDone = PyObject_IsTrue(done);
+		Py_DECREF(done);
+		if (isDone) continue;
+		PyObject* ret = PyObject_CallMethod(fut, PyExceptionInstance_Check(value) ? "set_exception" : "set_result", "O", value);
+		if (!ret) return nullptr;
+		Py_DECREF(ret);
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// hands the results of a batch to the event loops of their futures, waking each loop once. runs on the workers of the scorer
+static void resolveBatch(vector<knlm::BatchScorer::Request>& batch)
+{
+	PyGILState_STATE gil = PyGILState_Ensure();
+	PyObject *loop = nullptr, *futs = nullptr, *values = nullptr;
+	auto flush = [&]()
+	{
+		if (!loop) return;
+		PyObject* ret = PyObject_CallMethod(loop, "call_soon_threadsafe", "OOO", gResolve, futs, values);
+		// the loop may have been closed without waiting for the results
+		if (!ret) PyErr_Clear();
+		Py_XDECREF(ret);
+		Py_DECREF(loop);
+		Py_DECREF(futs);
+		Py_DECREF(values);
+		loop = nullptr;
+	};
+	for (auto& r : batch)
+	{
+		auto* fut = (PyObject*)r.tag;
+		PyObject* value;
+		if (!r.error.empty()) value = PyObject_CallFunction(PyExc_Exception, "s", r.error.c_str());
+		else if (!r.eachWord) value = PyFloat_FromDouble(r.ll);
+		else
+		{
+			value = PyList_New(r.lls.size() - 1);
+			for (size_t i = 1; i < r.lls.size(); ++i) PyList_SetItem(value, i - 1, PyFloat_FromDouble(r.lls[i]));
+		}
+		PyObject* futLoop = PyObject_CallMethod(fut, "get_loop", nullptr);
+		if (futLoop && futLoop != loop)
+		{
+			flush();
+			loop = futLoop;
+			futs = PyList_New(0);
+			values = PyList_New(0);
+		}
+		else Py_XDECREF(futLoop);
+		if (futLoop)
+		{
+			PyList_Append(futs, fut);
+			PyList_Append(values, value);
+		}
+		else PyErr_Clear();
+		Py_XDECREF(value);
+		Py_DECREF(fut);
+	}
+	flush();
+	PyGILState_Release(gil);
+}
+
+static PyObject* knbs__init(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf, *argModel;
+	size_t maxBatch = 64, numWorkers = 1;
+	double maxDelay = 0.001;
+	float minValue = -100;
+	if (!PyArg_ParseTuple(args, "OO|ndnf", &argSelf, &argModel, &maxBatch, &maxDelay, &numWorkers, &minValue)) return nullptr;
+	PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong(0));
+	try
+	{
+		if (PyObject_IsInstance(argModel, gClass) <= 0) throw runtime_error{ "model must be KneserNey" };
+		if (!gAsyncio && !(gAsyncio = PyImport_ImportModule("asyncio"))) return nullptr;
+		// requests are made on the model the object serves when they are submitted
+		PyObject_SetAttrString(argSelf, "_model", argModel);
+		auto* inst = new knlm::BatchScorer{ resolveBatch, maxBatch, chrono::microseconds{ (long long)(maxDelay * 1e6) }, numWorkers, minValue };
+		PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong((ssize_t)inst));
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject* knbs__close(PyObject* self, PyObject* args)
+{
+	PyObject* argSelf;
+	if (!PyArg_ParseTuple(args, "O", &argSelf)) return nullptr;
+	try
+	{
+		PyObject* instObj = PyObject_GetAttrString(argSelf, "_inst");
+		if (!instObj) throw runtime_error{ "_inst is null" };
+		auto* inst = (knlm::BatchScorer*)PyLong_AsLongLong(instObj);
+		Py_DECREF(instObj);
+		PyObject_SetAttrString(argSelf, "_inst", PyLong_FromLongLong(0));
+		// the workers need the GIL to hand over the requests still queued
+		Py_BEGIN_ALLOW_THREADS
+		if (inst) delete inst;
+		Py_END_ALLOW_THREADS
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject* submitRequest(PyObject* args, bool eachWord)
+{
+	PyObject *argSelf, *argIter;
+	if (!PyArg_ParseTuple(args, "OO", &argSelf, &argIter)) return nullptr;
+	try
+	{
+		auto* inst = getScorer(argSelf);
+		PyObject* modelObj = PyObject_GetAttrString(argSelf, "_model");
+		if (!modelObj) return nullptr;
+		knlm::BatchScorer::Request req;
+		req.model = getModel(modelObj);
+		Py_DECREF(modelObj);
+		req.eachWord = eachWord;
+		if (!(argIter = PyObject_GetIter(argIter))) throw runtime_error{ "argIter is not iterable" };
+		try
+		{
+			req.seq = makeSeqListConst<uint32_t>(argIter, req.model->getVocab(), !eachWord);
+		}
+		catch (const exception&)
+		{
+			Py_DECREF(argIter);
+			throw;
+		}
+		Py_DECREF(argIter);
+
+		PyObject* loop = PyObject_CallMethod(gAsyncio, "get_running_loop", nullptr);
+		if (!loop) return nullptr;
+		PyObject* fut = PyObject_CallMethod(loop, "create_future", nullptr);
+		Py_DECREF(loop);
+		if (!fut) return nullptr;
+		// the request holds a reference until its result is handed over
+		Py_INCREF(fut);
+		req.tag = fut;
+		try
+		{
+			inst->submit(move(req));
+		}
+		catch (const exception&)
+		{
+			Py_DECREF(fut);
+			Py_DECREF(fut);
+			throw;
+		}
+		return fut;
+	}
+	catch (const exception& e)
+	{
+		PyErr_SetString(PyExc_Exception, e.what());
+		return nullptr;
+	}
+}
+
+static PyObject* knbs__evaluateSent(PyObject* self, PyObject* args)
+{
+	return submitRequest(args, false);
+}
+
+static PyObject* knbs__evaluateEachWord(PyObject* self, PyObject* args)
+{
+	return submitRequest(args, true);
+}
+
+static PyObject* knbs__getattr(PyObject* self, PyObject* args)
+{
+	PyObject *argSelf;
+	const char* name;
+	if (!PyArg_ParseTuple(args, "Os", &argSelf, &name)) return nullptr;
+	try
+	{
+		if (name == string("stats"))
+		{
+			auto s = getScorer(argSelf)->getStats();
+			PyObject* sizes = PyList_New(s.batchSizes.size());
+			for (size_t i = 0; i < s.batchSizes.size(); ++i) PyList_SetItem(sizes, i, PyLong_FromSize_t(s.batchSizes[i]));
+			return Py_BuildValue("{s:n,s:n,s:n,s:n,s:d,s:N}", "queued", s.queued, "maxQueued", s.maxQueued,
+				"requests", s.requests, "batches", s.batches, "meanBatchSize", s.batches ? (s.requests - s.queued) / (double)s.batches : 0.,
+				"batchSizes", sizes);
+		}
 		else
 		{
 			return PyErr_Format(PyExc_AttributeError, "%s", name);
@@ -549,6 +2033,10 @@ static PyObject *createClassObject(const char *name, PyMethodDef methods[])
 	PyObject *pClassName = PyUnicode_FromString(name);
 	PyObject *pClassBases = PyTuple_New(0);
 	PyObject *pClassDic = PyDict_New();
+	// so that pickle finds the class
+	PyObject *pModuleName = PyUnicode_FromString("knlm_c");
+	PyDict_SetItemString(pClassDic, "__module__", pModuleName);
+	Py_DECREF(pModuleName);
 
 
 	PyMethodDef *def;
@@ -589,22 +2077,76 @@ PyMODINIT_FUNC PyInit_knlm_c()
 	{
 		{ "__init__", knlm__init, METH_VARARGS, "initializer" },
 		{ "train", knlm__train, METH_VARARGS, "train a sequence" },
-		{ "optimize", knlm__optimize, METH_VARARGS, "optimize" },
+		{ "optimize", (PyCFunction)knlm__optimize, METH_VARARGS | METH_KEYWORDS, "optimize. with sortVocab=True, words are renumbered by frequency for faster lookups and smaller files. sortNodes=True lays out children next to each other" },
+		{ "reorderNodes", knlm__reorderNodes, METH_VARARGS, "lay out the nodes of the optimized model for locality, the nodes most visited by scoring the given sentences first" },
+		{ "setFilterBits", knlm__setFilterBits, METH_VARARGS, "build Bloom filters of the given bits per n-gram, which skip lookups of missing n-grams. 0 drops them" },
 		{ "evaluate", knlm__evaluate , METH_VARARGS, "evaluate ll of last element" },
 		{ "evaluateSent", knlm__evaluateSent, METH_VARARGS, "evaluate total ll of sequences" },
 		{ "evaluateEachWord", knlm__evaluateEachWord, METH_VARARGS, "evaluate each sequence" },
+		{ "evaluateSentBatch", knlm__evaluateSentBatch, METH_VARARGS, "evaluate total ll of many sentences at once" },
+		{ "evaluateNBest", knlm__evaluateNBest, METH_VARARGS, "evaluate total ll of each hypothesis in n-best list, sharing common prefixes" },
+		{ "evaluateTree", knlm__evaluateTree, METH_VARARGS, "evaluate total ll of the hypothesis ending at each entry of a prefix tree given as (tokens, parents)" },
+		{ "decodeLattice", knlm__decodeLattice, METH_VARARGS, "find the best path over lattice of (begin, end, word) edges" },
+		{ "segment", knlm__segment, METH_VARARGS, "segment unspaced text into the most probable sequence of known words" },
 		{ "branchingEntropy", knlm__branchingEntropy, METH_VARARGS, "evaluate branching entropy of sequence" },
+		{ "stats", knlm__stats, METH_VARARGS, "query statistics of all threads, collected when built with KNLM_STATS" },
 		{ "__getattr__", knlm__getattr, METH_VARARGS, "getattr" },
 		{ "save", knlm__save, METH_VARARGS, "save current trained model to file" },
-		{ "load", knlm__load, METH_VARARGS | METH_STATIC, "load model from file" },
+		{ "load", knlm__load, METH_VARARGS | METH_STATIC, "load model from file, up to maxOrder if given. with firstOrder, serve the n-grams up to it while the rest loads in the background" },
+		{ "reload", (PyCFunction)knlm__reload, METH_VARARGS | METH_KEYWORDS, "replace the model with one loaded from file, in the background unless wait=True, up to maxOrder if given" },
+		{ "share", knlm__share, METH_VARARGS, "write the optimized model as an image file and serve it from there, shared by every process mapping the file" },
+		{ "loadShared", knlm__loadShared, METH_VARARGS | METH_STATIC, "map model image written by share()" },
+		{ "__reduce__", knlm__reduce, METH_VARARGS, "pickle shared model as the path of its image" },
+		{ "__setstate__", knlm__setstate, METH_VARARGS, "map the image of unpickled model" },
+		{ "saveArpa", knlm__saveArpa, METH_VARARGS, "save current optimized model to ARPA file" },
+		{ "loadArpa", knlm__loadArpa, METH_VARARGS | METH_STATIC, "load model from ARPA file" },
 		{ "__del__", knlm__del, METH_VARARGS, "destructor" },
 		{ nullptr, nullptr, 0, nullptr }
 	};
+	static PyMethodDef saMethods[] =
+	{
+		{ "__init__", knsa__init, METH_VARARGS, "initializer. order 0 uses contexts of any length" },
+		{ "train", knsa__train, METH_VARARGS, "train a sequence" },
+		{ "optimize", knsa__optimize, METH_VARARGS, "build the suffix array of the trained sequences" },
+		{ "evaluateSent", knsa__evaluateSent, METH_VARARGS, "evaluate total ll of sequences" },
+		{ "evaluateEachWord", knsa__evaluateEachWord, METH_VARARGS, "evaluate each sequence" },
+		{ "__getattr__", knsa__getattr, METH_VARARGS, "getattr" },
+		{ "save", knsa__save, METH_VARARGS, "save optimized model to file" },
+		{ "load", knsa__load, METH_VARARGS | METH_STATIC, "load model from file" },
+		{ "__del__", knsa__del, METH_VARARGS, "destructor" },
+		{ nullptr, nullptr, 0, nullptr }
+	};
+	static PyMethodDef enMethods[] =
+	{
+		{ "__init__", knen__init, METH_VARARGS, "initializer with KneserNey models and their weights" },
+		{ "evaluateSent", knen__evaluateSent, METH_VARARGS, "evaluate total interpolated ll of sequences" },
+		{ "evaluateEachWord", knen__evaluateEachWord, METH_VARARGS, "evaluate interpolated ll of each word" },
+		{ "__getattr__", knen__getattr, METH_VARARGS, "getattr" },
+		{ "__del__", knen__del, METH_VARARGS, "destructor" },
+		{ nullptr, nullptr, 0, nullptr }
+	};
+	static PyMethodDef bsMethods[] =
+	{
+		{ "__init__", knbs__init, METH_VARARGS, "initializer with a KneserNey model, maxBatch, maxDelay in seconds, workers and minValue" },
+		{ "evaluateSent", knbs__evaluateSent, METH_VARARGS, "future of the total ll of sequence, scored in a batch with other requests" },
+		{ "evaluateEachWord", knbs__evaluateEachWord, METH_VARARGS, "future of the ll of each word, scored in a batch with other requests" },
+		{ "close", knbs__close, METH_VARARGS, "score the requests queued and stop the workers" },
+		{ "__getattr__", knbs__getattr, METH_VARARGS, "getattr" },
+		{ "__del__", knbs__close, METH_VARARGS, "destructor" },
+		{ nullptr, nullptr, 0, nullptr }
+	};
+	static PyMethodDef resolveDef = { "_resolve", resolveFutures, METH_VARARGS, "set the results of futures which are not done" };
+	gResolve = PyCFunction_New(&resolveDef, nullptr);
 	gModule = PyModule_Create(&mod);
 	PyObject *pModuleDic = PyModule_GetDict(gModule);
 	PyDict_SetItemString(pModuleDic, "KneserNey", gClass = createClassObject("KneserNey", clsMethods));
+	PyDict_SetItemString(pModuleDic, "SuffixArrayKneserNey", gSAClass = createClassObject("SuffixArrayKneserNey", saMethods));
+	PyDict_SetItemString(pModuleDic, "KneserNeyEnsemble", createClassObject("KneserNeyEnsemble", enMethods));
+	PyDict_SetItemString(pModuleDic, "KneserNeyBatchScorer", createClassObject("KneserNeyBatchScorer", bsMethods));
+#if PY_VERSION_HEX < 0x03070000
 	if (!PyEval_ThreadsInitialized()) {
 		PyEval_InitThreads();
 	}
+#endif
 	return gModule;
 }
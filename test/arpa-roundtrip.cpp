@@ -0,0 +1,80 @@
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <random>
+#include "KNLangModel.hpp"
+
+using namespace std;
+
+/*
+Trains a model, writes it as ARPA, reads it back and saves and loads the result.
+Every sentence, including those with unknown words, must score as the trained model saved and loaded does.
+*/
+
+template<typename _WType>
+vector<_WType> randomSentence(mt19937_64& rng, size_t vocabSize, bool unknown)
+{
+	vector<_WType> sent{ 1 };
+	size_t len = 3 + rng() % 10;
+	for (size_t i = 0; i < len; ++i)
+	{
+		// smaller ids are more frequent
+		size_t r = rng() % (vocabSize - 3);
+		sent.emplace_back(3 + r * (rng() % (vocabSize - 3)) / (vocabSize - 3));
+	}
+	if (unknown) sent[1 + rng() % len] = 0;
+	sent.emplace_back(2);
+	return sent;
+}
+
+template<typename _WType>
+knlm::KNLangModel<_WType> reload(const knlm::KNLangModel<_WType>& mdl)
+{
+	ostringstream oss;
+	mdl.writeToStream(move(oss));
+	knlm::KNLangModel<_WType> ret;
+	ret.readFromStream(istringstream{ oss.str() });
+	return ret;
+}
+
+int main()
+{
+	typedef uint16_t WType;
+	const size_t vocabSize = 500;
+	mt19937_64 rng{ 7 };
+	knlm::KNLangModel<WType> trained{ 3 };
+	for (size_t i = 3; i < vocabSize; ++i) trained.getVocab().add("w" + to_string(i));
+	for (size_t i = 0; i < 20000; ++i)
+	{
+		auto sent = randomSentence<WType>(rng, vocabSize, false);
+		trained.trainSequence(sent.data(), sent.size());
+	}
+	trained.optimize();
+
+	ostringstream arpa;
+	trained.writeToArpa(arpa);
+	string data = arpa.str();
+	knlm::KNLangModel<WType> imported;
+	imported.readFromArpa(data.data(), data.size());
+
+	auto expected = reload(trained), actual = reload(imported);
+	size_t failures = 0;
+	for (size_t i = 0; i < 2000; ++i)
+	{
+		auto sent = randomSentence<WType>(rng, vocabSize, i % 2);
+		float e = expected.evaluateLLSent(sent.data(), sent.size());
+		float a = actual.evaluateLLSent(sent.data(), sent.size());
+		// both files quantize each likelihood to 1/4096, but from values differing in the last digits of ARPA
+		if (fabs(e - a) > 0.01f)
+		{
+			if (failures++ < 10) cerr << "sentence " << i << ": " << a << " instead of " << e << endl;
+		}
+	}
+	if (failures)
+	{
+		cerr << failures << " sentences scored differently" << endl;
+		return 1;
+	}
+	return 0;
+}
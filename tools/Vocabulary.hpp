@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "Vocab.hpp"
+
+/*
+Helpers of the command-line tools around the vocabulary stored in the model file.
+As in the Python module, every sentence is wrapped in ___BEG___ and ___END___ (ids 1 and 2).
+*/
+template<typename _WType, typename _Fn>
+std::vector<_WType> toSentence(const std::string& line, _Fn&& wordToId)
+{
+	std::vector<_WType> ret{ 1 };
+	std::istringstream iss{ line };
+	std::string w;
+	while (iss >> w) ret.emplace_back(wordToId(w));
+	ret.emplace_back(2);
+	return ret;
+}
+
+// the id of w, or of ___UNK___ (0) if it is unknown, as the Python module scores unknown words
+inline size_t findOrUnknown(const knlm::Vocab& vocab, const std::string& w)
+{
+	size_t id = vocab.find(w);
+	return id == knlm::Vocab::npos ? 0 : id;
+}
+
+// older tools wrote the vocabulary next to the model as `<path>.vocab`, one word per line, where the line number is the id
+inline void loadVocabFile(const std::string& path, knlm::Vocab& vocab)
+{
+	std::ifstream ifs{ path };
+	if (!ifs) throw std::runtime_error{ "cannot read " + path };
+	vocab.clear();
+	std::string w;
+	while (std::getline(ifs, w)) vocab.add(w);
+}
@@ -0,0 +1,159 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <limits>
+#include <memory>
+#include <iterator>
+#include "KNLangModel.hpp"
+#include "Vocabulary.hpp"
+
+using namespace std;
+
+static const char* usage =
+	"usage: knlm-build -o output [-n order] [-w width] [-t threads] [--sort-vocab] [--sort-nodes] [--profile file] [--import-arpa file] [--export-arpa file] [input files...]\n"
+	"trains a model from whitespace-separated sentences, one per line, read from the files or stdin.\n"
+	"writes output.mdl with its vocabulary. order defaults to 3 and the byte width of word ids (1, 2 or 4) to 4.\n"
+	"--sort-vocab numbers the words by frequency, which makes lookups faster and the model smaller.\n"
+	"--sort-nodes lays out the children of each node next to each other. with --profile, the nodes visited\n"
+	"by scoring the sentences of file come first as well, so that the queries like them touch fewer cache lines and pages.\n"
+	"--import-arpa builds the model from an ARPA file instead of training, with the order of the file.\n"
+	"--export-arpa also writes the model as an ARPA file. ARPA files are read and written on all cores unless -t is given.\n";
+
+struct Options
+{
+	string output, importArpa, exportArpa, profile;
+	size_t order = 3, width = 4, threads = 0;
+	bool sortVocab = false, sortNodes = false;
+	vector<string> inputs;
+};
+
+template<typename _WType>
+void train(knlm::KNLangModel<_WType>& mdl, const vector<string>& inputs, bool sortVocab)
+{
+	auto& vocab = mdl.getVocab();
+	size_t numSents = 0, numWords = 0;
+	auto read = [&](istream& is)
+	{
+		string line;
+		while (getline(is, line))
+		{
+			auto sent = toSentence<_WType>(line, [&](const string& w)
+			{
+				size_t id = vocab.find(w);
+				if (id != knlm::Vocab::npos) return id;
+				if (vocab.size() > numeric_limits<_WType>::max()) throw runtime_error{ "the vocabulary does not fit in the width of word ids. use a larger -w" };
+				return vocab.add(w);
+			});
+			if (sent.size() <= 2) continue;
+			mdl.trainSequence(sent.data(), sent.size());
+			numSents++;
+			numWords += sent.size() - 2;
+		}
+	};
+
+	if (inputs.empty()) read(cin);
+	for (auto& path : inputs)
+	{
+		ifstream ifs{ path };
+		if (!ifs) throw runtime_error{ "cannot read " + path };
+		read(ifs);
+	}
+	cerr << numSents << " sentences, " << numWords << " words, " << vocab.size() << " vocabs" << endl;
+	mdl.optimize(sortVocab);
+}
+
+template<typename _WType>
+void build(const Options& opt)
+{
+	// opened before training, so that an unwritable path fails at once
+	ofstream output{ opt.output + ".mdl", ios_base::binary };
+	if (!output) throw runtime_error{ "cannot write " + opt.output + ".mdl" };
+
+	knlm::KNLangModel<_WType> mdl{ opt.order };
+	if (opt.importArpa.empty()) train(mdl, opt.inputs, opt.sortVocab);
+	else
+	{
+		ifstream ifs{ opt.importArpa, ios_base::binary };
+		if (!ifs) throw runtime_error{ "cannot read " + opt.importArpa };
+		string data{ istreambuf_iterator<char>{ ifs }, istreambuf_iterator<char>{} };
+		mdl.readFromArpa(data.data(), data.size(), opt.threads);
+		cerr << "order " << mdl.getOrder() << ", " << mdl.getVocab().size() << " vocabs" << endl;
+	}
+	if (opt.sortNodes || !opt.profile.empty())
+	{
+		vector<vector<_WType>> profile;
+		if (!opt.profile.empty())
+		{
+			ifstream ifs{ opt.profile };
+			if (!ifs) throw runtime_error{ "cannot read " + opt.profile };
+			auto& vocab = mdl.getVocab();
+			string line;
+			// unknown words follow the nodes of ___UNK___, which scoring them visits as well
+			while (getline(ifs, line))
+			{
+				profile.emplace_back(toSentence<_WType>(line, [&](const string& w)
+				{
+					return findOrUnknown(vocab, w);
+				}));
+			}
+		}
+		mdl.reorderNodes(profile);
+	}
+
+	mdl.writeToStream(move(output));
+	if (!output.flush()) throw runtime_error{ "cannot write " + opt.output + ".mdl" };
+	if (!opt.exportArpa.empty())
+	{
+		ofstream ofs{ opt.exportArpa, ios_base::binary };
+		if (!ofs) throw runtime_error{ "cannot write " + opt.exportArpa };
+		mdl.writeToArpa(ofs, opt.threads);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options opt;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "-o" && i + 1 < argc) opt.output = argv[++i];
+		else if (arg == "-n" && i + 1 < argc) opt.order = stoul(argv[++i]);
+		else if (arg == "-w" && i + 1 < argc) opt.width = stoul(argv[++i]);
+		else if (arg == "-t" && i + 1 < argc) opt.threads = stoul(argv[++i]);
+		else if (arg == "--sort-vocab") opt.sortVocab = true;
+		else if (arg == "--sort-nodes") opt.sortNodes = true;
+		else if (arg == "--profile" && i + 1 < argc) opt.profile = argv[++i];
+		else if (arg == "--import-arpa" && i + 1 < argc) opt.importArpa = argv[++i];
+		else if (arg == "--export-arpa" && i + 1 < argc) opt.exportArpa = argv[++i];
+		else if (arg == "-h" || arg == "--help")
+		{
+			cout << usage;
+			return 0;
+		}
+		else opt.inputs.emplace_back(arg);
+	}
+	if (opt.output.empty() || opt.order < 2)
+	{
+		cerr << usage;
+		return 1;
+	}
+
+	try
+	{
+		switch (opt.width)
+		{
+		case 1: build<uint8_t>(opt); break;
+		case 2: build<uint16_t>(opt); break;
+		case 4: build<uint32_t>(opt); break;
+		default:
+			cerr << usage;
+			return 1;
+		}
+	}
+	catch (const exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,191 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include "KNLangModel.hpp"
+#include "Vocabulary.hpp"
+
+using namespace std;
+
+static const char* usage =
+	"usage: knlm-query -m model [-n order] [-f bits] [-t threads] [-e] [--min value] [input files...]\n"
+	"scores whitespace-separated sentences, one per line, read from the files or stdin, with model.mdl.\n"
+	"prints the log-likelihood of each sentence in input order, followed by those of each word and the end of sentence with -e.\n"
+	"the log-likelihood of a word is clamped to --min value (default -100). the perplexity is printed to stderr at the end.\n"
+	"-n reads the n-grams up to order only, which is quicker and smaller than the whole model.\n"
+	"-f builds Bloom filters of bits per n-gram (10 misses about 1 %), so that most n-grams missing from large maps are not searched.\n";
+
+struct Options
+{
+	string model;
+	size_t order = 0;
+	size_t filterBits = 0;
+	size_t threads = thread::hardware_concurrency();
+	bool eachWord = false;
+	float minValue = -100;
+	vector<string> inputs;
+};
+
+struct Totals
+{
+	size_t sents = 0, words = 0, oovs = 0;
+	double ll = 0;
+};
+
+template<typename _WType>
+void query(const Options& opt)
+{
+	knlm::KNLangModel<_WType> mdl;
+	mdl.readFromStream(ifstream{ opt.model + ".mdl", ios_base::binary }, opt.order);
+	auto& vocab = mdl.getVocab();
+	// models of older tools keep their vocabulary in model.vocab
+	if (vocab.size() <= 3) loadVocabFile(opt.model + ".vocab", vocab);
+	mdl.setFilterBits(opt.filterBits);
+
+	// lines are scored in chunks. the threads take blocks of a chunk in turn and the chunk is printed in order.
+	static const size_t chunkSize = 65536, blockSize = 256;
+	size_t numThreads = max(opt.threads, (size_t)1);
+	vector<string> lines, outputs;
+	vector<Totals> totals(numThreads);
+
+	auto scoreChunk = [&]()
+	{
+		outputs.assign(lines.size(), string{});
+		atomic<size_t> next{ 0 };
+		auto worker = [&](Totals& t)
+		{
+			vector<vector<_WType>> sents;
+			vector<const _WType*> ptrs;
+			vector<size_t> lens;
+			vector<float> scores;
+			for (size_t b; (b = next.fetch_add(blockSize)) < lines.size();)
+			{
+				size_t e = min(b + blockSize, lines.size());
+				sents.clear();
+				for (size_t i = b; i < e; ++i)
+				{
+					sents.emplace_back(toSentence<_WType>(lines[i], [&](const string& w)
+					{
+						size_t id = findOrUnknown(vocab, w);
+						if (!id) t.oovs++;
+						return id;
+					}));
+					t.words += sents.back().size() - 1;
+				}
+				t.sents += e - b;
+
+				ptrs.clear();
+				lens.clear();
+				for (auto& s : sents)
+				{
+					ptrs.emplace_back(s.data());
+					lens.emplace_back(s.size());
+				}
+				scores.resize(sents.size());
+				mdl.evaluateLLSentBatch(ptrs.data(), lens.data(), sents.size(), scores.data(), opt.minValue);
+
+				for (size_t i = b; i < e; ++i)
+				{
+					auto& s = sents[i - b];
+					t.ll += scores[i - b];
+					ostringstream oss;
+					oss << scores[i - b];
+					if (opt.eachWord)
+					{
+						auto each = mdl.evaluateLLEachWord(s.data(), s.size());
+						for (size_t j = 1; j < each.size(); ++j) oss << (j > 1 ? ' ' : '\t') << max(each[j], opt.minValue);
+					}
+					outputs[i] = oss.str();
+				}
+			}
+		};
+
+		vector<thread> workers;
+		for (size_t i = 1; i < numThreads; ++i) workers.emplace_back(worker, ref(totals[i]));
+		worker(totals[0]);
+		for (auto& w : workers) w.join();
+		for (auto& o : outputs) cout << o << '\n';
+		lines.clear();
+	};
+
+	auto read = [&](istream& is)
+	{
+		string line;
+		while (getline(is, line))
+		{
+			lines.emplace_back(move(line));
+			if (lines.size() >= chunkSize) scoreChunk();
+		}
+	};
+
+	if (opt.inputs.empty()) read(cin);
+	for (auto& path : opt.inputs)
+	{
+		ifstream ifs{ path };
+		if (!ifs) throw runtime_error{ "cannot read " + path };
+		read(ifs);
+	}
+	if (!lines.empty()) scoreChunk();
+	cout.flush();
+
+	Totals sum;
+	for (auto& t : totals)
+	{
+		sum.sents += t.sents;
+		sum.words += t.words;
+		sum.oovs += t.oovs;
+		sum.ll += t.ll;
+	}
+	// words counts the end of each sentence as well
+	cerr << sum.sents << " sentences, " << sum.words - sum.sents << " words, " << sum.oovs << " OOVs" << endl;
+	cerr << "ll: " << sum.ll << ", ppl: " << exp(-sum.ll / max(sum.words, (size_t)1)) << endl;
+}
+
+int main(int argc, char** argv)
+{
+	Options opt;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "-m" && i + 1 < argc) opt.model = argv[++i];
+		else if (arg == "-n" && i + 1 < argc) opt.order = stoul(argv[++i]);
+		else if (arg == "-f" && i + 1 < argc) opt.filterBits = stoul(argv[++i]);
+		else if (arg == "-t" && i + 1 < argc) opt.threads = stoul(argv[++i]);
+		else if (arg == "-e") opt.eachWord = true;
+		else if (arg == "--min" && i + 1 < argc) opt.minValue = stof(argv[++i]);
+		else if (arg == "-h" || arg == "--help")
+		{
+			cout << usage;
+			return 0;
+		}
+		else opt.inputs.emplace_back(arg);
+	}
+	if (opt.model.empty())
+	{
+		cerr << usage;
+		return 1;
+	}
+
+	try
+	{
+		ifstream ifs{ opt.model + ".mdl", ios_base::binary };
+		if (!ifs) throw runtime_error{ "cannot read " + opt.model + ".mdl" };
+		ifs.exceptions(istream::failbit | istream::badbit);
+		switch (knlm::readWordSize(ifs))
+		{
+		case 1: query<uint8_t>(opt); break;
+		case 2: query<uint16_t>(opt); break;
+		case 4: query<uint32_t>(opt); break;
+		default: throw runtime_error{ "unknown width of word ids" };
+		}
+	}
+	catch (const exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,410 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "KNLangModel.hpp"
+#include "ModelHandle.hpp"
+#include "BatchScorer.hpp"
+#include "Vocabulary.hpp"
+
+using namespace std;
+
+static const char* usage =
+	"usage: knlm-serve -m model (-s socket | -p port) [-n order] [-f bits] [-t threads] [-b batch] [--delay us] [--min value]\n"
+	"serves model.mdl, or the model image at model, which is mapped, over a Unix domain socket or a TCP port of localhost.\n"
+	"each request is a line of whitespace-separated words after a command, and gets a line in reply.\n"
+	"replies of a connection come in the order of its requests:\n"
+	"  S words...  the log-likelihood of the sentence\n"
+	"  E words...  the log-likelihoods of each word and of the end of the sentence\n"
+	"  N words...  the log-likelihood of each word after the context of the connection, which then includes it\n"
+	"  B           empties the context to the beginning of a sentence, replying OK\n"
+	"S and E requests of all connections are scored together, in batches of up to -b requests (default 64)\n"
+	"which wait --delay microseconds (default 1000) at most to fill up, on -t threads (default 1).\n"
+	"log-likelihoods are clamped to --min value (default -100), and failed requests reply ERR and the reason.\n"
+	"-n serves the n-grams up to order only. -f builds Bloom filters of bits per n-gram, which skip searches of missing n-grams.\n"
+	"SIGHUP reloads the model in the background.\n";
+
+struct Options
+{
+	string model, socket;
+	int port = 0;
+	size_t order = 0, filterBits = 0, threads = 1, batch = 64, delay = 1000;
+	float minValue = -100;
+};
+
+// the longest request line accepted
+static const size_t maxLine = 1 << 20;
+
+static volatile sig_atomic_t reloadRequested = 0, stopRequested = 0;
+
+struct Connection
+{
+	int fd;
+	string in, out;
+	// replies in the order of the requests, and whether each is ready. those of batched requests are filled by the scorer
+	deque<pair<bool, string>> replies;
+	// the number of the request of replies.front()
+	uint32_t firstReply = 0;
+	bool eof = false;
+	// the context of N requests, and the model it is a state of
+	shared_ptr<const knlm::IModel> model;
+	const void* state = nullptr;
+};
+
+template<typename _WType>
+const void* stepAs(const knlm::IModel* mdl, const void* state, uint32_t id, float& ll)
+{
+	typedef knlm::KNLangModel<_WType> Model;
+	auto* m = static_cast<const Model*>(mdl);
+	if (!state) state = m->getInitState();
+	return m->scoreNext((const typename Model::BakedNode*)state, id, ll);
+}
+
+// the state after id, from the state before the first word if state is null
+static const void* step(const knlm::IModel* mdl, const void* state, uint32_t id, float& ll)
+{
+	switch (mdl->getWordSize())
+	{
+	case 1: return stepAs<uint8_t>(mdl, state, id, ll);
+	case 2: return stepAs<uint16_t>(mdl, state, id, ll);
+	default: return stepAs<uint32_t>(mdl, state, id, ll);
+	}
+}
+
+static string formatLL(float ll)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.7g", ll);
+	return buf;
+}
+
+static int listenOn(const Options& opt)
+{
+	int fd;
+	if (!opt.socket.empty())
+	{
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (opt.socket.size() >= sizeof(addr.sun_path)) throw runtime_error{ "too long path of socket " + opt.socket };
+		strcpy(addr.sun_path, opt.socket.c_str());
+		// a socket left by an earlier server is replaced, but nothing else is
+		struct stat st;
+		if (stat(opt.socket.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(opt.socket.c_str());
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) throw runtime_error{ "cannot bind " + opt.socket + ": " + strerror(errno) };
+	}
+	else
+	{
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(opt.port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (fd < 0 || bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) throw runtime_error{ "cannot bind port " + to_string(opt.port) + ": " + strerror(errno) };
+	}
+	if (listen(fd, 128) < 0) throw runtime_error{ string{ "cannot listen: " } + strerror(errno) };
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static shared_ptr<knlm::IModel> loadServed(const Options& opt)
+{
+	string path = knlm::isModelImage(opt.model) ? opt.model : opt.model + ".mdl";
+	shared_ptr<knlm::IModel> mdl = knlm::loadModel(path, opt.order);
+	// models of older tools keep their vocabulary in model.vocab
+	if (mdl->getVocab().size() <= 3 && !mdl->getImage()) loadVocabFile(opt.model + ".vocab", mdl->getVocab());
+	if (opt.filterBits) mdl->setFilterBits(opt.filterBits);
+	return mdl;
+}
+
+static void onSignal(int sig)
+{
+	if (sig == SIGHUP) reloadRequested = 1;
+	else stopRequested = 1;
+}
+
+static void serve(const Options& opt)
+{
+	knlm::ModelHandle handle{ loadServed(opt) };
+	int listener = listenOn(opt), wake[2];
+	if (pipe(wake) < 0) throw runtime_error{ string{ "cannot make pipe: " } + strerror(errno) };
+	for (int fd : wake) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	mutex lock; // guards the connections and their replies
+	map<uint32_t, unique_ptr<Connection>> conns;
+	uint32_t nextConn = 0;
+
+	// tags of batched requests are the number of their connection and of the request in it
+	auto done = [&](vector<knlm::BatchScorer::Request>& batch)
+	{
+		{
+			lock_guard<mutex> guard{ lock };
+			for (auto& r : batch)
+			{
+				auto tag = (uint64_t)(uintptr_t)r.tag;
+				auto it = conns.find((uint32_t)(tag >> 32));
+				// the connection was closed meanwhile
+				if (it == conns.end()) continue;
+				auto& c = *it->second;
+				size_t n = (uint32_t)tag - c.firstReply;
+				if (n >= c.replies.size()) continue;
+				auto& reply = c.replies[n];
+				reply.first = true;
+				if (!r.error.empty()) reply.second = "ERR " + r.error;
+				else if (!r.eachWord) reply.second = formatLL(r.ll);
+				else for (size_t i = 1; i < r.lls.size(); ++i)
+				{
+					if (i > 1) reply.second += ' ';
+					reply.second += formatLL(max(r.lls[i], opt.minValue));
+				}
+			}
+		}
+		char b = 0;
+		if (write(wake[1], &b, 1) < 0) {} // the pipe is full, so the server wakes up anyway
+	};
+	knlm::BatchScorer scorer{ done, opt.batch, chrono::microseconds{ opt.delay }, opt.threads, opt.minValue };
+
+	auto handleLine = [&](uint32_t id, Connection& c, const string& line)
+	{
+		uint32_t seq = c.firstReply + (uint32_t)c.replies.size();
+		c.replies.emplace_back(true, string{});
+		auto& reply = c.replies.back().second;
+		istringstream iss{ line };
+		string cmd, w;
+		iss >> cmd;
+		try
+		{
+			if (cmd == "S" || cmd == "E")
+			{
+				knlm::BatchScorer::Request req;
+				req.model = handle.get();
+				auto& vocab = req.model->getVocab();
+				getline(iss, w);
+				req.seq = toSentence<uint32_t>(w, [&](const string& w)
+				{
+					return findOrUnknown(vocab, w);
+				});
+				req.eachWord = cmd == "E";
+				req.tag = (void*)(uintptr_t)(((uint64_t)id << 32) | seq);
+				c.replies.back().first = false;
+				scorer.submit(move(req));
+			}
+			else if (cmd == "N")
+			{
+				if (!c.model) c.model = handle.get();
+				auto& vocab = c.model->getVocab();
+				float ll;
+				if (!c.state) c.state = step(c.model.get(), nullptr, 1, ll);
+				while (iss >> w)
+				{
+					c.state = step(c.model.get(), c.state, findOrUnknown(vocab, w), ll);
+					if (!reply.empty()) reply += ' ';
+					reply += formatLL(max(ll, opt.minValue));
+				}
+			}
+			else if (cmd == "B")
+			{
+				// the context starts over on the model served now
+				c.model.reset();
+				c.state = nullptr;
+				reply = "OK";
+			}
+			else reply = "ERR unknown command " + cmd;
+		}
+		catch (const exception& e)
+		{
+			c.replies.back() = make_pair(true, "ERR " + string{ e.what() });
+		}
+	};
+
+	auto flush = [&](Connection& c)
+	{
+		while (!c.replies.empty() && c.replies.front().first)
+		{
+			c.out += c.replies.front().second;
+			c.out += '\n';
+			c.replies.pop_front();
+			c.firstReply++;
+		}
+		while (!c.out.empty())
+		{
+			ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+			if (n <= 0)
+			{
+				// the peer is gone, so nothing more is read nor written
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+				c.eof = true;
+				c.out.clear();
+				c.replies.clear();
+				break;
+			}
+			c.out.erase(0, n);
+		}
+	};
+
+	cerr << "serving " << opt.model << " on " << (opt.socket.empty() ? "port " + to_string(opt.port) : opt.socket) << endl;
+	vector<pollfd> fds;
+	vector<uint32_t> ids;
+	char buf[65536];
+	while (!stopRequested)
+	{
+		if (reloadRequested)
+		{
+			reloadRequested = 0;
+			thread{ [&opt, handle]() mutable
+			{
+				try
+				{
+					handle.set(loadServed(opt));
+					cerr << "reloaded " << opt.model << endl;
+				}
+				catch (const exception& e)
+				{
+					cerr << "reload failed: " << e.what() << endl;
+				}
+			} }.detach();
+		}
+
+		fds.assign({ pollfd{ listener, POLLIN, 0 }, pollfd{ wake[0], POLLIN, 0 } });
+		ids.clear();
+		{
+			lock_guard<mutex> guard{ lock };
+			for (auto& p : conns)
+			{
+				short events = (p.second->eof ? 0 : POLLIN) | (p.second->out.empty() ? 0 : POLLOUT);
+				fds.emplace_back(pollfd{ p.second->fd, events, 0 });
+				ids.emplace_back(p.first);
+			}
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			throw runtime_error{ string{ "poll failed: " } + strerror(errno) };
+		}
+
+		lock_guard<mutex> guard{ lock };
+		if (fds[1].revents) while (read(wake[0], buf, sizeof(buf)) > 0);
+		if (fds[0].revents & POLLIN)
+		{
+			int fd;
+			while ((fd = accept(listener, nullptr, nullptr)) >= 0)
+			{
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				unique_ptr<Connection> c{ new Connection };
+				c->fd = fd;
+				conns.emplace(nextConn++, move(c));
+			}
+		}
+		for (size_t i = 0; i < ids.size(); ++i)
+		{
+			if (!(fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			auto& c = *conns[ids[i]];
+			ssize_t n;
+			while ((n = recv(c.fd, buf, sizeof(buf), 0)) > 0) c.in.append(buf, n);
+			if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) c.eof = true;
+
+			size_t b = 0;
+			for (size_t e; (e = c.in.find('\n', b)) != string::npos; b = e + 1)
+			{
+				size_t len = e - b;
+				if (len && c.in[e - 1] == '\r') --len;
+				handleLine(ids[i], c, c.in.substr(b, len));
+			}
+			c.in.erase(0, b);
+			if (c.in.size() > maxLine)
+			{
+				c.replies.emplace_back(true, "ERR too long request");
+				c.in.clear();
+				c.eof = true;
+			}
+		}
+		for (auto it = conns.begin(); it != conns.end();)
+		{
+			auto& c = *it->second;
+			flush(c);
+			// a connection closed by its peer is kept until the replies to its requests are sent
+			if (c.eof && c.replies.empty() && c.out.empty())
+			{
+				close(c.fd);
+				it = conns.erase(it);
+			}
+			else ++it;
+		}
+	}
+
+	close(listener);
+	if (!opt.socket.empty()) unlink(opt.socket.c_str());
+	lock_guard<mutex> guard{ lock };
+	for (auto& p : conns) close(p.second->fd);
+	conns.clear();
+}
+
+int main(int argc, char** argv)
+{
+	Options opt;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "-m" && i + 1 < argc) opt.model = argv[++i];
+		else if (arg == "-s" && i + 1 < argc) opt.socket = argv[++i];
+		else if (arg == "-p" && i + 1 < argc) opt.port = stoi(argv[++i]);
+		else if (arg == "-n" && i + 1 < argc) opt.order = stoul(argv[++i]);
+		else if (arg == "-f" && i + 1 < argc) opt.filterBits = stoul(argv[++i]);
+		else if (arg == "-t" && i + 1 < argc) opt.threads = stoul(argv[++i]);
+		else if (arg == "-b" && i + 1 < argc) opt.batch = stoul(argv[++i]);
+		else if (arg == "--delay" && i + 1 < argc) opt.delay = stoul(argv[++i]);
+		else if (arg == "--min" && i + 1 < argc) opt.minValue = stof(argv[++i]);
+		else if (arg == "-h" || arg == "--help")
+		{
+			cout << usage;
+			return 0;
+		}
+		else
+		{
+			cerr << usage;
+			return 1;
+		}
+	}
+	if (opt.model.empty() || opt.socket.empty() == !opt.port)
+	{
+		cerr << usage;
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onSignal;
+	sigaction(SIGHUP, &sa, nullptr);
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	try
+	{
+		serve(opt);
+	}
+	catch (const exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}